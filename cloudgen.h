@@ -12,14 +12,48 @@ extern "C" {
      single-precision is sufficiently accurate. */
 #include <complex.h>
 #include <fftw3.h>
+#ifdef CG_ENABLE_MPI
+#include <mpi.h>
+#include <fftw3-mpi.h>
+#endif
 
 #include "config.h"
 
 #define CG_MAX_VARS 16
+
+/* Number of values in the blocks passed to the vectorised kernels */
+#define CG_BLOCK 256
+
+  /* How hard FFTW should work to find fast plans for the Fourier
+     transforms, in order of increasing planning time. Anything other
+     than CG_PLAN_ESTIMATE benefits from a wisdom file; see
+     cg_import_wisdom(). */
+  typedef enum {
+    CG_PLAN_ESTIMATE = 0,
+    CG_PLAN_MEASURE,
+    CG_PLAN_PATIENT,
+    CG_PLAN_EXHAUSTIVE
+  } cg_planner_effort;
   
+  /* Fourier transform plans shared between fields of the same shape */
+  struct cg_plan_set;
+
+  /* Random number generator state, from random.h */
+  struct random_state;
+
+  /* Table of the horizontal wavenumbers of a field, from
+     cloudgen_spectrum.c */
+  struct cg_plane_table;
+
+  /* Table of the logarithm of the horizontal wavenumbers of a field,
+     from cloudgen_layers.c */
+  struct cg_slope_table;
+
   /* This structure contains the cloud field information */
   typedef struct {
+    struct cg_plan_set *plans;  /* Reference to the shared plans below */
     fftw_plan fft_plan;         /* The initial inverse 3D transform */
+    fftw_plan fft_plan_z;       /* Its vertical part on its own */
     fftw_plan fft_plan_2d_1;    /* The forward 2D transforms */
     fftw_plan fft_plan_2d_2;    /* The inverse 2D transforms */
     complex *p[CG_MAX_VARS];    /* Fourier components (size (nx/2+1)*ny*nz) */
@@ -29,9 +63,58 @@ extern "C" {
     real dx, dy, dz;    /* pixels sizes */
     real dkx, dky, dkz; /* wavenumber intervals */
     int nx, ny, nz;     /* number of pixels in the x, y and z directions */
+    int local_nz;       /* number of layers held by this process */
+    int z_start;        /* index of the first layer held by this process */
+    int distributed;    /* 1 if the layers are spread over MPI ranks */
+#ifdef CG_ENABLE_MPI
+    MPI_Comm comm;      /* communicator of a distributed field */
+#endif
     int nvars;
+    int nthreads;       /* number of threads used by the FFTW plans
+			   and the OpenMP loops */
+    cg_planner_effort effort; /* planner effort used for the FFTW plans */
+    struct random_state *random; /* generator of the random phases, or
+				    NULL for the default one */
+    struct cg_plane_table *plane_table; /* distinct horizontal wavenumbers
+					   and amplitudes of the spectrum,
+					   built on first use */
+    struct cg_slope_table *slope_table; /* log wavenumbers beyond the
+					   outer scale, built on first
+					   use */
   } cg_field;
+
+  /* A radial spectrum: the amplitude of the Fourier components as a
+     function of the squared wavenumber kk = kx^2+ky^2+kz^2 only. It
+     is either the piecewise power law of cg_power_law() or
+     interpolated from a table. */
+  typedef struct {
+    int tabulated;      /* 0 for a power law, 1 for a table */
+    complex factor;     /* Multiplies every amplitude */
+    real slope, outer_slope; /* Power law: slopes */
+    real kk_I, kk_II, kk_III; /* Power law: scale breaks (in kk) */
+    real coefft_I, coefft_II, coefft_III, coefft_IV; /* Power law */
+    int n;              /* Table: number of points */
+    real *log_k;        /* Table: log of wavenumber (cycles per m) */
+    real *log_amplitude; /* Table: log of amplitude */
+  } cg_spectrum;
   
+  /* How cg_finish_output() transforms each variable */
+  typedef enum {
+    CG_OUTPUT_AS_IS = 0,
+    CG_OUTPUT_SCALE,
+    CG_OUTPUT_LOGNORMAL
+  } cg_output_transform;
+
+  /* What cg_finish_output() does to each variable of a field */
+  typedef struct {
+    cg_output_transform transform[CG_MAX_VARS];
+    real *std[CG_MAX_VARS];   /* One element per layer of the domain */
+    real *mean[CG_MAX_VARS];  /* One element per layer of the domain */
+    const double *power[CG_MAX_VARS]; /* One per local layer, or NULL */
+    int threshold_var;        /* Variable to threshold, or -1 for none */
+    real threshold, missing_value;
+  } cg_output;
+
   /* FUNCTIONS IN cloudgen_core.c */
   /* The same memory is used to store the data at different stages of
      the processing, so it is important that the functions are called
@@ -40,7 +123,9 @@ extern "C" {
   /* Create a cloudgen field, set the size of the cloud fields to
      generate, and allocate the various arrays that are
      required. Returns NULL if there is a problem allocating the
-     memory. */
+     memory. The Fourier transform plans are shared with any other
+     field of the same shape, number of threads and planner effort,
+     and are destroyed with the last such field. */
   cg_field *cg_new_multi_field(int nx, int ny, int nz,
 			       real dx, real dy, real dz,
 			       real x_offset, real y_offset, real z_offset,
@@ -48,6 +133,88 @@ extern "C" {
 #define cg_new_field(nx, ny, nz, dx, dy, dz, x_offset, y_offset, z_offset) \
   cg_new_multi_field(nx, ny, nz, dx, dy, dz, x_offset, y_offset, z_offset, 1)
 
+  /* As cg_new_multi_field(), but the Fourier transforms are planned
+     to run on "nthreads" threads. FFTW's thread support is
+     initialised on the first call. If the library was built without
+     threads, or nthreads is less than 2, the plans are
+     single-threaded. If the library was built with OpenMP, the other
+     loops over the layers are also shared between "nthreads"
+     threads, apart from the drawing of the random phases. */
+  cg_field *cg_new_threaded_field(int nx, int ny, int nz,
+				  real dx, real dy, real dz,
+				  real x_offset, real y_offset, real z_offset,
+				  int nvars, int nthreads);
+
+  /* As cg_new_threaded_field(), but the Fourier transforms are
+     planned with the given planner effort. */
+  cg_field *cg_new_planned_field(int nx, int ny, int nz,
+				 real dx, real dy, real dz,
+				 real x_offset, real y_offset, real z_offset,
+				 int nvars, int nthreads,
+				 cg_planner_effort effort);
+
+  /* As cg_new_planned_field(), but the field only holds the
+     local_nz layers starting at layer z_start of an nx by ny by nz
+     domain, as a distributed field would. There is no 3D transform,
+     so cg_generate_fractal() may not be used; the layer functions
+     below work as normal. Changing z_start afterwards moves the
+     window through the domain, and local_nz may be reduced for a
+     window at the top of the domain, although the layer transforms
+     still act on as many layers as the field was created with. */
+  cg_field *cg_new_window_field(int nx, int ny, int nz,
+				real dx, real dy, real dz,
+				real x_offset, real y_offset, real z_offset,
+				int nvars, int nthreads,
+				cg_planner_effort effort,
+				int z_start, int local_nz);
+
+#ifdef CG_ENABLE_MPI
+  /* As cg_new_planned_field(), but the field is split into slabs of
+     whole layers across the ranks of comm, each rank holding
+     field->local_nz layers starting at field->z_start. The arrays
+     p, field, kx, ky, kz, x, y and z keep their meaning, except that
+     p and field only hold the local layers, which is all the
+     functions below operate on; arrays with one element per layer
+     still cover all nz layers. Must be called
+     collectively on comm after MPI_Init(). Ranks may hold no layers
+     if nz is not much larger than the number of ranks. */
+  cg_field *cg_new_distributed_field(int nx, int ny, int nz,
+				     real dx, real dy, real dz,
+				     real x_offset, real y_offset,
+				     real z_offset, int nvars, int nthreads,
+				     cg_planner_effort effort, MPI_Comm comm);
+
+  /* As cg_import_wisdom(), but the wisdom is read by rank 0 of comm
+     and broadcast to the other ranks. Must be called collectively. */
+  int cg_import_wisdom_mpi(const char *file_name, MPI_Comm comm);
+
+  /* As cg_export_wisdom(), but the wisdom of all the ranks of comm is
+     gathered and written by rank 0. Must be called collectively. */
+  int cg_export_wisdom_mpi(const char *file_name, MPI_Comm comm);
+#endif
+
+  /* Return the FFTW planner flags corresponding to effort, for
+     planning other transforms consistently with a field's. */
+  unsigned int cg_planner_flags(cg_planner_effort effort);
+
+  /* Lock and unlock the FFTW planner, which like the plans shared
+     between fields belongs to the whole process. Other code that
+     creates or destroys FFTW plans while fields may be created from
+     other threads must do so between these calls. Without
+     CG_ENABLE_REENTRANT they do nothing. */
+  void cg_lock_planner(void);
+  void cg_unlock_planner(void);
+
+  /* Load FFTW wisdom accumulated by previous runs from file_name, so
+     that plans of the same shape are found without measuring. Call
+     before creating any fields. Returns 1 on success and 0 if the
+     file could not be read. */
+  int cg_import_wisdom(const char *file_name);
+
+  /* Save all the FFTW wisdom accumulated so far to file_name. Returns
+     1 on success and 0 on failure. */
+  int cg_export_wisdom(const char *file_name);
+
 
   /* Set the mean spectral energy density - a power law with a scale
      break at outer_scale, a slope of "slope" at small scales and
@@ -64,18 +231,91 @@ extern "C" {
   /* Set a phase of 1+0i */
   void cg_unity_phase(cg_field *field, int ivar);
 
+  /* Draw the random phases of field from state rather than the
+     default generator of random.h, or from the default one again if
+     state is NULL. The state is not copied and must outlive its use
+     by field. Fields with their own states can be generated at the
+     same time from different threads. */
+  void cg_set_random_state(cg_field *field, struct random_state *state);
+
+  /* Return the generator the random phases of field are drawn from */
+  struct random_state *cg_random_state(const cg_field *field);
+
   /* Convert mean spectral energies into Fourier coefficients with a
-     random phase, derived by calls to gaussian_deviate(). */
+     random phase, derived by calls to random_gaussian_deviate() for
+     the generator of the field, or from the counter-based generator
+     if chosen with cg_select_field_counter_phases() or
+     cg_select_counter_phases(). */
   void cg_random_phase(cg_field *field, int ivar);
   
   void cg_correlated_phase(cg_field *field, int ivar, int iorig,
 			   real correlation);
 
+  /* Draw the random phases from the counter-based generator of
+     random.h, seeded by seed, if use_counter is non-zero, or by calls
+     to gaussian_deviate() otherwise. Each phase of the counter-based
+     generator depends only on the seed, the variable and the position
+     of the coefficient in the whole field, so the phases are the same
+     for any number of threads or processes and may be drawn in
+     parallel. This only sets the default generator, which fields
+     given their own by cg_set_random_state() do not use; see
+     cg_select_field_counter_phases() for those. */
+  void cg_select_counter_phases(int use_counter, unsigned int seed);
+
+  /* Return 1 if the default generator is counter-based and 0
+     otherwise */
+  int cg_counter_phases(void);
+
+  /* As cg_select_counter_phases(), but for the generator of field,
+     which is the default one unless field has its own */
+  void cg_select_field_counter_phases(cg_field *field, int use_counter,
+				      unsigned int seed);
+
+  /* Return 1 if the generator of field is counter-based and 0
+     otherwise */
+  int cg_field_counter_phases(const cg_field *field);
+
+  /* Set the n random phases of variable ivar from the counter-based
+     generator of field, starting with Fourier coefficient index of
+     the whole field, numbered as in a field held by a single
+     process */
+  void cg_counter_phase_values(const cg_field *field, complex *phase,
+			       int ivar, long int index, long int n);
+
+  /* Set the n random phases from the next 2n Gaussian deviates of the
+     sequential generator of field */
+  void cg_next_phase_values(const cg_field *field, complex *phase,
+			    long int n);
+
+  /* As cg_random_phase() followed by cg_apply_spectrum(), but in a
+     single pass over the Fourier components. Returns 1 on success
+     and 0 if out of memory. */
+  int cg_random_spectrum(cg_field *field, int ivar,
+			 const cg_spectrum *spectrum);
+
+  /* As cg_random_phase() for iorig and cg_correlated_phase() for
+     ivar, followed by cg_apply_spectrum() with orig_spectrum for
+     iorig and spectrum for ivar, but in a single pass over the
+     Fourier components of each variable. Returns 1 on success and 0
+     if out of memory. */
+  int cg_correlated_spectra(cg_field *field, int iorig, int ivar,
+			    real correlation,
+			    const cg_spectrum *orig_spectrum,
+			    const cg_spectrum *spectrum);
+
   /* Perform inverse 3D Fourier transform to generate initial
      isotropic fractal field. The result is held in field as well as
      being returned. */
   real *cg_generate_fractal(cg_field *field);
 
+  /* As cg_generate_fractal() followed by cg_transform_layers(), but
+     only the inverse transform along z is performed, which saves a
+     2D transform in each direction for every layer. Agrees with the
+     full round trip to rounding error. Returns 0, leaving the field
+     untouched, if the field is distributed over MPI ranks, in which
+     case the full round trip must be used, and 1 otherwise. */
+  int cg_generate_layers(cg_field *field);
+
   /* Replace all values below threshold with missing_value */
   void cg_threshold(cg_field *field, int ivar,
 		    real threshold, real missing_value);
@@ -115,6 +355,12 @@ extern "C" {
      the field. */
   void cg_transform_layers(cg_field *field);
 
+  /* Bring layers that are in horizontal Fourier space after only the
+     vertical part of the inverse 3D transform to the state that
+     cg_transform_layers() would leave the full transform in. Called
+     by cg_generate_layers() and cg_stream_layers_window(). */
+  void cg_finish_layers(cg_field *field);
+
   /* Interpolate array "param", consisting of "n" floating point
      values at heights "height" on to the heights in "field". At
      heights outsight "height" the extreme values of "param" are
@@ -142,7 +388,10 @@ extern "C" {
   /* At each height in the field, change the slope of the power
      spectrum at scales smaller than outer_scale. The original slope
      is provided in old_slope and the new in the array new_slope,
-     which should have field->nz elements. */
+     which should have field->nz elements. The components are
+     multiplied by the exponential of the change in slope times the
+     logarithm of the wavenumber, kept in field->slope_table, which
+     may differ from pow() in the last bits. */
   void cg_change_slope_layers(cg_field *field, int ivar,
 			      real outer_scale,
 			      real *new_slope, real old_slope);
@@ -155,6 +404,19 @@ extern "C" {
 					  real outer_scale,
 					  real *new_slope, real old_slope,
 					  real *deltax, real *deltay);
+
+  /* Free the table cg_change_slope_layers() keeps in
+     field->slope_table, which cg_delete_field() does; it is built
+     again when needed. */
+  void cg_delete_slope_table(cg_field *field);
+
+  /* Store in power[k] the mean square that local layer k of variable
+     ivar will have after cg_revert_layers(), found from its 2D
+     Fourier components with Parseval's theorem, so that the layers
+     need not be read again in real space. "power" should have
+     field->local_nz elements. */
+  void cg_layer_powers(cg_field *field, int ivar, double *power);
+
   /* Perform inverse 2D Fourier transform on each horizontal layer to
      revert to real space. */
   void cg_revert_layers(cg_field *field);
@@ -173,7 +435,230 @@ extern "C" {
      the final field. */
   void cg_lognormal_layers(cg_field *field, int ivar, real *std, real *mean);
 
-  
+  /* As cg_scale_layers() and cg_lognormal_layers(), but with the mean
+     square of each local layer given in "power", as from
+     cg_layer_powers(), making a single pass that only writes to the
+     field. If power is NULL it is calculated from the field. */
+  void cg_scale_layers_power(cg_field *field, int ivar,
+			     real *std, real *mean, const double *power);
+  void cg_lognormal_layers_power(cg_field *field, int ivar,
+				 real *std, real *mean, const double *power);
+
+  /* Finish the local layers of every variable for output in a single
+     pass: each variable is scaled as by cg_scale_layers_power() or
+     cg_lognormal_layers_power(), or left as it is, according to
+     "output", then thresholded as by cg_threshold() if
+     output->threshold_var is not negative, and finally the padding
+     at the end of each row is removed. Afterwards the nx*ny values of
+     layer k are contiguous from cg_output_layer(field, ivar, k), and
+     only cg_output_layer() should be used to access them. */
+  void cg_finish_output(cg_field *field, const cg_output *output);
+
+  /* Return the start of local layer k of variable ivar */
+  real *cg_output_layer(cg_field *field, int ivar, int k);
+
+  /* Move the layers packed by cg_finish_output() together, so that
+     the local layers of each variable are contiguous from
+     field->field[ivar], as cg_squeeze() would leave them, ready to
+     be written in one go. cg_output_layer() may not be used
+     afterwards. */
+  void cg_join_layers(cg_field *field);
+
+  /* Finish local layers k_begin to k_end-1 as cg_finish_output()
+     does, then move them to where cg_join_layers() would, so that
+     they are ready to be written while the layers after them are
+     finished. The layers before k_begin must already have been
+     finished and moved this way. */
+  void cg_finish_join_layers(cg_field *field, const cg_output *output,
+			     int k_begin, int k_end);
+
+
+  /* FUNCTIONS IN cloudgen_spectrum.c */
+
+  /* Create the spectrum applied by cg_power_law(), except that the
+     factor is 1: a power law with a scale break at outer_scale, a
+     slope of "slope" at small scales and "outer_slope" at large
+     scales, for the wavenumbers of field. Returns NULL if out of
+     memory. */
+  cg_spectrum *cg_new_power_law_spectrum(cg_field *field, real outer_scale,
+					 real slope, real outer_slope);
+
+  /* Create a spectrum from n values of the mean spectral energy
+     density of the Fourier components, "energy", at strictly
+     increasing wavenumbers "wavenumber" (cycles per metre), both
+     positive. The amplitude is the square root of the energy,
+     interpolated linearly in log-log space and extrapolated beyond
+     the ends of the table. Returns NULL if the table is invalid or
+     out of memory. */
+  cg_spectrum *cg_new_tabulated_spectrum(int n, const real *wavenumber,
+					 const real *energy);
+
+  /* Free a spectrum */
+  void cg_delete_spectrum(cg_spectrum *spectrum);
+
+  /* Return the amplitude of the spectrum at squared wavenumber kk,
+     not including the factor. */
+  real cg_spectrum_amplitude(const cg_spectrum *spectrum, real kk);
+
+  /* Multiply the Fourier components of variable ivar by the amplitude
+     of the spectrum and its factor, and set the mean to zero. The
+     amplitudes are tabulated exactly for the distinct wavenumbers of
+     the field rather than evaluated for every component. */
+  void cg_apply_spectrum(cg_field *field, int ivar,
+			 const cg_spectrum *spectrum);
+
+  /* Fill the local layers of variable ivar with random phases from
+     the generator of the field multiplied by the amplitude of the
+     spectrum, in one pass and with a zero mean. The random numbers
+     are drawn for these layers only, in order, so the caller is
+     responsible for those of any other layers. If ikeep is not
+     negative then the raw phases are also stored in variable ikeep.
+     If there is not enough memory to tabulate the amplitudes they are
+     evaluated for every component instead, so 1 is always
+     returned. */
+  int cg_synthesize_layers(cg_field *field, int ivar, int ikeep,
+			   const cg_spectrum *spectrum);
+
+  /* Replace the raw phases of another variable, stored in ivar by
+     cg_synthesize_layers(), with phases correlated with them as in
+     cg_correlated_phase(), multiplied by the amplitude of the
+     spectrum, in one pass. Random numbers are drawn as by
+     cg_synthesize_layers() unless correlation is at least 1, and
+     likewise 1 is always returned. */
+  int cg_correlate_layers(cg_field *field, int ivar, real correlation,
+			  const cg_spectrum *spectrum);
+
+  /* Free the table the functions above keep in field->plane_table,
+     which cg_delete_field() does; it is built again when needed. */
+  void cg_delete_plane_table(cg_field *field);
+
+
+  /* FUNCTIONS IN cloudgen_simd.c */
+
+  /* The kernels below are implemented for SSE2, AVX2 and AVX-512 as
+     well as in plain C, and the best supported by the processor is
+     chosen when first used. Every implementation gives the same
+     bits. */
+
+  /* Choose the instruction set of the kernels: "auto" (the best
+     supported), "generic", "sse2", "avx2" or "avx512". Returns 1 on
+     success and 0 if it is unknown or not supported. */
+  int cg_select_simd(const char *name);
+
+  /* Return the name of the instruction set of the kernels */
+  const char *cg_simd_name(void);
+
+  /* Return the sum of the squares of n values */
+  double cg_sum_squares(const real *data, long int n);
+
+  /* Replace each of n values x by x*scale + offset */
+  void cg_scale_values(real *data, long int n, real scale, real offset);
+
+  /* Multiply each of n values by the corresponding factor */
+  void cg_multiply_values(real *data, const real *factor, long int n);
+
+  /* Multiply each of n complex values by the corresponding factor */
+  void cg_multiply_complex_values(complex *data, const complex *factor,
+				  long int n);
+
+  /* Replace each of n values x by exp(x*pre_scale) * post_scale */
+  void cg_lognormal_values(real *data, long int n, real pre_scale,
+			   real post_scale);
+
+  /* Replace each of n values x by exp(x). The exponential is
+     computed by the vectorised kernels, within 1.5 ulp of the
+     exact result; arguments below -708 (-86.5 in single precision),
+     whose exponentials are near the smallest normal number, give 0.
+     The C library's exp() is used instead if chosen with
+     cg_select_libm_exp() or by default if built with CG_LIBM_EXP. */
+  void cg_exp_values(real *data, long int n);
+
+  /* Replace n pairs of uniform deviates, x in (0,1] and y in [0,1),
+     by the Gaussian deviates sqrt(-2 ln x) cos(2 pi y) and
+     sqrt(-2 ln x) sin(2 pi y) of the Box-Muller transform, within a
+     few ulp of the exact results; x must not be subnormal. Unlike
+     cg_exp_values(), this never uses the C library, so that the
+     deviates are the same whatever the options. */
+  void cg_gaussian_values(real *x, real *y, long int n);
+
+  /* Use the C library's exp() if use_libm is non-zero, or the
+     vectorised exponential otherwise */
+  void cg_select_libm_exp(int use_libm);
+
+  /* Return 1 if the C library's exp() is in use and 0 otherwise */
+  int cg_libm_exp(void);
+
+  /* Set n values of each of nvars variables to missing_value where
+     those of variable ivar are below threshold */
+  void cg_threshold_values(real **data, int nvars, int ivar, long int n,
+			   real threshold, real missing_value);
+
+
+  /* FUNCTIONS IN cloudgen_stream.c */
+
+  /* A field generated out of core: the spectrum and the intermediate
+     results are kept in a scratch file, and only a window of layers
+     and a set of vertical pencils are held in memory at a time. */
+  typedef struct {
+    cg_field *window;   /* The layers currently in memory */
+    int nlayers;        /* Layers in each window but the last */
+    int nwindows;       /* Number of windows covering the domain */
+    int iwindow;        /* Index of the window in memory, or -1 */
+    int pencil_ny;      /* Rows in each pencil of vertical transforms */
+    FILE *scratch;      /* Scratch file holding the whole field */
+  } cg_stream;
+
+  /* Create a field to be generated out of core, with peak memory of
+     roughly memory_budget bytes regardless of the size of the
+     domain: about half of it for the window of layers and half for
+     the pencils. The window holds as many layers as fit, and each
+     pencil as many rows, apart from the last window or pencil, which
+     may hold fewer, and
+     window->z, x and y cover the whole domain so that the vertical
+     profiles can be interpolated as for a normal field. The scratch
+     file is created at scratch_file, or as a temporary file if this
+     is NULL, and removed when the stream is deleted. Returns NULL if
+     not even a single layer fits in the budget or the scratch file
+     cannot be created. */
+  cg_stream *cg_new_stream(int nx, int ny, int nz,
+			   real dx, real dy, real dz,
+			   real x_offset, real y_offset, real z_offset,
+			   int nvars, int nthreads, cg_planner_effort effort,
+			   size_t memory_budget, const char *scratch_file);
+
+  /* Free the window and close the scratch file */
+  void cg_delete_stream(cg_stream *stream);
+
+  /* Generate the spectrum of every variable with random phases and
+     the given spectrum, as cg_random_phase(), cg_correlated_phase()
+     with variable 0 as the original and cg_apply_spectrum() would,
+     and perform the vertical part of the inverse 3D transform. The
+     random numbers are drawn in the same order as for a field held
+     in memory. Returns 1 on success and 0 on failure. */
+  int cg_stream_generate(cg_stream *stream, const cg_spectrum *spectrum,
+			 real correlation);
+
+  /* Load window iwindow of the fractal, as cg_generate_fractal()
+     would leave those layers, and return the window field, or NULL
+     if iwindow is beyond the last window or on error. The layer
+     functions may then be applied to the window before it is saved
+     with cg_stream_store_window(). */
+  cg_field *cg_stream_fractal_window(cg_stream *stream, int iwindow);
+
+  /* As cg_stream_fractal_window() followed by cg_transform_layers()
+     on the window, as cg_generate_layers() is for a field in
+     memory. */
+  cg_field *cg_stream_layers_window(cg_stream *stream, int iwindow);
+
+  /* Save the layers of the window in memory as the final result for
+     those layers. Returns 1 on success and 0 on failure. */
+  int cg_stream_store_window(cg_stream *stream);
+
+  /* Load window iwindow of the final result, as saved by
+     cg_stream_store_window(), and return the window field, or NULL
+     if iwindow is beyond the last window or on error. */
+  cg_field *cg_stream_result_window(cg_stream *stream, int iwindow);
+
 #ifdef __cplusplus
 }                               /* extern "C" */
 #endif                          /* __cplusplus */
@@ -8,115 +8,428 @@
 #include "cloudgen.h"
 #include "random.h"
 
-#define PI 3.14159265358979323846
+#ifdef CG_ENABLE_REENTRANT
+#include <pthread.h>
 
-/* Logarithm of the Gamma function, adapted from Numerical Recipies */
+/* FFTW's planner, its wisdom and the plan cache below are shared by
+   the whole process, so only one thread may use them at a time */
+static pthread_mutex_t planner_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+/* Take the lock on the FFTW planner */
+void
+cg_lock_planner(void)
+{
+#ifdef CG_ENABLE_REENTRANT
+  pthread_mutex_lock(&planner_lock);
+#endif
+}
+
+/* Release the lock on the FFTW planner */
+void
+cg_unlock_planner(void)
+{
+#ifdef CG_ENABLE_REENTRANT
+  pthread_mutex_unlock(&planner_lock);
+#endif
+}
+
+#ifdef CG_ENABLE_THREADS
+/* Initialise FFTW's thread support, returning 1 on success. This
+   only needs to be done once per process, with the planner locked. */
 static
-float
-gammaln(float xx)
+int
+init_fftw_threads(void)
 {
-  double x, tmp, ser;
-  static double cof[6] = {76.18009173, -86.50532033, 24.01409822,
-			  -1.231739516, 0.120858003e-2, -0.536382e-5};
-  int j;
-  x = xx-1.0;
-  tmp = x+5.5;
-  tmp -= (x+0.5) * log(tmp);
-  ser = 1.0;
-  for (j = 0; j <= 5; j++) {
-    x += 1.0;
-    ser += cof[j]/x;
+  static int initialised = 0;
+  if (!initialised) {
+    initialised = fftw_init_threads();
   }
-  return -tmp+log(2.50662827465*ser);
+  return initialised;
 }
+#endif
 
+#ifdef CG_ENABLE_MPI
+/* Initialise FFTW's MPI support (after its thread support, if
+   any). This only needs to be done once per process, with the planner
+   locked. */
+static
+void
+init_fftw_mpi(void)
+{
+  static int initialised = 0;
+  if (!initialised) {
+#ifdef CG_ENABLE_THREADS
+    init_fftw_threads();
+#endif
+    fftw_mpi_init();
+    initialised = 1;
+  }
+}
+#endif
 
 /* Create a cloudgen field, set the size of the cloud fields to
    generate, and allocate the various arrays that are
    required. Returns NULL if there is a problem allocating the
-h   memory. */
+   memory. */
 cg_field *
 cg_new_multi_field(int nx, int ny, int nz,
 		   real dx, real dy, real dz,
 		   real x_offset, real y_offset, real z_offset,
 		   int nvars)
 {
-  cg_field *field;
-  real *kx, *ky, *kz;
-  real *x, *y, *z;
-  real dkx, dky, dkz; /* x and y wavenumber intervals */
-  int i;
+  return cg_new_threaded_field(nx, ny, nz, dx, dy, dz,
+			       x_offset, y_offset, z_offset, nvars, 1);
+}
 
-  /* We are generating a matrix of real numbers, so the length of the
-     arrays is slightly larger than half that which would be required
-     for a full complex fft. */
-  long int len = (nx/2+1) * ny * nz;
-  
+/* Convert a planner effort into the corresponding FFTW flag */
+unsigned int
+cg_planner_flags(cg_planner_effort effort)
+{
+  switch (effort) {
+  case CG_PLAN_MEASURE:
+    return FFTW_MEASURE;
+  case CG_PLAN_PATIENT:
+    return FFTW_PATIENT;
+  case CG_PLAN_EXHAUSTIVE:
+    return FFTW_EXHAUSTIVE;
+  default:
+    return FFTW_ESTIMATE;
+  }
+}
+
+/* Load FFTW wisdom from file_name. Returns 1 on success and 0 on
+   failure. */
+int
+cg_import_wisdom(const char *file_name)
+{
+  int status;
+  if (!file_name) {
+    return 0;
+  }
+  cg_lock_planner();
+  status = fftw_import_wisdom_from_filename(file_name);
+  cg_unlock_planner();
+  return status;
+}
+
+/* Save the accumulated FFTW wisdom to file_name. Returns 1 on success
+   and 0 on failure. */
+int
+cg_export_wisdom(const char *file_name)
+{
+  int status;
+  if (!file_name) {
+    return 0;
+  }
+  cg_lock_planner();
+  status = fftw_export_wisdom_to_filename(file_name);
+  cg_unlock_planner();
+  return status;
+}
+
+#ifdef CG_ENABLE_MPI
+/* Load FFTW wisdom on rank 0 of comm and share it with the other
+   ranks. Returns 1 on success and 0 on failure on every rank. */
+int
+cg_import_wisdom_mpi(const char *file_name, MPI_Comm comm)
+{
+  int rank, status = 0;
+  MPI_Comm_rank(comm, &rank);
+  if (rank == 0) {
+    status = cg_import_wisdom(file_name);
+  }
+  MPI_Bcast(&status, 1, MPI_INT, 0, comm);
+  cg_lock_planner();
+  init_fftw_mpi();
+  fftw_mpi_broadcast_wisdom(comm);
+  cg_unlock_planner();
+  return status;
+}
+
+/* Gather the FFTW wisdom of all the ranks of comm and save it from
+   rank 0. Returns 1 on success and 0 on failure on every rank. */
+int
+cg_export_wisdom_mpi(const char *file_name, MPI_Comm comm)
+{
+  int rank, status = 0;
+  MPI_Comm_rank(comm, &rank);
+  cg_lock_planner();
+  init_fftw_mpi();
+  fftw_mpi_gather_wisdom(comm);
+  cg_unlock_planner();
+  if (rank == 0) {
+    status = cg_export_wisdom(file_name);
+  }
+  MPI_Bcast(&status, 1, MPI_INT, 0, comm);
+  return status;
+}
+#endif
+
+/* As cg_new_multi_field(), but with the Fourier transforms planned
+   for nthreads threads. */
+cg_field *
+cg_new_threaded_field(int nx, int ny, int nz,
+		      real dx, real dy, real dz,
+		      real x_offset, real y_offset, real z_offset,
+		      int nvars, int nthreads)
+{
+  return cg_new_planned_field(nx, ny, nz, dx, dy, dz,
+			      x_offset, y_offset, z_offset, nvars,
+			      nthreads, CG_PLAN_ESTIMATE);
+}
+
+/* The Fourier transform plans only depend on the shape of the field,
+   the number of threads and the planner effort, and are executed on
+   each field's arrays with the new-array interface. They are
+   therefore kept in a process-wide, reference-counted cache so that
+   fields of the same shape share one set of plans. The cache is only
+   used with the planner locked. */
+struct cg_plan_set {
+  int nx, ny, nz;
+  int local_nz, z_start;        /* layers of a distributed field */
+  int distributed;
+#ifdef CG_ENABLE_MPI
+  MPI_Comm comm;
+#endif
+  int precision;                /* sizeof(real) */
+  int nthreads;
+  cg_planner_effort effort;
+  int count;                    /* number of fields using the plans */
+  fftw_plan fft_plan;
+  fftw_plan fft_plan_z;
+  fftw_plan fft_plan_2d_1;
+  fftw_plan fft_plan_2d_2;
+  struct cg_plan_set *next;
+};
+
+static struct cg_plan_set *plan_cache = NULL;
+
+/* Return a set of plans for the shape of field, creating them from
+   the arrays of field if no matching set exists. The 3D plan, and
+   for a field held by one process the 1D plan along z, are only
+   created if need_3d is set. Returns NULL if the plans could not be
+   created. Must be called with the planner locked. */
+static
+struct cg_plan_set *
+acquire_plans(cg_field *field, unsigned int flags, int need_3d)
+{
+  struct cg_plan_set *plans;
+  int nx = field->nx;
+  int ny = field->ny;
+  int nz = field->nz;
+  int local_nz = field->local_nz;
   int planar_rank = 2;
   int planar_shape[] = {ny, nx};
   int planar_size_c = ny * (nx/2 + 1);
   int planar_size_r = ny * 2 * (nx / 2 + 1);
+  int need_z = need_3d && !field->distributed;
 
-  /* Check range of nvars */
-  if (nvars < 1 || nvars > CG_MAX_VARS) {
+  for (plans = plan_cache; plans; plans = plans->next) {
+    if (plans->nx == nx && plans->ny == ny && plans->nz == nz
+	&& plans->local_nz == local_nz && plans->z_start == field->z_start
+	&& plans->distributed == field->distributed
+#ifdef CG_ENABLE_MPI
+	&& (!plans->distributed || plans->comm == field->comm)
+#endif
+	&& plans->precision == (int) sizeof(real)
+	&& plans->nthreads == field->nthreads
+	&& plans->effort == field->effort
+	&& (plans->fft_plan || !need_3d)) {
+      plans->count++;
+      return plans;
+    }
+  }
+
+  plans = malloc(sizeof(struct cg_plan_set));
+  if (!plans) {
     return NULL;
   }
 
-  /* Allocate memory for field structure */
-  field = malloc(sizeof(cg_field));
-  if (!field) {
-    /* Out of memory */
+#ifdef CG_ENABLE_THREADS
+  fftw_plan_with_nthreads(field->nthreads);
+#endif
+  plans->fft_plan = plans->fft_plan_z = NULL;
+  if (need_3d) {
+#ifdef CG_ENABLE_MPI
+    if (field->distributed) {
+      plans->fft_plan = fftw_mpi_plan_dft_c2r_3d(nz, ny, nx, field->p[0],
+						 field->field[0],
+						 field->comm, flags);
+    }
+    else
+#endif
+    plans->fft_plan = fftw_plan_dft_c2r_3d(nz, ny, nx, field->p[0],
+					   field->field[0], flags);
+  }
+  if (need_z) {
+    /* The vertical part of the 3D transform on its own, leaving each
+       layer in horizontal Fourier space */
+    plans->fft_plan_z = fftw_plan_many_dft(1, &nz, planar_size_c,
+					   field->p[0], NULL, planar_size_c, 1,
+					   field->p[0], NULL, planar_size_c, 1,
+					   FFTW_BACKWARD, flags);
+  }
+  /* The layer transforms only act on the local layers, of which a
+     rank of a distributed field may have none */
+  plans->fft_plan_2d_1 = plans->fft_plan_2d_2 = NULL;
+  if (local_nz > 0) {
+    plans->fft_plan_2d_1 = fftw_plan_many_dft_r2c(planar_rank, planar_shape,
+					local_nz,
+					field->field[0], NULL, 1, planar_size_r,
+					field->p[0], NULL, 1, planar_size_c,
+					flags);
+    plans->fft_plan_2d_2 = fftw_plan_many_dft_c2r(planar_rank, planar_shape,
+					local_nz,
+					field->p[0], NULL, 1, planar_size_c,
+					field->field[0], NULL, 1, planar_size_r,
+					flags);
+  }
+
+  if ((need_3d && !plans->fft_plan) || (need_z && !plans->fft_plan_z)
+      || (local_nz > 0 && (!plans->fft_plan_2d_1 || !plans->fft_plan_2d_2))) {
+    /* Out of memory or incorrect arguments to the planner */
+    if (plans->fft_plan) {
+      fftw_destroy_plan(plans->fft_plan);
+    }
+    if (plans->fft_plan_z) {
+      fftw_destroy_plan(plans->fft_plan_z);
+    }
+    if (plans->fft_plan_2d_1) {
+      fftw_destroy_plan(plans->fft_plan_2d_1);
+    }
+    if (plans->fft_plan_2d_2) {
+      fftw_destroy_plan(plans->fft_plan_2d_2);
+    }
+    free(plans);
     return NULL;
   }
 
+  plans->nx = nx;
+  plans->ny = ny;
+  plans->nz = nz;
+  plans->local_nz = local_nz;
+  plans->z_start = field->z_start;
+  plans->distributed = field->distributed;
+#ifdef CG_ENABLE_MPI
+  plans->comm = field->comm;
+#endif
+  plans->precision = sizeof(real);
+  plans->nthreads = field->nthreads;
+  plans->effort = field->effort;
+  plans->count = 1;
+  plans->next = plan_cache;
+  plan_cache = plans;
+  return plans;
+}
+
+/* Release a set of plans obtained from acquire_plans(), destroying
+   them when the last field using them has gone. */
+static
+void
+release_plans(struct cg_plan_set *plans)
+{
+  struct cg_plan_set **link;
+  if (!plans) {
+    return;
+  }
+  cg_lock_planner();
+  if (--(plans->count) > 0) {
+    cg_unlock_planner();
+    return;
+  }
+  for (link = &plan_cache; *link; link = &((*link)->next)) {
+    if (*link == plans) {
+      *link = plans->next;
+      break;
+    }
+  }
+  if (plans->fft_plan) {
+    fftw_destroy_plan(plans->fft_plan);
+  }
+  if (plans->fft_plan_z) {
+    fftw_destroy_plan(plans->fft_plan_z);
+  }
+  if (plans->fft_plan_2d_1) {
+    fftw_destroy_plan(plans->fft_plan_2d_1);
+  }
+  if (plans->fft_plan_2d_2) {
+    fftw_destroy_plan(plans->fft_plan_2d_2);
+  }
+  cg_unlock_planner();
+  free(plans);
+}
+
+/* Allocate the arrays and plans of a field whose local layers have
+   already been set, each variable holding len complex values. The 3D
+   transform is only planned if need_3d is set. Frees field and
+   returns NULL on failure. */
+static
+cg_field *
+setup_field(cg_field *field, int nx, int ny, int nz,
+	    real dx, real dy, real dz,
+	    real x_offset, real y_offset, real z_offset,
+	    int nvars, int nthreads, cg_planner_effort effort,
+	    long int len, int need_3d)
+{
+  real *kx, *ky, *kz;
+  real *x, *y, *z;
+  real dkx, dky, dkz; /* x and y wavenumber intervals */
+  int i;
+
+  field->nx = nx;
+  field->ny = ny;
+  field->nz = nz;
+
   field->nvars = nvars;
   for (i = 0; i < nvars; i++) {
-    int j;
     /* Allocate memory for the Fourier components */
     field->p[i] = fftw_malloc(len * sizeof(complex));
     if (!field->p[i]) {
       /* Out of memory */
-      for (j = 0; j < i; j++) {
-	free(field->p[j]);
-      }
-      free(field);
+      cg_delete_field(field);
       return NULL;
     }
     /* We are using `in place' fftw functions, so the output field
        occupies the same memory as the input */
     field->field[i] = (real *) field->p[i];
   }
-  for (i = nvars; i < CG_MAX_VARS; i++) {
-    field->field[i] = NULL;
-    field->p[i] = NULL;
-  }
 
-  fftw_plan fft_plan = fftw_plan_dft_c2r_3d(nz, ny, nx, field->p[0], field->field[0], FFTW_ESTIMATE);
-  fftw_plan fft_plan_2d_1 = fftw_plan_many_dft_r2c(planar_rank, planar_shape, nz,
-                                            field->field[0], NULL, 1, planar_size_r,
-                                            field->p[0], NULL, 1, planar_size_c,
-                                            FFTW_ESTIMATE);
-  fftw_plan fft_plan_2d_2 = fftw_plan_many_dft_c2r(planar_rank, planar_shape, nz,
-                                            field->p[0], NULL, 1, planar_size_c,
-                                            field->field[0], NULL, 1, planar_size_r,
-                                            FFTW_ESTIMATE);
+  if (nthreads < 1) {
+    nthreads = 1;
+  }
+  cg_lock_planner();
+#ifdef CG_ENABLE_THREADS
+  if (!init_fftw_threads()) {
+    /* Fall back to single-threaded plans */
+    nthreads = 1;
+  }
+#endif
+  field->nthreads = nthreads;
+  field->effort = effort;
 
-  if (!fft_plan || !fft_plan_2d_1 || !fft_plan_2d_2) {
-    /* Out of memory or incorrect arguments to fftw_create_plan */
+  field->plans = acquire_plans(field, cg_planner_flags(effort), need_3d);
+  cg_unlock_planner();
+  if (!field->plans) {
+    cg_delete_field(field);
     return NULL;
   }
+  field->fft_plan = field->plans->fft_plan;
+  field->fft_plan_z = field->plans->fft_plan_z;
+  field->fft_plan_2d_1 = field->plans->fft_plan_2d_1;
+  field->fft_plan_2d_2 = field->plans->fft_plan_2d_2;
 
   /* Allocate memory for x and y wavenumbers */
-  kx = malloc(nx * sizeof(real));
-  ky = malloc(ny * sizeof(real));
-  kz = malloc(nz * sizeof(real));
-  x = malloc(nx * sizeof(real));
-  y = malloc(ny * sizeof(real));
-  z = malloc(nz * sizeof(real));
+  field->kx = kx = malloc(nx * sizeof(real));
+  field->ky = ky = malloc(ny * sizeof(real));
+  field->kz = kz = malloc(nz * sizeof(real));
+  field->x = x = malloc(nx * sizeof(real));
+  field->y = y = malloc(ny * sizeof(real));
+  field->z = z = malloc(nz * sizeof(real));
 
   if (!kx || !ky || !kz || !x || !y || !z) {
     /* Out of memory */
-    fftw_free(field);
+    cg_delete_field(field);
     return NULL;
   }
 
@@ -155,29 +468,124 @@ cg_new_multi_field(int nx, int ny, int nz,
     kz[i] = -(nz-i) * dkz;
   }
 
-  field->fft_plan = fft_plan;
-  field->fft_plan_2d_1 = fft_plan_2d_1;
-  field->fft_plan_2d_2 = fft_plan_2d_2;
-
-  field->kx = kx;
-  field->ky = ky;
-  field->kz = kz;
-  field->x = x;
-  field->y = y;
-  field->z = z;
   field->dx = dx;
   field->dy = dy;
   field->dz = dz;
   field->dkx = dkx;
   field->dky = dky;
   field->dkz = dkz;
-  field->nx = nx;
-  field->ny = ny;
-  field->nz = nz;
 
   return field;
 }
 
+/* As cg_new_threaded_field(), but with the Fourier transforms planned
+   with the given effort. */
+cg_field *
+cg_new_planned_field(int nx, int ny, int nz,
+		     real dx, real dy, real dz,
+		     real x_offset, real y_offset, real z_offset,
+		     int nvars, int nthreads, cg_planner_effort effort)
+{
+  cg_field *field;
+
+  /* We are generating a matrix of real numbers, so the length of the
+     arrays is slightly larger than half that which would be required
+     for a full complex fft. */
+  long int len = (long int) (nx/2+1) * ny * nz;
+
+  /* Check range of nvars */
+  if (nvars < 1 || nvars > CG_MAX_VARS) {
+    return NULL;
+  }
+
+  /* Allocate memory for field structure */
+  field = calloc(1, sizeof(cg_field));
+  if (!field) {
+    /* Out of memory */
+    return NULL;
+  }
+  field->local_nz = nz;
+  field->z_start = 0;
+  field->distributed = 0;
+
+  return setup_field(field, nx, ny, nz, dx, dy, dz,
+		     x_offset, y_offset, z_offset, nvars, nthreads, effort,
+		     len, 1);
+}
+
+/* As cg_new_planned_field(), but only holding local_nz layers
+   starting at z_start, and without the 3D transform. */
+cg_field *
+cg_new_window_field(int nx, int ny, int nz,
+		    real dx, real dy, real dz,
+		    real x_offset, real y_offset, real z_offset,
+		    int nvars, int nthreads, cg_planner_effort effort,
+		    int z_start, int local_nz)
+{
+  cg_field *field;
+  long int len = (long int) (nx/2+1) * ny * local_nz;
+
+  if (nvars < 1 || nvars > CG_MAX_VARS
+      || local_nz < 1 || z_start < 0 || z_start + local_nz > nz) {
+    return NULL;
+  }
+
+  field = calloc(1, sizeof(cg_field));
+  if (!field) {
+    return NULL;
+  }
+  field->local_nz = local_nz;
+  field->z_start = z_start;
+  field->distributed = 0;
+
+  return setup_field(field, nx, ny, nz, dx, dy, dz,
+		     x_offset, y_offset, z_offset, nvars, nthreads, effort,
+		     len, 0);
+}
+
+#ifdef CG_ENABLE_MPI
+/* As cg_new_planned_field(), but with the layers split into slabs
+   across the ranks of comm. */
+cg_field *
+cg_new_distributed_field(int nx, int ny, int nz,
+			 real dx, real dy, real dz,
+			 real x_offset, real y_offset, real z_offset,
+			 int nvars, int nthreads, cg_planner_effort effort,
+			 MPI_Comm comm)
+{
+  cg_field *field;
+  ptrdiff_t local_n0, local_0_start;
+  long int len;
+
+  if (nvars < 1 || nvars > CG_MAX_VARS) {
+    return NULL;
+  }
+
+  field = calloc(1, sizeof(cg_field));
+  if (!field) {
+    return NULL;
+  }
+  /* FFTW decides how the layers are distributed, and may need a
+     little more memory than the local layers for the transposes */
+  cg_lock_planner();
+  init_fftw_mpi();
+  len = fftw_mpi_local_size_3d(nz, ny, nx/2+1, comm,
+			       &local_n0, &local_0_start);
+  cg_unlock_planner();
+  if (len < 1) {
+    len = 1;
+  }
+  field->local_nz = local_n0;
+  field->z_start = local_0_start;
+  field->distributed = 1;
+  field->comm = comm;
+
+  return setup_field(field, nx, ny, nz, dx, dy, dz,
+		     x_offset, y_offset, z_offset, nvars, nthreads, effort,
+		     len, 1);
+}
+#endif
+
 /* Free all the memory allocated in field */
 void
 cg_delete_field(cg_field *field)
@@ -186,23 +594,20 @@ cg_delete_field(cg_field *field)
   if (!field) {
     return;
   }
-  if (field->fft_plan) {
-    fftw_destroy_plan(field->fft_plan);
-  }
+  release_plans(field->plans);
+  cg_delete_plane_table(field);
+  cg_delete_slope_table(field);
   for (i = 0; i < field->nvars; i++) {
     if (field->p[i]) {
       fftw_free(field->p[i]);
     }
   }
-  if (field->kx) {
-    free(field->kx);
-  }
-  if (field->ky) {
-    free(field->ky);
-  }
-  if (field->kz) {
-    free(field->kz);
-  }
+  free(field->kx);
+  free(field->ky);
+  free(field->kz);
+  free(field->x);
+  free(field->y);
+  free(field->z);
   free(field);
 }
 
@@ -211,8 +616,9 @@ cg_delete_last_variable(cg_field *field)
 {
   int i = field->nvars-1;
   if (i >= 0 && field->p[i]) {
-    free(field->p[i]);
+    fftw_free(field->p[i]);
     field->p[i] = NULL;
+    field->field[i] = NULL;
   }
   --(field->nvars);
 }
@@ -224,57 +630,14 @@ void
 cg_power_law(cg_field *field, int ivar, real outer_scale,
 	     real slope, real outer_slope)
 {
-  complex *p = field->p[ivar];
-  real *kx = field->kx;
-  real *ky = field->ky;
-  real *kz = field->kz;
-  real dkx = field->dkx;
-  real dkz = field->dkz;
-  real max_kx = field->nx * dkx *0.5;
-  int i, j, k;
-  int nx = field->nx;
-  int ny = field->ny;
-  int nz = field->nz;
-  /* Locations of scale breaks: note that we use k^2 rather than k for
-     efficiency */
-  real gamma_factor = dkz * exp(gammaln(-0.5*slope)-gammaln(0.5-0.5*slope));
-  real kk_I = 1./(outer_scale * outer_scale);
-  real kk_II =  gamma_factor*gamma_factor * slope*slope * 0.25 / PI;
-  real kk_III = max_kx * max_kx * 2 * (-slope) / PI;
-  /* Coefficients: note that we are working in amplitude not frequency
-     space, leading to the square-roots */
-  real coefft_II = sqrt(1/(gamma_factor * sqrt(PI)));
-  real coefft_I = coefft_II * pow(kk_I, (slope-outer_slope-1)*0.25);
-  real coefft_III = sqrt(-0.5 * slope / PI);
-  real coefft_IV = sqrt(0.25 / (max_kx * max_kx));
-
-  for (k = 0; k < nz; k++) {
-    for (j = 0; j < ny; j++) {
-      for (i = 0; i < (nx/2+1); i++) {
-	real kk = kx[i]*kx[i] + ky[j]*ky[j] + kz[k]*kz[k];
-	real value;
-	complex *target = &(p[i + (nx/2+1)*(j + ny*k)]);
-	if (kk < kk_I) {
-	  /* Region I: outer scale */
-	  value = coefft_I * pow(kk, outer_slope*0.25);
-	}
-	else if (kk < kk_II) {
-	  /* Region II: quasi-2D behaviour (x-y) */
-	  value = coefft_II * pow(kk, (slope-1)*0.25);
-	}
-	else if (kk < kk_III) {
-	  /* Region III: 3D behaviour */
-	  value = coefft_III * pow(kk, (slope-2)*0.25);
-	}
-	else {
-	  /* Region IV: quasi-1D behaviour (z) */
-	  value = coefft_IV * pow(kk, slope*0.25);
-	}
-	*target *= value + value * I;
-      }
-    }
+  cg_spectrum *spectrum = cg_new_power_law_spectrum(field, outer_scale,
+						    slope, outer_slope);
+  if (!spectrum) {
+    return;
   }
-  *p = 0.0 + 0.0 * I;
+  spectrum->factor = 1.0 + 1.0 * I;
+  cg_apply_spectrum(field, ivar, spectrum);
+  cg_delete_spectrum(spectrum);
 }
 
 /* Set the mean spectral energy density - a power law with a scale
@@ -284,75 +647,16 @@ void
 cg_power_laws(cg_field *field, real outer_scale,
 	      real *slope, real *outer_slope)
 {
-  complex **p = field->p;
-  real *kx = field->kx;
-  real *ky = field->ky;
-  real *kz = field->kz;
-  real dkx = field->dkx;
-  real dkz = field->dkz;
-  real max_kx = field->nx * dkx *0.5;
-  int i, j, k, n;
-  int nx = field->nx;
-  int ny = field->ny;
-  int nz = field->nz;
-
-  real gamma_factor[CG_MAX_VARS];
-  real kk_I;
-  real kk_II[CG_MAX_VARS];
-  real kk_III[CG_MAX_VARS];
-  real coefft_I[CG_MAX_VARS];
-  real coefft_II[CG_MAX_VARS];
-  real coefft_III[CG_MAX_VARS];
-  real coefft_IV;
-
-  kk_I = 1./(outer_scale * outer_scale);
+  int n;
   for (n = 0; n < field->nvars; n++) {
-    /* Locations of scale breaks: note that we use k^2 rather than k for
-       efficiency */
-    gamma_factor[n] = dkz * exp(gammaln(-0.5*slope[n])
-				-gammaln(0.5-0.5*slope[n]));
-    kk_II[n] =  gamma_factor[n]*gamma_factor[n] 
-      * slope[n]*slope[n] * 0.25 / PI;
-    kk_III[n] = -slope[n] * max_kx * max_kx * 2 / PI;
-    /* Coefficients: note that we are working in amplitude not frequency
-       space, leading to the square-roots */
-    coefft_II[n] = sqrt(1/(gamma_factor[n] * sqrt(PI)));
-    coefft_I[n] = coefft_II[n]
-      * pow(kk_I, (slope[n]-outer_slope[n]-1)*0.25);
-    coefft_III[n] = sqrt(-0.5 * slope[n] / PI);
-  }
-  coefft_IV = sqrt(0.25 / (max_kx * max_kx));
-
-  for (k = 0; k < nz; k++) {
-    for (j = 0; j < ny; j++) {
-      for (i = 0; i < (nx/2+1); i++) {
-	real kk = kx[i]*kx[i] + ky[j]*ky[j] + kz[k]*kz[k];
-	real value;
-	int index = i + (nx/2+1)*(j + ny*k);
-	for (n = 0; n < field->nvars; n++) {
-	  if (kk < kk_I) {
-	    /* Region I: outer scale */
-	    value = coefft_I[n] * pow(kk, outer_slope[n]*0.25);
-	  }
-	  else if (kk < kk_II[n]) {
-	    /* Region II: quasi-2D behaviour (x-y) */
-	    value = coefft_II[n] * pow(kk, (slope[n]-1)*0.25);
-	  }
-	  else if (kk < kk_III[n]) {
-	    /* Region III: 3D behaviour */
-	    value = coefft_III[n] * pow(kk, (slope[n]-2)*0.25);
-	  }
-	  else {
-	    /* Region IV: quasi-1D behaviour (z) */
-	    value = coefft_IV * pow(kk, slope[n]*0.25);
-	  }
-	  p[n][index] *= value;
-	}
-      }
+    cg_spectrum *spectrum = cg_new_power_law_spectrum(field, outer_scale,
+						      slope[n],
+						      outer_slope[n]);
+    if (!spectrum) {
+      return;
     }
-  }
-  for (n = 0; n < field->nvars; n++) {
-    p[n][0] = 0.0 + 0.0 * I;
+    cg_apply_spectrum(field, n, spectrum);
+    cg_delete_spectrum(spectrum);
   }
 }
 
@@ -363,30 +667,221 @@ cg_unity_phase(cg_field *field, int ivar)
 {
   complex *p = field->p[ivar];
   long int n;
-  long int len = (field->nx/2+1) * field->ny * field->nz;
-  p[0] = 0.0 + 0.0 * I;
+  long int len = (field->nx/2+1) * field->ny * field->local_nz;
 
-  for (n = 1; n < len; n++) {
+  for (n = 0; n < len; n++) {
     p[n] = 1.0 + 0.0 * I;
   }
+  if (field->z_start == 0 && len > 0) {
+    p[0] = 0.0 + 0.0 * I;
+  }
+}
+
+/* Draw the random phases of field from state */
+void
+cg_set_random_state(cg_field *field, struct random_state *state)
+{
+  field->random = state;
+}
+
+/* Return the generator of the random phases of field */
+struct random_state *
+cg_random_state(const cg_field *field)
+{
+  return field->random ? field->random : default_random_state();
+}
+
+/* Choose between the sequential and the counter-based generator */
+void
+cg_select_counter_phases(int use_counter, unsigned int seed)
+{
+  select_counter_generator(default_random_state(), use_counter, seed);
+}
+
+/* Return 1 if the phases come from the counter-based generator */
+int
+cg_counter_phases(void)
+{
+  return default_random_state()->counter;
+}
+
+/* Choose between the generators for the state of field */
+void
+cg_select_field_counter_phases(cg_field *field, int use_counter,
+			       unsigned int seed)
+{
+  select_counter_generator(cg_random_state(field), use_counter, seed);
+}
+
+/* Return 1 if the phases of field come from the counter-based
+   generator */
+int
+cg_field_counter_phases(const cg_field *field)
+{
+  return cg_random_state(field)->counter;
+}
+
+/* Set the n phases of variable ivar starting at coefficient index of
+   the whole field from the counter-based generator, a block at a
+   time: the random bits of the block are converted into uniform
+   deviates and these into Gaussian deviates by the vectorised
+   Box-Muller transform */
+void
+cg_counter_phase_values(const cg_field *field, complex *phase, int ivar,
+			long int index, long int n)
+{
+  unsigned int key = counter_key(cg_random_state(field)->counter_seed,
+				 ivar);
+  unsigned int first[CG_BLOCK], second[CG_BLOCK];
+  real rr[CG_BLOCK], ii[CG_BLOCK];
+  const real scale = 1.0/4294967296.0, half = 0.5;
+  long int i, m, len;
+  for (i = 0; i < n; i += len) {
+    len = n - i < CG_BLOCK ? n - i : CG_BLOCK;
+    counter_random_bits(key, index + i, len, first, second);
+    for (m = 0; m < len; m++) {
+      /* rr in (0,1] so that its logarithm is finite */
+      rr[m] = ((real) first[m] + half) * scale;
+      ii[m] = (real) second[m] * scale;
+    }
+    cg_gaussian_values(rr, ii, len);
+    for (m = 0; m < len; m++) {
+      phase[i+m] = rr[m] + ii[m] * I;
+    }
+  }
+}
+
+/* Set n phases from the sequential generator of field, drawing the
+   deviates a block at a time */
+void
+cg_next_phase_values(const cg_field *field, complex *phase, long int n)
+{
+  random_state *state = cg_random_state(field);
+  float deviates[2*CG_BLOCK];
+  long int i, m, len;
+  for (i = 0; i < n; i += len) {
+    len = n - i < CG_BLOCK ? n - i : CG_BLOCK;
+    random_gaussian_deviates(state, 2*len, deviates);
+    for (m = 0; m < len; m++) {
+      real rr = deviates[2*m], ii = deviates[2*m+1];
+      phase[i+m] = rr + ii * I;
+    }
+  }
+}
+
+/* Discard n Gaussian deviates of state, so that the layers of a
+   distributed field receive the same random numbers as they would in
+   a field held by a single process. The counter-based generator needs
+   no skipping. */
+static
+void
+skip_gaussian_deviates(random_state *state, long int n)
+{
+  float deviates[2*CG_BLOCK];
+  if (state->counter) {
+    return;
+  }
+  for (; n > 0; n -= 2*CG_BLOCK) {
+    random_gaussian_deviates(state, n < 2*CG_BLOCK ? n : 2*CG_BLOCK,
+			     deviates);
+  }
 }
 
 /* Convert mean spectral energies into Fourier coefficients with a
-   random phase, derived by calls to gaussian_deviate(). */
+   random phase, derived from the generator of the field. */
 void
 cg_random_phase(cg_field *field, int ivar)
 {
+  random_state *state = cg_random_state(field);
   complex *p = field->p[ivar];
-  long int n;
-  long int len = (field->nx/2+1) * field->ny * field->nz;
-  real rr, ii;
+  long int plane = (field->nx/2+1) * field->ny;
+  long int len = plane * field->local_nz;
+  long int offset = plane * field->z_start;
+  long int first = offset > 0 ? offset : 1;
+  long int end = offset+len > first ? offset+len : first;
+
+  if (state->counter) {
+    int k;
+#pragma omp parallel for num_threads(field->nthreads) schedule(static)
+    for (k = 0; k < field->local_nz; k++) {
+      cg_counter_phase_values(field, p + plane*k, ivar, offset + plane*k,
+			      plane);
+    }
+  }
+  else {
+    skip_gaussian_deviates(state, 2*(first-1));
+    if (len > first-offset) {
+      cg_next_phase_values(field, p + first-offset, len - (first-offset));
+    }
+    skip_gaussian_deviates(state, 2*(plane*field->nz - end));
+  }
+
+  if (offset == 0 && len > 0) {
+    p[0] = 0.0 + 0.0 * I;
+  }
+}
+
+/* Draw random phases for variable ivar, in the same order as
+   cg_random_phase(), and apply the spectrum in the same pass. If
+   ikeep is not negative, the raw phases are also kept in variable
+   ikeep. */
+static
+int
+random_spectrum(cg_field *field, int ivar, int ikeep,
+		const cg_spectrum *spectrum)
+{
+  random_state *state = cg_random_state(field);
+  long int plane = (field->nx/2+1) * field->ny;
+  long int len = plane * field->local_nz;
+  long int offset = plane * field->z_start;
+  long int first = offset > 0 ? offset : 1;
+  long int end = offset+len > first ? offset+len : first;
+  int status;
+
+  skip_gaussian_deviates(state, 2*(first-1));
+  status = cg_synthesize_layers(field, ivar, ikeep, spectrum);
+  skip_gaussian_deviates(state, 2*(plane*field->nz - end));
+  return status;
+}
+
+/* As cg_random_phase() followed by cg_apply_spectrum(), but in a
+   single pass over the Fourier components. */
+int
+cg_random_spectrum(cg_field *field, int ivar, const cg_spectrum *spectrum)
+{
+  return random_spectrum(field, ivar, -1, spectrum);
+}
 
-  p[0] = 0.0 + 0.0 * I;
+/* As cg_random_phase() for iorig, cg_correlated_phase() for ivar and
+   then cg_apply_spectrum() for both, but in a single pass over the
+   Fourier components of each variable. The raw phases of iorig are
+   kept in ivar until its own pass. */
+int
+cg_correlated_spectra(cg_field *field, int iorig, int ivar,
+		      real correlation, const cg_spectrum *orig_spectrum,
+		      const cg_spectrum *spectrum)
+{
+  if (!random_spectrum(field, iorig, correlation > 0.0 ? ivar : -1,
+		       orig_spectrum)) {
+    return 0;
+  }
+  if (correlation >= 1.0) {
+    /* No new random numbers are needed */
+    return cg_correlate_layers(field, ivar, correlation, spectrum);
+  }
+  else {
+    random_state *state = cg_random_state(field);
+    long int plane = (field->nx/2+1) * field->ny;
+    long int len = plane * field->local_nz;
+    long int offset = plane * field->z_start;
+    long int first = offset > 0 ? offset : 1;
+    long int end = offset+len > first ? offset+len : first;
+    int status;
 
-  for (n = 1; n < len; n++) {
-    rr = gaussian_deviate();
-    ii = gaussian_deviate();
-    p[n] = rr + ii * I;
+    skip_gaussian_deviates(state, 2*(first-1));
+    status = cg_correlate_layers(field, ivar, correlation, spectrum);
+    skip_gaussian_deviates(state, 2*(plane*field->nz - end));
+    return status;
   }
 }
 
@@ -395,36 +890,61 @@ cg_random_phase(cg_field *field, int ivar)
 void
 cg_correlated_phase(cg_field *field, int ivar, int iorig, real correlation)
 {
+  random_state *state = cg_random_state(field);
   complex *p = field->p[ivar];
   complex *p_orig = field->p[iorig];
   long int n;
-  long int len = (field->nx/2+1) * field->ny * field->nz;
-  real rr, ii;
-
-  p[0] = 0.0 + 0.0 * I;
+  long int plane = (field->nx/2+1) * field->ny;
+  long int len = plane * field->local_nz;
+  long int offset = plane * field->z_start;
+  long int first = offset > 0 ? offset : 1;
+  long int end = offset+len > first ? offset+len : first;
+  long int remaining = 2*(plane*field->nz - end);
 
   if (correlation <= 0.0) {
     /* Use completely new random numbers */
-    for (n = 1; n < len; n++) {
-      rr = gaussian_deviate();
-      ii = gaussian_deviate();
-      p[n] = rr + ii * I;
-    }
+    cg_random_phase(field, ivar);
   }
   else if (correlation >= 1.0) {
     /* Copy values over */
     memcpy(p, p_orig, len*sizeof(complex));
   }
+  else if (state->counter) {
+    /* As below, but each layer draws its own random numbers */
+    real comp_correlation = 1.0-correlation;
+    int k;
+#pragma omp parallel for num_threads(field->nthreads) schedule(static)
+    for (k = 0; k < field->local_nz; k++) {
+      complex *target = p + plane*k;
+      const complex *orig = p_orig + plane*k;
+      long int m;
+      cg_counter_phase_values(field, target, ivar, offset + plane*k, plane);
+      for (m = 0; m < plane; m++) {
+	target[m] = correlation * orig[m] + comp_correlation * target[m];
+      }
+    }
+    if (offset == 0 && len > 0) {
+      p[0] = 0.0 + 0.0 * I;
+    }
+  }
   else {
     /* Use weighting of new random number
        and those from another variable */
     real comp_correlation = 1.0-correlation;
-    for (n = 1; n < len; n++) {
-      rr = gaussian_deviate();
-      ii = gaussian_deviate();
-      p[n] = correlation * p_orig[n]
-          + comp_correlation * (rr + ii * I);
+    if (offset == 0 && len > 0) {
+      p[0] = 0.0 + 0.0 * I;
+    }
+    skip_gaussian_deviates(state, 2*(first-1));
+    for (n = first-offset; n < len; n += CG_BLOCK) {
+      long int m, block = len - n < CG_BLOCK ? len - n : CG_BLOCK;
+      complex phase[CG_BLOCK];
+      cg_next_phase_values(field, phase, block);
+      for (m = 0; m < block; m++) {
+	p[n+m] = correlation * p_orig[n+m]
+	  + comp_correlation * phase[m];
+      }
     }
+    skip_gaussian_deviates(state, remaining);
   }
 }
 
@@ -436,61 +956,128 @@ cg_generate_fractal(cg_field *field)
 {
   int n;
   for (n = 0; n < field->nvars; n++) {
+#ifdef CG_ENABLE_MPI
+    if (field->distributed) {
+      fftw_mpi_execute_dft_c2r(field->fft_plan, field->p[n], field->field[n]);
+      continue;
+    }
+#endif
     fftw_execute_dft_c2r(field->fft_plan, field->p[n], field->field[n]);
   }
 
   return field->field[0];
 }
 
+/* Perform only the vertical part of the inverse 3D Fourier
+   transform, leaving each layer in the state cg_transform_layers()
+   would put the result of cg_generate_fractal() in. */
+int
+cg_generate_layers(cg_field *field)
+{
+  int n;
+  if (!field->fft_plan_z) {
+    return 0;
+  }
+  for (n = 0; n < field->nvars; n++) {
+    fftw_execute_dft(field->fft_plan_z, field->p[n], field->p[n]);
+  }
+  cg_finish_layers(field);
+  return 1;
+}
+
 
 /* Replace all values below threshold with missing_value */
 void
 cg_threshold(cg_field *field, int ivar, real threshold, real missing_value)
 {
-  real *data = field->field[ivar];
-  int i, j, k, n;
+  int k;
   int nx = field->nx;
   int ny = field->ny;
-  int nz = field->nz;
+  int local_nz = field->local_nz;
 
-  for (k = 0; k < nz; k++) {
+#pragma omp parallel for num_threads(field->nthreads) schedule(static)
+  for (k = 0; k < local_nz; k++) {
+    int j, n;
     for (j = 0; j < ny; j++) {
-      for (i = 0; i < nx; i++) {
-	int index = i + (nx+2)*(j + ny*k);
-	if (data[index] < threshold) {
-	  for (n = 0; n < field->nvars; n++) {
-	    field->field[n][index] = missing_value;
-	  }
-	}
+      real *rows[CG_MAX_VARS];
+      for (n = 0; n < field->nvars; n++) {
+	rows[n] = field->field[n] + (nx+2)*(j + ny*k);
       }
+      cg_threshold_values(rows, field->nvars, ivar, nx,
+			  threshold, missing_value);
     }
   }
 }
 
+/* Return the sum of the squares of layer k of data */
+static
+double
+layer_sum_squares(cg_field *field, real *data, int k)
+{
+  double sum2 = 0.0;
+  int j;
+  for (j = 0; j < field->ny; j++) {
+    sum2 += cg_sum_squares(data + (field->nx+2)*(j + field->ny*k),
+			   field->nx);
+  }
+  return sum2;
+}
+
+/* Return the sum of the squares of the local layers of data. The
+   layers are summed in parallel but added together in order, so the
+   result does not depend on the number of threads. */
+static
+double
+sum_squares(cg_field *field, real *data)
+{
+  int local_nz = field->local_nz;
+  double *layer_sum2 = malloc((local_nz > 0 ? local_nz : 1)
+			      * sizeof(double));
+  double sum2 = 0.0;
+  int k;
+
+  if (!layer_sum2) {
+    for (k = 0; k < local_nz; k++) {
+      sum2 += layer_sum_squares(field, data, k);
+    }
+    return sum2;
+  }
+#pragma omp parallel for num_threads(field->nthreads) schedule(static)
+  for (k = 0; k < local_nz; k++) {
+    layer_sum2[k] = layer_sum_squares(field, data, k);
+  }
+  for (k = 0; k < local_nz; k++) {
+    sum2 += layer_sum2[k];
+  }
+  free(layer_sum2);
+  return sum2;
+}
+
 /* Scale the field to obtain a standard deviation of
    "std" and a mean of "mean". */
 void
 cg_scale(cg_field *field, int ivar, real std, real mean)
 {
   real *data = field->field[ivar];
-  int i, j, k;
+  int k;
   int nx = field->nx;
   int ny = field->ny;
   int nz = field->nz;
+  int local_nz = field->local_nz;
   double scale = 0.0;
   double sum2 = 0.0;
 
-  for (k = 0; k < nz; k++) {
-    for (j = 0; j < ny; j++) {
-      for (i = 0; i < nx; i++) {
-	int index = i + (nx+2)*(j + ny*k);
-	sum2 += data[index]*data[index];
-      }
-    }
+  sum2 = sum_squares(field, data);
+#ifdef CG_ENABLE_MPI
+  if (field->distributed) {
+    MPI_Allreduce(MPI_IN_PLACE, &sum2, 1, MPI_DOUBLE, MPI_SUM, field->comm);
   }
-  scale = std/sqrt(sum2/(nx*ny*nz));
+#endif
+  scale = std/sqrt(sum2/((double) nx*ny*nz));
 
-  for (k = 0; k < nz; k++) {
+#pragma omp parallel for num_threads(field->nthreads) schedule(static)
+  for (k = 0; k < local_nz; k++) {
+    int i, j;
     for (j = 0; j < ny; j++) {
       for (i = 0; i < nx; i++) {
 	int index = i + (nx+2)*(j + ny*k);
@@ -509,27 +1096,28 @@ void
 cg_lognormal(cg_field *field, int ivar, real std, real mean)
 {
   real *data = field->field[ivar];
-  int i, j, k;
+  int k;
   int nx = field->nx;
   int ny = field->ny;
   int nz = field->nz;
-  int len = nx*ny*nz;
+  int local_nz = field->local_nz;
+  double len = (double) nx*ny*nz;
   double pre_scale = 0.0;
   double post_scale = 0.0;
   double sum2 = 0.0;
 
-  for (k = 0; k < nz; k++) {
-    for (j = 0; j < ny; j++) {
-      for (i = 0; i < nx; i++) {
-	int index = i + (nx+2)*(j + ny*k);
-	sum2 += data[index]*data[index];
-      }
-    }
+  sum2 = sum_squares(field, data);
+#ifdef CG_ENABLE_MPI
+  if (field->distributed) {
+    MPI_Allreduce(MPI_IN_PLACE, &sum2, 1, MPI_DOUBLE, MPI_SUM, field->comm);
   }
+#endif
   pre_scale = std/sqrt(sum2/len);
   post_scale = mean/exp(0.5*std*std);
 
-  for (k = 0; k < nz; k++) {
+#pragma omp parallel for num_threads(field->nthreads) schedule(static)
+  for (k = 0; k < local_nz; k++) {
+    int i, j;
     for (j = 0; j < ny; j++) {
       for (i = 0; i < nx; i++) {
 	int index = i + (nx+2)*(j + ny*k);
@@ -540,18 +1128,21 @@ cg_lognormal(cg_field *field, int ivar, real std, real mean)
 }
 
 /* Shuffle the data to remove the 2-float padding at the end of
-   every row */
+   every row. Each row may overwrite the one before, so only the
+   variables are shared between threads. */
 void
 cg_squeeze(cg_field *field)
 {
-  int i, j, k, v;
+  int v;
   int nx = field->nx;
   int ny = field->ny;
-  int nz = field->nz;
+  int local_nz = field->local_nz;
 
+#pragma omp parallel for num_threads(field->nthreads) schedule(static)
   for (v = 0; v < field->nvars; v++) {
     real *data = field->field[v];
-    for (k = 0; k < nz; k++) {
+    int i, j, k;
+    for (k = 0; k < local_nz; k++) {
       for (j = 0; j < ny; j++) {
 	int old_offset = (nx+2)*(j + ny*k);
 	int new_offset = nx*(j + ny*k);
@@ -573,7 +1164,7 @@ cg_dump_field(FILE * handle, cg_field * field) {
   fftw_fprint_plan(field->fft_plan_2d_2, handle);
   fprintf(handle, "\n%d\n%d\n%d\n%d", field->nx, field->ny, field->nz,
           field->nvars);
-  size = 2 * (field->nx / 2 + 1) * field->ny * field->nz;
+  size = 2 * (field->nx / 2 + 1) * field->ny * field->local_nz;
   for (j = 0; j < field->nvars; j++) {
     fprintf(handle, "\n%f", field->field[j][0]);
     for (i = 1; i < size; i++) {
@@ -0,0 +1,129 @@
+/* cloudgen_float.h -- Names of the single-precision functions
+
+   When the library is built in both precisions, the single-precision
+   copy of each function that depends on "real" has the suffix "_f".
+   Defining CG_FLOAT_SYMBOLS as well as FFTW_ENABLE_FLOAT before
+   including cloudgen.h or readconfig.h makes the usual names refer to
+   these. A program can use both precisions, but each source file only
+   one of them. */
+#ifndef CLOUDGEN_FLOAT_H
+#define CLOUDGEN_FLOAT_H
+
+/* cloudgen_core.c */
+#define cg_correlated_phase cg_correlated_phase_f
+#define cg_correlated_spectra cg_correlated_spectra_f
+#define cg_counter_phase_values cg_counter_phase_values_f
+#define cg_counter_phases cg_counter_phases_f
+#define cg_delete_field cg_delete_field_f
+#define cg_delete_last_variable cg_delete_last_variable_f
+#define cg_dump_field cg_dump_field_f
+#define cg_export_wisdom cg_export_wisdom_f
+#define cg_export_wisdom_mpi cg_export_wisdom_mpi_f
+#define cg_field_counter_phases cg_field_counter_phases_f
+#define cg_generate_fractal cg_generate_fractal_f
+#define cg_generate_layers cg_generate_layers_f
+#define cg_import_wisdom cg_import_wisdom_f
+#define cg_import_wisdom_mpi cg_import_wisdom_mpi_f
+#define cg_lock_planner cg_lock_planner_f
+#define cg_lognormal cg_lognormal_f
+#define cg_new_distributed_field cg_new_distributed_field_f
+#define cg_new_multi_field cg_new_multi_field_f
+#define cg_new_planned_field cg_new_planned_field_f
+#define cg_new_threaded_field cg_new_threaded_field_f
+#define cg_new_window_field cg_new_window_field_f
+#define cg_next_phase_values cg_next_phase_values_f
+#define cg_planner_flags cg_planner_flags_f
+#define cg_power_law cg_power_law_f
+#define cg_power_laws cg_power_laws_f
+#define cg_random_phase cg_random_phase_f
+#define cg_random_spectrum cg_random_spectrum_f
+#define cg_random_state cg_random_state_f
+#define cg_scale cg_scale_f
+#define cg_select_counter_phases cg_select_counter_phases_f
+#define cg_select_field_counter_phases cg_select_field_counter_phases_f
+#define cg_set_random_state cg_set_random_state_f
+#define cg_squeeze cg_squeeze_f
+#define cg_threshold cg_threshold_f
+#define cg_unlock_planner cg_unlock_planner_f
+#define cg_unity_phase cg_unity_phase_f
+
+/* cloudgen_layers.c */
+#define cg_anisotropic_change_slope_layers cg_anisotropic_change_slope_layers_f
+#define cg_change_slope_layers cg_change_slope_layers_f
+#define cg_delete_slope_table cg_delete_slope_table_f
+#define cg_finish_join_layers cg_finish_join_layers_f
+#define cg_finish_layers cg_finish_layers_f
+#define cg_finish_output cg_finish_output_f
+#define cg_get_layer_displacements cg_get_layer_displacements_f
+#define cg_interpolate_layers cg_interpolate_layers_f
+#define cg_join_layers cg_join_layers_f
+#define cg_layer_powers cg_layer_powers_f
+#define cg_lognormal_layers cg_lognormal_layers_f
+#define cg_lognormal_layers_power cg_lognormal_layers_power_f
+#define cg_output_layer cg_output_layer_f
+#define cg_revert_layers cg_revert_layers_f
+#define cg_scale_layers cg_scale_layers_f
+#define cg_scale_layers_power cg_scale_layers_power_f
+#define cg_transform_layers cg_transform_layers_f
+#define cg_translate_layers cg_translate_layers_f
+
+/* cloudgen_simd.c */
+#define cg_exp_values cg_exp_values_f
+#define cg_gaussian_values cg_gaussian_values_f
+#define cg_libm_exp cg_libm_exp_f
+#define cg_lognormal_values cg_lognormal_values_f
+#define cg_multiply_complex_values cg_multiply_complex_values_f
+#define cg_multiply_values cg_multiply_values_f
+#define cg_scale_values cg_scale_values_f
+#define cg_select_libm_exp cg_select_libm_exp_f
+#define cg_select_simd cg_select_simd_f
+#define cg_simd_name cg_simd_name_f
+#define cg_sum_squares cg_sum_squares_f
+#define cg_threshold_values cg_threshold_values_f
+
+/* cloudgen_spectrum.c */
+#define cg_apply_spectrum cg_apply_spectrum_f
+#define cg_correlate_layers cg_correlate_layers_f
+#define cg_delete_plane_table cg_delete_plane_table_f
+#define cg_delete_spectrum cg_delete_spectrum_f
+#define cg_new_power_law_spectrum cg_new_power_law_spectrum_f
+#define cg_new_tabulated_spectrum cg_new_tabulated_spectrum_f
+#define cg_spectrum_amplitude cg_spectrum_amplitude_f
+#define cg_synthesize_layers cg_synthesize_layers_f
+
+/* cloudgen_stream.c */
+#define cg_delete_stream cg_delete_stream_f
+#define cg_new_stream cg_new_stream_f
+#define cg_stream_fractal_window cg_stream_fractal_window_f
+#define cg_stream_generate cg_stream_generate_f
+#define cg_stream_layers_window cg_stream_layers_window_f
+#define cg_stream_result_window cg_stream_result_window_f
+#define cg_stream_store_window cg_stream_store_window_f
+
+/* readconfig.c */
+#define rc_assign_int rc_assign_int_f
+#define rc_assign_real rc_assign_real_f
+#define rc_assign_real_array rc_assign_real_array_f
+#define rc_assign_real_array_default rc_assign_real_array_default_f
+#define rc_assign_string rc_assign_string_f
+#define rc_clear rc_clear_f
+#define rc_exists rc_exists_f
+#define rc_find rc_find_f
+#define rc_free rc_free_f
+#define rc_generate_base_field rc_generate_base_field_f
+#define rc_generate_stream rc_generate_stream_f
+#define rc_get_boolean rc_get_boolean_f
+#define rc_get_file rc_get_file_f
+#define rc_get_int rc_get_int_f
+#define rc_get_int_array rc_get_int_array_f
+#define rc_get_real rc_get_real_f
+#define rc_get_real_array rc_get_real_array_f
+#define rc_get_shape rc_get_shape_f
+#define rc_get_string rc_get_string_f
+#define rc_print rc_print_f
+#define rc_read rc_read_f
+#define rc_register rc_register_f
+#define rc_register_args rc_register_args_f
+#define rc_sprint rc_sprint_f
+
+#endif
@@ -7,6 +7,7 @@
 
 #include <tgmath.h>
 #include <stdlib.h>
+#include <string.h>
 
 #define PI 3.14159265358979323846
 #define PI2 6.28318530717958647692
@@ -17,22 +18,252 @@ void
 cg_transform_layers(cg_field *field)
 {
   int n;
+  if (field->local_nz == 0) {
+    /* No layers held by this process */
+    return;
+  }
   for (n = 0; n < field->nvars; n++) {
     fftw_execute_dft_r2c(field->fft_plan_2d_1, field->field[n], field->p[n]);
   }
 }
 
+/* Find the mean square of each layer from its Fourier components.
+   The inverse real transform gives a layer whose mean square is the
+   sum of |p|^2 over the full spectrum, of which only the columns
+   kx=0 to nx/2 are stored: the columns in between also stand for
+   their conjugates at -kx, while the kx=0 and kx=nx/2 columns
+   contribute only their part that is Hermitian in ky. */
+void
+cg_layer_powers(cg_field *field, int ivar, double *power)
+{
+  int nx = field->nx;
+  int ny = field->ny;
+  int row = nx/2+1;
+  long int plane = (long int) row * ny;
+  /* Columns kx=0 and, for even nx, kx=nx/2 */
+  int ncolumns = (nx > 1 && nx % 2 == 0) ? 2 : 1;
+  int k;
+
+#pragma omp parallel for num_threads(field->nthreads) schedule(static)
+  for (k = 0; k < field->local_nz; k++) {
+    complex *p = field->p[ivar] + k*plane;
+    double sum2 = 0.0;
+    int c, i, j;
+    for (j = 0; j < ny; j++) {
+      complex *conj_row = p + ((ny - j) % ny)*row;
+      sum2 += 2.0 * cg_sum_squares((real *) (p + j*row + 1),
+				   2*(row - ncolumns));
+      for (c = 0; c < ncolumns; c++) {
+	complex hermitian;
+	i = c * (nx/2);
+	hermitian = 0.5 * (p[j*row+i] + conj(conj_row[i]));
+	sum2 += creal(hermitian)*creal(hermitian)
+	  + cimag(hermitian)*cimag(hermitian);
+      }
+    }
+    power[k] = sum2;
+  }
+}
+
 /* Perform inverse 2D Fourier transform on each horizontal layer to
    revert to real space. */
 void
 cg_revert_layers(cg_field *field)
 {
   int n;
+  if (field->local_nz == 0) {
+    return;
+  }
   for (n = 0; n < field->nvars; n++) {
     fftw_execute_dft_c2r(field->fft_plan_2d_2, field->p[n], field->field[n]);
   }
 }
 
+/* Turn the layers left in horizontal Fourier space by the inverse
+   transform along z alone into those cg_transform_layers() would
+   give after cg_generate_fractal(). The 2D round trip multiplies by
+   nx*ny, and as the layers are real it makes the kx=0 and kx=nx/2
+   columns Hermitian in ky, keeping the part that the inverse real
+   transform would have used. */
+void
+cg_finish_layers(cg_field *field)
+{
+  int nx = field->nx;
+  int ny = field->ny;
+  int row = nx/2+1;
+  long int plane = (long int) row * ny;
+  real scale = (real) nx * ny;
+  /* Columns kx=0 and, for even nx, kx=nx/2 */
+  int ncolumns = (nx > 1 && nx % 2 == 0) ? 2 : 1;
+  int k;
+
+#pragma omp parallel for num_threads(field->nthreads) schedule(static)
+  for (k = 0; k < field->local_nz; k++) {
+    int n, c, i, j;
+    for (n = 0; n < field->nvars; n++) {
+      complex *p = field->p[n] + k*plane;
+      cg_scale_values((real *) p, 2*plane, scale, 0.0);
+      for (c = 0; c < ncolumns; c++) {
+	i = c * (nx/2);
+	for (j = 0; j <= ny/2; j++) {
+	  int jj = (ny - j) % ny;
+	  complex mean = 0.5 * (p[j*row+i] + conj(p[jj*row+i]));
+	  p[j*row+i] = mean;
+	  p[jj*row+i] = conj(mean);
+	}
+      }
+    }
+  }
+}
+
+/* The Fourier components of a layer beyond the outer scale, as
+   indices into the layer, and the logarithm of kk/kk_outer at each,
+   so that changing the slope of a layer only needs an exp of the
+   logarithm times the change in slope. The isotropic table is kept
+   in the field for the outer scale it was filled for, so that the
+   variables of a field and the windows of a stream share it. */
+struct cg_slope_table {
+  long int n;
+  long int *index;
+  real *log_ratio;
+  real kk_outer;  /* Squared outer wavenumber, or 0 if not filled */
+};
+typedef struct cg_slope_table slope_table;
+
+static
+int
+new_slope_table(slope_table *table, cg_field *field)
+{
+  long int plane = (long int) (field->nx/2+1) * field->ny;
+  table->n = 0;
+  table->kk_outer = 0.0;
+  table->index = malloc(plane * sizeof(long int));
+  table->log_ratio = malloc(plane * sizeof(real));
+  if (!table->index || !table->log_ratio) {
+    free(table->index);
+    free(table->log_ratio);
+    table->index = NULL;
+    table->log_ratio = NULL;
+    return 0;
+  }
+  return 1;
+}
+
+static
+void
+delete_slope_table(slope_table *table)
+{
+  free(table->index);
+  free(table->log_ratio);
+}
+
+/* Free the isotropic table of field */
+void
+cg_delete_slope_table(cg_field *field)
+{
+  if (field->slope_table) {
+    delete_slope_table(field->slope_table);
+    free(field->slope_table);
+    field->slope_table = NULL;
+  }
+}
+
+/* Fill the table for the direction theta, or the radial wavenumber
+   if isotropic is set */
+static
+void
+fill_slope_table(slope_table *table, cg_field *field, real kk_outer,
+		 int isotropic, real sin_theta, real cos_theta)
+{
+  int row = field->nx/2+1;
+  int i, j;
+  table->n = 0;
+  table->kk_outer = kk_outer;
+  for (j = 0; j < field->ny; j++) {
+    for (i = 0; i < row; i++) {
+      real kk;
+      if (isotropic) {
+	kk = field->kx[i]*field->kx[i] + field->ky[j]*field->ky[j];
+      }
+      else {
+	real k_theta = field->kx[i]*sin_theta + field->ky[j]*cos_theta;
+	kk = k_theta*k_theta;
+      }
+      if (kk > kk_outer) {
+	table->index[table->n] = i + (long int) row*j;
+	table->log_ratio[table->n] = log(kk/kk_outer);
+	table->n++;
+      }
+    }
+  }
+}
+
+/* Multiply the components of layer p in the table by
+   (kk/kk_outer)^power */
+static
+void
+apply_slope_table(complex *p, const slope_table *table, real power)
+{
+  real factor[CG_BLOCK];
+  long int m, m0;
+  for (m0 = 0; m0 < table->n; m0 += CG_BLOCK) {
+    long int len = table->n - m0 < CG_BLOCK ? table->n - m0 : CG_BLOCK;
+    memcpy(factor, table->log_ratio + m0, len * sizeof(real));
+    cg_lognormal_values(factor, len, power, 1.0);
+    for (m = 0; m < len; m++) {
+      p[table->index[m0+m]] *= factor[m];
+    }
+  }
+}
+
+/* Multiply the components of layer p by (kk/kk_outer)^power with
+   pow() for each, for when the table cannot be allocated */
+static
+void
+apply_slope_direct(complex *p, cg_field *field, real kk_outer,
+		   int isotropic, real sin_theta, real cos_theta, real power)
+{
+  int row = field->nx/2+1;
+  int i, j;
+  for (j = 0; j < field->ny; j++) {
+    for (i = 0; i < row; i++) {
+      real kk;
+      if (isotropic) {
+	kk = field->kx[i]*field->kx[i] + field->ky[j]*field->ky[j];
+      }
+      else {
+	real k_theta = field->kx[i]*sin_theta + field->ky[j]*cos_theta;
+	kk = k_theta*k_theta;
+      }
+      if (kk > kk_outer) {
+	p[i + row*j] *= pow(kk/kk_outer, power);
+      }
+    }
+  }
+}
+
+/* Return the isotropic table of field for kk_outer, building it on
+   first use or refilling it if the outer scale has changed, or NULL
+   if out of memory */
+static
+slope_table *
+get_slope_table(cg_field *field, real kk_outer)
+{
+  slope_table *table = field->slope_table;
+  if (!table) {
+    table = malloc(sizeof(slope_table));
+    if (!table || !new_slope_table(table, field)) {
+      free(table);
+      return NULL;
+    }
+    field->slope_table = table;
+  }
+  if (table->kk_outer != kk_outer) {
+    fill_slope_table(table, field, kk_outer, 1, 0.0, 0.0);
+  }
+  return table;
+}
+
 /* At each height in the field, change the slope of the power
    spectrum at scales smaller than outer_scale. The original slope
    is provided in old_slope and the new in the array new_slope,
@@ -41,27 +272,24 @@ void
 cg_change_slope_layers(cg_field *field, int ivar, real outer_scale,
 		       real *new_slope, real old_slope)
 {
-  complex *p = field->p[ivar];
-  real *kx = field->kx;
-  real *ky = field->ky;
-  int i, j, k;
-  int nx = field->nx;
-  int ny = field->ny;
-  int nz = field->nz;
-
+  long int plane = (long int) (field->nx/2+1) * field->ny;
+  int k;
+  int local_nz = field->local_nz;
+  int z_start = field->z_start;
   real kk_outer = 1/(outer_scale*outer_scale);
+  /* The wavenumbers are the same on every layer, so the table is
+     shared between them */
+  slope_table *table = get_slope_table(field, kk_outer);
 
-  for (k = 0; k < nz; k++) {
-    real power = 0.25*(new_slope[k]-old_slope);
-    for (j = 0; j < ny; j++) { 
-      for (i = 0; i < (nx/2+1); i++) {
-	real kk = kx[i]*kx[i] + ky[j]*ky[j];
-	if (kk > kk_outer) {
-	  int index = i + (nx/2+1)*(j + ny*k);
-	  real scaling = pow(kk/kk_outer, power);
-	  p[index] *= scaling;
-	}
-      }
+#pragma omp parallel for num_threads(field->nthreads) schedule(static)
+  for (k = 0; k < local_nz; k++) {
+    real power = 0.25*(new_slope[k+z_start]-old_slope);
+    complex *p = field->p[ivar] + k*plane;
+    if (table) {
+      apply_slope_table(p, table, power);
+    }
+    else {
+      apply_slope_direct(p, field, kk_outer, 1, 0.0, 0.0, power);
     }
   }
 }
@@ -76,42 +304,52 @@ cg_anisotropic_change_slope_layers(cg_field *field, int ivar,
 				   real *new_slope, real old_slope,
 				   real *deltax, real *deltay)
 {
-  complex *p = field->p[ivar];
-  real *kx = field->kx;
-  real *ky = field->ky;
-  int i, j, k;
-  int nx = field->nx;
-  int ny = field->ny;
-  int nz = field->nz;
-
+  long int plane = (long int) (field->nx/2+1) * field->ny;
+  int local_nz = field->local_nz;
+  int z_start = field->z_start;
   real kk_outer = 1/(outer_scale*outer_scale);
 
-  for (k = 0; k < nz; k++) {
-    real theta, sin_theta, cos_theta, power;
-    if (deltax[k] != 0.0 || deltay[k] != 0.0) {
-      theta = atan2(deltax[k], deltay[k]);
-    }
-    else {
-      /* Can't work out the orientation of the fall streak - use 0
-	 radians*/
-      theta = 0.0;
-    }
-    sin_theta = sin(theta);
-    cos_theta = cos(theta);
-    power = 0.25*(new_slope[k]-old_slope);
-    for (j = 0; j < ny; j++) { 
-      for (i = 0; i < (nx/2+1); i++) {
-	real k_theta = kx[i]*sin_theta + ky[j]*cos_theta;
-	real kk = k_theta*k_theta;
-	if (kk > kk_outer) {
-	  int index = i + (nx/2+1)*(j + ny*k);
-	  real scaling = pow(kk/kk_outer, power);
-	  p[index] *= scaling;
-	}
+#pragma omp parallel num_threads(field->nthreads)
+  {
+    /* The direction usually changes little with height, so each
+       thread keeps its table until the direction does change */
+    slope_table table;
+    int filled = 0;
+    real last_theta = 0.0;
+    int k;
+
+    new_slope_table(&table, field);
+#pragma omp for schedule(static)
+    for (k = 0; k < local_nz; k++) {
+      real theta, sin_theta, cos_theta, power;
+      complex *p = field->p[ivar] + k*plane;
+      if (deltax[k+z_start] != 0.0 || deltay[k+z_start] != 0.0) {
+	theta = atan2(deltax[k+z_start], deltay[k+z_start]);
       }
+      else {
+	/* Can't work out the orientation of the fall streak - use 0
+	   radians*/
+	theta = 0.0;
+      }
+      sin_theta = sin(theta);
+      cos_theta = cos(theta);
+      power = 0.25*(new_slope[k+z_start]-old_slope);
+      if (!table.index) {
+	apply_slope_direct(p, field, kk_outer, 0, sin_theta, cos_theta,
+			   power);
+	continue;
+      }
+      if (!filled || theta != last_theta) {
+	fill_slope_table(&table, field, kk_outer, 0, sin_theta, cos_theta);
+	filled = 1;
+	last_theta = theta;
+      }
+      apply_slope_table(p, &table, power);
     }
+    delete_slope_table(&table);
   }
 }
+
 /* Translate the field horizontally at each level by the amounts
    given in the arrays deltax and deltay. */
 void
@@ -119,57 +357,110 @@ cg_translate_layers(cg_field *field, real *deltax, real *deltay)
 {
   real *kx = field->kx;
   real *ky = field->ky;
-  int i, j, k, n;
   int nx = field->nx;
   int ny = field->ny;
-  int nz = field->nz;
+  int local_nz = field->local_nz;
+  int z_start = field->z_start;
 
-  for (n = 0; n < field->nvars; n++) {
-    complex *p = field->p[n];
-    
-    for (k = 0; k < nz; k++) {
+#pragma omp parallel num_threads(field->nthreads)
+  {
+    complex *ramp_x = fftw_malloc((nx/2+1) * sizeof(complex));
+    complex *ramp_y = fftw_malloc(ny * sizeof(complex));
+    complex *shift = fftw_malloc((nx/2+1) * sizeof(complex));
+    int i, j, k, n;
+
+#pragma omp for schedule(static)
+    for (k = 0; k < local_nz; k++) {
+      if (!ramp_x || !ramp_y || !shift) {
+	/* Out of memory: rotate the phase of each component in turn */
+	for (n = 0; n < field->nvars; n++) {
+	  complex *p = field->p[n];
+	  for (j = 0; j < ny; j++) {
+	    for (i = 0; i < (nx/2+1); i++) {
+	      int index = i + (nx/2+1)*(j + ny*k);
+	      real angle = carg(p[index]);
+	      real amp = fabs(p[index]);
+	      angle -= PI2 * (kx[i] * deltax[k+z_start]
+			      + ky[j] * deltay[k+z_start]);
+	      p[index] = amp * (cos(angle) + sin(angle) * I);
+	    }
+	  }
+	}
+	continue;
+      }
+
+      /* The shift exp(-2 pi i (kx deltax + ky deltay)) is the product
+	 of a ramp in kx and a ramp in ky, so only these need the
+	 trigonometric functions, once per layer. */
+      for (i = 0; i < (nx/2+1); i++) {
+	real angle = -PI2 * kx[i] * deltax[k+z_start];
+	ramp_x[i] = cos(angle) + sin(angle) * I;
+      }
+      for (j = 0; j < ny; j++) {
+	real angle = -PI2 * ky[j] * deltay[k+z_start];
+	ramp_y[j] = cos(angle) + sin(angle) * I;
+      }
       for (j = 0; j < ny; j++) {
 	for (i = 0; i < (nx/2+1); i++) {
-	  int index = i + (nx/2+1)*(j + ny*k);
-	  real angle = carg(p[index]);
-	  real amp = fabs(p[index]);
-	  angle -= PI2 * (kx[i] * deltax[k] + ky[j] * deltay[k]);
-	  p[index] = amp * (cos(angle) + sin(angle) * I);
+	  shift[i] = ramp_x[i] * ramp_y[j];
+	}
+	for (n = 0; n < field->nvars; n++) {
+	  cg_multiply_complex_values(field->p[n] + (nx/2+1)*(j + ny*k),
+				     shift, nx/2+1);
 	}
       }
     }
+
+    fftw_free(ramp_x);
+    fftw_free(ramp_y);
+    fftw_free(shift);
   }
 }
 
+/* Return the mean square of local layer k of data in real space */
+static
+double
+layer_power(cg_field *field, real *data, int k)
+{
+  double sum2 = 0.0;
+  int j;
+  for (j = 0; j < field->ny; j++) {
+    sum2 += cg_sum_squares(data + (field->nx+2)*(j + field->ny*k),
+			   field->nx);
+  }
+  return sum2/(field->nx*field->ny);
+}
+
 /* Scale the field at each height to obtain standard deviations
    close to "std" and means close to "mean". Note that the
    calculation allows for natural vertical variations in the fractal
    field so will not match the request exactly. */
 void
 cg_scale_layers(cg_field *field, int ivar, real *std, real *mean)
+{
+  cg_scale_layers_power(field, ivar, std, mean, NULL);
+}
+
+/* As cg_scale_layers() with the mean square of each layer given */
+void
+cg_scale_layers_power(cg_field *field, int ivar, real *std, real *mean,
+		      const double *power)
 {
   real *data = field->field[ivar];
-  int i, j, k;
+  int k;
   int nx = field->nx;
   int ny = field->ny;
-  int nz = field->nz;
+  int local_nz = field->local_nz;
+  int z_start = field->z_start;
 
-  for (k = 0; k < nz; k++) {
-    double sum2 = 0.0;
-    real scale;
-    real offset = mean[k];
-    for (j = 0; j < ny; j++) {
-      for (i = 0; i < nx; i++) {
-	real value = data[i + (nx+2)*(j + ny*k)];
-	sum2 += value*value;
-      }
-    }
-    scale = std[k]/sqrt(sum2/(nx*ny));
+#pragma omp parallel for num_threads(field->nthreads) schedule(static)
+  for (k = 0; k < local_nz; k++) {
+    double layer = power ? power[k] : layer_power(field, data, k);
+    real scale = std[k+z_start]/sqrt(layer);
+    real offset = mean[k+z_start];
+    int j;
     for (j = 0; j < ny; j++) {
-      for (i = 0; i < nx; i++) {
-	real *value = data + i + (nx+2)*(j + ny*k);
-	*value = *value * scale + offset;
-      }
+      cg_scale_values(data + (nx+2)*(j + ny*k), nx, scale, offset);
     }
   }
 }
@@ -181,33 +472,149 @@ cg_scale_layers(cg_field *field, int ivar, real *std, real *mean)
    refers to the requested horizontal mean of the final field. */
 void
 cg_lognormal_layers(cg_field *field, int ivar, real *std, real *mean)
+{
+  cg_lognormal_layers_power(field, ivar, std, mean, NULL);
+}
+
+/* As cg_lognormal_layers() with the mean square of each layer given */
+void
+cg_lognormal_layers_power(cg_field *field, int ivar, real *std, real *mean,
+			  const double *power)
 {
   real *data = field->field[ivar];
-  int i, j, k;
+  int k;
   int nx = field->nx;
   int ny = field->ny;
-  int nz = field->nz;
+  int local_nz = field->local_nz;
+  int z_start = field->z_start;
 
-  for (k = 0; k < nz; k++) {
-    double sum2 = 0.0;
-    real pre_scale;
-    real post_scale = mean[k]/exp(0.5*std[k]*std[k]);
+#pragma omp parallel for num_threads(field->nthreads) schedule(static)
+  for (k = 0; k < local_nz; k++) {
+    double layer = power ? power[k] : layer_power(field, data, k);
+    real pre_scale = std[k+z_start]/sqrt(layer);
+    real post_scale = mean[k+z_start]
+      / exp(0.5*std[k+z_start]*std[k+z_start]);
+    int j;
     for (j = 0; j < ny; j++) {
-      for (i = 0; i < nx; i++) {
-	real value = data[i + (nx+2)*(j + ny*k)];
-	sum2 += value*value;
+      cg_lognormal_values(data + (nx+2)*(j + ny*k), nx,
+			  pre_scale, post_scale);
+    }
+  }
+}
+
+/* Scale, threshold and pack each layer in turn, so that it passes
+   through the cache once rather than once per stage. Each row is
+   finished for every variable, so that the threshold can be applied
+   across them, and then moved down over the padding of the rows
+   before it, which have already been read. Only local layers
+   k_begin to k_end-1 are finished. */
+static
+void
+finish_output_layers(cg_field *field, const cg_output *output,
+		     int k_begin, int k_end)
+{
+  int nx = field->nx;
+  int ny = field->ny;
+  int nvars = field->nvars;
+  int z_start = field->z_start;
+  int k;
+
+#pragma omp parallel for num_threads(field->nthreads) schedule(static)
+  for (k = k_begin; k < k_end; k++) {
+    real scale[CG_MAX_VARS], offset[CG_MAX_VARS];
+    real *rows[CG_MAX_VARS];
+    int j, n;
+    for (n = 0; n < nvars; n++) {
+      real std, mean;
+      double layer;
+      if (output->transform[n] == CG_OUTPUT_AS_IS) {
+	continue;
+      }
+      std = output->std[n][k+z_start];
+      mean = output->mean[n][k+z_start];
+      layer = output->power[n] ? output->power[n][k]
+	: layer_power(field, field->field[n], k);
+      scale[n] = std/sqrt(layer);
+      if (output->transform[n] == CG_OUTPUT_LOGNORMAL) {
+	offset[n] = mean / exp(0.5*std*std);
+      }
+      else {
+	offset[n] = mean;
       }
     }
-    pre_scale = std[k]/sqrt(sum2/(nx*ny));
     for (j = 0; j < ny; j++) {
-      for (i = 0; i < nx; i++) {
-	real *value = data + i + (nx+2)*(j + ny*k);
-	*value = exp(*value * pre_scale) * post_scale;
+      for (n = 0; n < nvars; n++) {
+	rows[n] = cg_output_layer(field, n, k) + (nx+2)*j;
+	if (output->transform[n] == CG_OUTPUT_SCALE) {
+	  cg_scale_values(rows[n], nx, scale[n], offset[n]);
+	}
+	else if (output->transform[n] == CG_OUTPUT_LOGNORMAL) {
+	  cg_lognormal_values(rows[n], nx, scale[n], offset[n]);
+	}
+      }
+      if (output->threshold_var >= 0) {
+	cg_threshold_values(rows, nvars, output->threshold_var, nx,
+			    output->threshold, output->missing_value);
+      }
+      for (n = 0; n < nvars; n++) {
+	memmove(cg_output_layer(field, n, k) + nx*j, rows[n],
+		nx * sizeof(real));
       }
     }
   }
 }
 
+/* Move packed layers k_begin to k_end-1 down over the space left at
+   the end of those before them, which must already have been moved.
+   The layers must be moved in order, so only the variables are
+   shared between threads. */
+static
+void
+join_layers(cg_field *field, int k_begin, int k_end)
+{
+  long int size = (long int) field->nx * field->ny;
+  int v;
+
+#pragma omp parallel for num_threads(field->nthreads) schedule(static)
+  for (v = 0; v < field->nvars; v++) {
+    int k;
+    for (k = k_begin > 0 ? k_begin : 1; k < k_end; k++) {
+      memmove(field->field[v] + size*k, cg_output_layer(field, v, k),
+	      size * sizeof(real));
+    }
+  }
+}
+
+void
+cg_finish_output(cg_field *field, const cg_output *output)
+{
+  finish_output_layers(field, output, 0, field->local_nz);
+}
+
+/* Return the start of local layer k of variable ivar */
+real *
+cg_output_layer(cg_field *field, int ivar, int k)
+{
+  return field->field[ivar] + (long int) (field->nx+2)*field->ny*k;
+}
+
+void
+cg_join_layers(cg_field *field)
+{
+  join_layers(field, 1, field->local_nz);
+}
+
+/* The layers after k_end have not been finished, so they start no
+   earlier than where layer k_end will be moved to, and moving the
+   finished layers down leaves them untouched. */
+void
+cg_finish_join_layers(cg_field *field, const cg_output *output,
+		      int k_begin, int k_end)
+{
+  finish_output_layers(field, output, k_begin, k_end);
+  join_layers(field, k_begin, k_end);
+}
+
 /* Interpolate array "param", consisting of "n" floating point
    values at heights "height" on to the heights in "field". At
    heights outsight "height" the extreme values of "param" are
@@ -0,0 +1,1290 @@
+/* cloudgen_simd.c -- Generating stochastic fractal clouds
+   This file contains the vectorised kernels of the spectral and
+   real-space loops, with a choice of instruction set at run time
+   Copyright (C) 2003 Robin Hogan <r.j.hogan@reading.ac.uk> */
+#include <string.h>
+#include <stdint.h>
+
+#include "cloudgen.h"
+
+#include <tgmath.h>
+
+/* Every kernel gives the same bits whatever the instruction set: the
+   arithmetic is done element by element in the same order, without
+   fused multiply-adds, and the sum of squares is accumulated in
+   eight lanes (element i in lane i%8) which are then added together
+   in a fixed order. The same holds for the exponential, which is
+   computed in-tree rather than by libm so that it can be vectorised:
+   see cg_exp_values(). */
+
+#define LANES 8
+
+/* The exponential: x = m ln2 + r with m = round(x/ln2) and |r| <=
+   ln2/2, the rounding done by adding and subtracting EXP_SHIFT, and
+   ln2 split so that m*EXP_LN2_HI is exact. exp(r) is the Taylor
+   series to degree EXP_DEGREE, which is within a tenth of an ulp for
+   |r| <= ln2/2, and 2^m is made by shifting m into the exponent. As
+   m may be 1024 (or 128 for floats), 2^(m-1) is made and the series
+   doubled before it is scaled, so that the product is rounded only
+   once even near the smallest normal number. Arguments below EXP_MIN
+   give 0 so that 2^(m-1) is never subnormal. */
+#ifdef FFTW_ENABLE_FLOAT
+typedef uint32_t exp_bits;
+#define EXP_DEGREE 7
+#define EXP_LOG2E 1.44269504088896341f
+#define EXP_SHIFT 12582912.0f              /* 1.5*2^23 */
+#define EXP_LN2_HI 0.693145751953125f
+#define EXP_LN2_LO 1.42860682030941723e-06f
+#define EXP_MAX 88.7228391116729996f       /* log(FLT_MAX) */
+#define EXP_MIN -86.5f
+#define EXP_BIAS 126                       /* Exponent bias - 1 */
+#define EXP_MANTISSA 23
+#else
+typedef uint64_t exp_bits;
+#define EXP_DEGREE 13
+#define EXP_LOG2E 1.44269504088896341
+#define EXP_SHIFT 6755399441055744.0       /* 1.5*2^52 */
+#define EXP_LN2_HI 6.93147180369123816490e-01
+#define EXP_LN2_LO 1.90821492927058770002e-10
+#define EXP_MAX 709.782712893383973        /* log(DBL_MAX) */
+#define EXP_MIN -708.0
+#define EXP_BIAS 1022                      /* Exponent bias - 1 */
+#define EXP_MANTISSA 52
+#endif
+
+/* 1/n! from n = EXP_DEGREE down to 0 */
+static const real exp_coefft[] = {
+#ifndef FFTW_ENABLE_FLOAT
+  1.60590438368216146e-10, 2.08767569878680990e-09,
+  2.50521083854417188e-08, 2.75573192239858907e-07,
+  2.75573192239858907e-06, 2.48015873015873016e-05,
+#endif
+  1.98412698412698413e-04, 1.38888888888888889e-03,
+  8.33333333333333333e-03, 4.16666666666666667e-02,
+  1.66666666666666667e-01, 5.00000000000000000e-01,
+  1.0, 1.0
+};
+
+/* The Box-Muller transform of a pair of uniform deviates u in (0,1]
+   and v in [0,1) into the Gaussian deviates sqrt(-2 ln u) cos(2 pi v)
+   and sqrt(-2 ln u) sin(2 pi v), without branches:
+
+   ln u = e ln2 + ln m with m in [sqrt(1/2), sqrt(2)), e and m being
+   taken from the bits of u and the exponent converted to a real by
+   placing it in the mantissa of GAUSS_MAGIC. ln m = 2s + s R(s^2)
+   with s = (m-1)/(m+1), R being the polynomial of fdlibm's log() in
+   double precision and the Taylor series of 2 atanh(s)/s - 2 in
+   single precision.
+
+   2 pi v = q pi/2 + a with q = round(4v), found with EXP_SHIFT, and
+   |a| <= pi/4, the subtraction v - q/4 being exact. sin(a) and cos(a)
+   are Taylor series, within a tenth of an ulp, and are swapped and
+   negated according to the quadrant q, whose bits are those of the
+   rounded value. */
+#ifdef FFTW_ENABLE_FLOAT
+#define GAUSS_MAGIC 8388608.0f                 /* 2^23 */
+#define GAUSS_MAGIC_BITS 0x4B000000U
+#define GAUSS_MANTISSA_MASK 0x007FFFFFU
+#define GAUSS_ONE_BITS 0x3F800000U
+#define GAUSS_BIAS 127.0f
+#define GAUSS_SQRT2 1.41421356237309505f
+#define GAUSS_LN2 0.693147180559945309f
+#define GAUSS_TWO_PI 6.28318530717958648f
+#define GAUSS_SIGN 31
+#define LOG_TERMS 4
+#define SIN_TERMS 4
+#define COS_TERMS 5
+#else
+#define GAUSS_MAGIC 4503599627370496.0         /* 2^52 */
+#define GAUSS_MAGIC_BITS 0x4330000000000000ULL
+#define GAUSS_MANTISSA_MASK 0x000FFFFFFFFFFFFFULL
+#define GAUSS_ONE_BITS 0x3FF0000000000000ULL
+#define GAUSS_BIAS 1023.0
+#define GAUSS_SQRT2 1.41421356237309505
+#define GAUSS_LN2 0.693147180559945309
+#define GAUSS_TWO_PI 6.28318530717958648
+#define GAUSS_SIGN 63
+#define LOG_TERMS 7
+#define SIN_TERMS 7
+#define COS_TERMS 8
+#endif
+
+/* The coefficients of R from the highest power of s^2 down */
+static const real log_coefft[] = {
+#ifndef FFTW_ENABLE_FLOAT
+  1.479819860511658591e-01, 1.531383769920937332e-01,
+  1.818357216161805012e-01, 2.222219843214978396e-01,
+  2.857142874366239149e-01, 3.999999999940941908e-01,
+  6.666666666666735130e-01
+#else
+  2.22222222222222222e-01, 2.85714285714285714e-01,
+  4.00000000000000000e-01, 6.66666666666666667e-01
+#endif
+};
+
+/* sin(a) = a + a^3 S(a^2) and cos(a) = 1 + a^2 C(a^2): the
+   coefficients of S and C from the highest power of a^2 down */
+static const real sin_coefft[] = {
+#ifndef FFTW_ENABLE_FLOAT
+  -7.64716373181981648e-13, 1.60590438368216146e-10,
+  -2.50521083854417188e-08,
+#endif
+  2.75573192239858907e-06, -1.98412698412698413e-04,
+  8.33333333333333333e-03, -1.66666666666666667e-01
+};
+
+static const real cos_coefft[] = {
+#ifndef FFTW_ENABLE_FLOAT
+  4.77947733238738530e-14, -1.14707455977297247e-11,
+  2.08767569878680990e-09,
+#endif
+  -2.75573192239858907e-07, 2.48015873015873016e-05,
+  -1.38888888888888889e-03, 4.16666666666666667e-02,
+  -5.00000000000000000e-01
+};
+
+/* The kernels of one instruction set */
+typedef struct {
+  const char *name;
+  double (*sum_squares)(const real *data, long int n);
+  void (*scale)(real *data, long int n, real scale, real offset);
+  void (*multiply)(real *data, const real *factor, long int n);
+  void (*multiply_complex)(complex *data, const complex *factor,
+			   long int n);
+  void (*threshold)(real **data, int nvars, int ivar, long int n,
+		    real threshold, real missing_value);
+  void (*exponential)(real *data, long int n);
+  void (*gaussian)(real *x, real *y, long int n);
+} simd_kernels;
+
+/* Add the lanes of the sum of squares and the remaining elements */
+static
+double
+sum_lanes(const double *lane, const real *data, long int start,
+	  long int n)
+{
+  double sum = ((lane[0] + lane[1]) + (lane[2] + lane[3]))
+    + ((lane[4] + lane[5]) + (lane[6] + lane[7]));
+  long int i;
+  for (i = start; i < n; i++) {
+    sum += data[i]*data[i];
+  }
+  return sum;
+}
+
+
+/* GENERIC KERNELS */
+
+static
+double
+generic_sum_squares(const real *data, long int n)
+{
+  double lane[LANES] = {0.0};
+  long int i, m = n - n % LANES;
+  int l;
+  for (i = 0; i < m; i += LANES) {
+    for (l = 0; l < LANES; l++) {
+      lane[l] += data[i+l]*data[i+l];
+    }
+  }
+  return sum_lanes(lane, data, m, n);
+}
+
+static
+void
+generic_scale(real *data, long int n, real scale, real offset)
+{
+  long int i;
+  for (i = 0; i < n; i++) {
+    data[i] = data[i] * scale + offset;
+  }
+}
+
+static
+void
+generic_multiply(real *data, const real *factor, long int n)
+{
+  long int i;
+  for (i = 0; i < n; i++) {
+    data[i] *= factor[i];
+  }
+}
+
+static
+void
+generic_multiply_complex(complex *data, const complex *factor, long int n)
+{
+  long int i;
+  for (i = 0; i < n; i++) {
+    data[i] *= factor[i];
+  }
+}
+
+static
+void
+generic_threshold(real **data, int nvars, int ivar, long int n,
+		  real threshold, real missing_value)
+{
+  long int i;
+  int v;
+  for (i = 0; i < n; i++) {
+    if (data[ivar][i] < threshold) {
+      for (v = 0; v < nvars; v++) {
+	data[v][i] = missing_value;
+      }
+    }
+  }
+}
+
+static
+void
+generic_exp(real *data, long int n)
+{
+  const real shift = EXP_SHIFT;
+  exp_bits shift_bits;
+  long int i;
+  int d;
+  memcpy(&shift_bits, &shift, sizeof(shift_bits));
+  for (i = 0; i < n; i++) {
+    real x = data[i];
+    real t = x * EXP_LOG2E + EXP_SHIFT;
+    real m = t - EXP_SHIFT;
+    real r = (x - m * EXP_LN2_HI) - m * EXP_LN2_LO;
+    real p = exp_coefft[0];
+    real scale;
+    exp_bits bits;
+    for (d = 1; d <= EXP_DEGREE; d++) {
+      p = p * r + exp_coefft[d];
+    }
+    memcpy(&bits, &t, sizeof(bits));
+    bits = (bits - shift_bits + EXP_BIAS) << EXP_MANTISSA;
+    memcpy(&scale, &bits, sizeof(scale));
+    p = (p * 2.0) * scale;
+    if (x > EXP_MAX) {
+      p = INFINITY;
+    }
+    else if (x < EXP_MIN) {
+      p = 0.0;
+    }
+    data[i] = p;
+  }
+}
+
+static
+void
+generic_gaussian(real *x, real *y, long int n)
+{
+  const real one = 1.0, half = 0.5, quarter = 0.25, four = 4.0;
+  const real minus_two = -2.0;
+  long int i;
+  int d;
+  for (i = 0; i < n; i++) {
+    real u = x[i];
+    real v = y[i];
+    real k, m, s, z, p, r, t, q, a, sn, cs;
+    exp_bits bits, csign, ssign;
+    /* r = sqrt(-2 ln u) */
+    memcpy(&bits, &u, sizeof(bits));
+    bits = (bits >> EXP_MANTISSA) | GAUSS_MAGIC_BITS;
+    memcpy(&k, &bits, sizeof(k));
+    k = k - GAUSS_MAGIC;
+    memcpy(&bits, &u, sizeof(bits));
+    bits = (bits & GAUSS_MANTISSA_MASK) | GAUSS_ONE_BITS;
+    memcpy(&m, &bits, sizeof(m));
+    if (m > GAUSS_SQRT2) {
+      m = m * half;
+      k = k + one;
+    }
+    s = (m - one) / (m + one);
+    z = s * s;
+    p = log_coefft[0];
+    for (d = 1; d < LOG_TERMS; d++) {
+      p = p * z + log_coefft[d];
+    }
+    r = (k - GAUSS_BIAS) * GAUSS_LN2 + ((s + s) + s * (p * z));
+    r = sqrt(r * minus_two);
+    /* sin and cos of 2 pi v */
+    t = v * four + EXP_SHIFT;
+    q = t - EXP_SHIFT;
+    a = (v - q * quarter) * GAUSS_TWO_PI;
+    z = a * a;
+    p = sin_coefft[0];
+    for (d = 1; d < SIN_TERMS; d++) {
+      p = p * z + sin_coefft[d];
+    }
+    sn = a + (a * z) * p;
+    p = cos_coefft[0];
+    for (d = 1; d < COS_TERMS; d++) {
+      p = p * z + cos_coefft[d];
+    }
+    cs = z * p + one;
+    /* Odd quadrants swap sin and cos, and quadrants 2 and 3 negate
+       the sine and 1 and 2 the cosine */
+    if (q * half != (q * half + EXP_SHIFT) - EXP_SHIFT) {
+      p = sn;
+      sn = cs;
+      cs = p;
+    }
+    memcpy(&bits, &t, sizeof(bits));
+    ssign = (bits >> 1) << GAUSS_SIGN;
+    csign = ((bits + 1) >> 1) << GAUSS_SIGN;
+    memcpy(&bits, &cs, sizeof(bits));
+    bits ^= csign;
+    memcpy(&cs, &bits, sizeof(cs));
+    memcpy(&bits, &sn, sizeof(bits));
+    bits ^= ssign;
+    memcpy(&sn, &bits, sizeof(sn));
+    x[i] = r * cs;
+    y[i] = r * sn;
+  }
+}
+
+static const simd_kernels generic_kernels = {
+  "generic", generic_sum_squares, generic_scale, generic_multiply,
+  generic_multiply_complex, generic_threshold, generic_exp,
+  generic_gaussian
+};
+
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define CG_SIMD_X86
+#include <immintrin.h>
+
+/* Each instruction set is written once for both precisions with the
+   following macros: V128(op) is the SSE2 intrinsic _mm_op_ps or
+   _mm_op_pd, and similarly for AVX (V256) and AVX-512 (V512). N128
+   etc. are the number of reals per vector. */
+#ifdef FFTW_ENABLE_FLOAT
+#define V128(op) _mm_##op##_ps
+#define V256(op) _mm256_##op##_ps
+#define V512(op) _mm512_##op##_ps
+#define vec128 __m128
+#define vec256 __m256
+#define vec512 __m512
+#define N128 4
+#define I128(op) _mm_##op##_epi32
+#define I256(op) _mm256_##op##_epi32
+#define I512(op) _mm512_##op##_epi32
+#define BITS128(v) _mm_castps_si128(v)
+#define BITS256(v) _mm256_castps_si256(v)
+#define BITS512(v) _mm512_castps_si512(v)
+#define REAL128(v) _mm_castsi128_ps(v)
+#define REAL256(v) _mm256_castsi256_ps(v)
+#define REAL512(v) _mm512_castsi512_ps(v)
+#define SET1_BITS128(b) _mm_set1_epi32((int) (b))
+#define SET1_BITS256(b) _mm256_set1_epi32((int) (b))
+#define SET1_BITS512(b) _mm512_set1_epi32((int) (b))
+#else
+#define V128(op) _mm_##op##_pd
+#define V256(op) _mm256_##op##_pd
+#define V512(op) _mm512_##op##_pd
+#define vec128 __m128d
+#define vec256 __m256d
+#define vec512 __m512d
+#define N128 2
+#define I128(op) _mm_##op##_epi64
+#define I256(op) _mm256_##op##_epi64
+#define I512(op) _mm512_##op##_epi64
+#define BITS128(v) _mm_castpd_si128(v)
+#define BITS256(v) _mm256_castpd_si256(v)
+#define BITS512(v) _mm512_castpd_si512(v)
+#define REAL128(v) _mm_castsi128_pd(v)
+#define REAL256(v) _mm256_castsi256_pd(v)
+#define REAL512(v) _mm512_castsi512_pd(v)
+#define SET1_BITS128(b) _mm_set1_epi64x((long long) (b))
+#define SET1_BITS256(b) _mm256_set1_epi64x((long long) (b))
+#define SET1_BITS512(b) _mm512_set1_epi64((long long) (b))
+#endif
+#define N256 (2*N128)
+#define N512 (4*N128)
+
+
+/* SSE2 KERNELS */
+
+__attribute__((target("sse2")))
+static
+double
+sse2_sum_squares(const real *data, long int n)
+{
+  double lane[LANES];
+  __m128d acc[4];
+  long int i, m = n - n % LANES;
+  int l;
+  for (l = 0; l < 4; l++) {
+    acc[l] = _mm_setzero_pd();
+  }
+  for (i = 0; i < m; i += LANES) {
+#ifdef FFTW_ENABLE_FLOAT
+    __m128 a = _mm_loadu_ps(data + i);
+    __m128 b = _mm_loadu_ps(data + i + 4);
+    a = _mm_mul_ps(a, a);
+    b = _mm_mul_ps(b, b);
+    acc[0] = _mm_add_pd(acc[0], _mm_cvtps_pd(a));
+    acc[1] = _mm_add_pd(acc[1], _mm_cvtps_pd(_mm_movehl_ps(a, a)));
+    acc[2] = _mm_add_pd(acc[2], _mm_cvtps_pd(b));
+    acc[3] = _mm_add_pd(acc[3], _mm_cvtps_pd(_mm_movehl_ps(b, b)));
+#else
+    for (l = 0; l < 4; l++) {
+      __m128d a = _mm_loadu_pd(data + i + 2*l);
+      acc[l] = _mm_add_pd(acc[l], _mm_mul_pd(a, a));
+    }
+#endif
+  }
+  for (l = 0; l < 4; l++) {
+    _mm_storeu_pd(lane + 2*l, acc[l]);
+  }
+  return sum_lanes(lane, data, m, n);
+}
+
+__attribute__((target("sse2")))
+static
+void
+sse2_scale(real *data, long int n, real scale, real offset)
+{
+  vec128 s = V128(set1)(scale);
+  vec128 o = V128(set1)(offset);
+  long int i;
+  for (i = 0; i + N128 <= n; i += N128) {
+    V128(storeu)(data + i, V128(add)(V128(mul)(V128(loadu)(data + i), s), o));
+  }
+  generic_scale(data + i, n - i, scale, offset);
+}
+
+__attribute__((target("sse2")))
+static
+void
+sse2_multiply(real *data, const real *factor, long int n)
+{
+  long int i;
+  for (i = 0; i + N128 <= n; i += N128) {
+    V128(storeu)(data + i, V128(mul)(V128(loadu)(data + i),
+				     V128(loadu)(factor + i)));
+  }
+  generic_multiply(data + i, factor + i, n - i);
+}
+
+/* (a+bi)(c+di) = (ac-bd) + (ad+bc)i, with ac + (-bd) in place of the
+   subtraction, which gives the same result */
+__attribute__((target("sse2")))
+static
+void
+sse2_multiply_complex(complex *data, const complex *factor, long int n)
+{
+  real *d = (real *) data;
+  const real *f = (const real *) factor;
+  long int i;
+#ifdef FFTW_ENABLE_FLOAT
+  const __m128 sign = _mm_set_ps(0.0f, -0.0f, 0.0f, -0.0f);
+  for (i = 0; i + 2 <= n; i += 2) {
+    __m128 a = _mm_loadu_ps(d + 2*i);
+    __m128 c = _mm_loadu_ps(f + 2*i);
+    __m128 re = _mm_shuffle_ps(c, c, _MM_SHUFFLE(2, 2, 0, 0));
+    __m128 im = _mm_shuffle_ps(c, c, _MM_SHUFFLE(3, 3, 1, 1));
+    __m128 swap = _mm_shuffle_ps(a, a, _MM_SHUFFLE(2, 3, 0, 1));
+    _mm_storeu_ps(d + 2*i,
+		  _mm_add_ps(_mm_mul_ps(a, re),
+			     _mm_xor_ps(_mm_mul_ps(swap, im), sign)));
+  }
+#else
+  const __m128d sign = _mm_set_pd(0.0, -0.0);
+  for (i = 0; i < n; i++) {
+    __m128d a = _mm_loadu_pd(d + 2*i);
+    __m128d c = _mm_loadu_pd(f + 2*i);
+    __m128d re = _mm_unpacklo_pd(c, c);
+    __m128d im = _mm_unpackhi_pd(c, c);
+    __m128d swap = _mm_shuffle_pd(a, a, 1);
+    _mm_storeu_pd(d + 2*i,
+		  _mm_add_pd(_mm_mul_pd(a, re),
+			     _mm_xor_pd(_mm_mul_pd(swap, im), sign)));
+  }
+#endif
+  generic_multiply_complex(data + i, factor + i, n - i);
+}
+
+__attribute__((target("sse2")))
+static
+void
+sse2_threshold(real **data, int nvars, int ivar, long int n,
+	       real threshold, real missing_value)
+{
+  vec128 t = V128(set1)(threshold);
+  vec128 missing = V128(set1)(missing_value);
+  long int i;
+  int v;
+  for (i = 0; i + N128 <= n; i += N128) {
+    vec128 mask = V128(cmplt)(V128(loadu)(data[ivar] + i), t);
+    for (v = 0; v < nvars; v++) {
+      vec128 value = V128(loadu)(data[v] + i);
+      V128(storeu)(data[v] + i, V128(or)(V128(and)(mask, missing),
+					 V128(andnot)(mask, value)));
+    }
+  }
+  if (i < n) {
+    real *rest[CG_MAX_VARS];
+    for (v = 0; v < nvars; v++) {
+      rest[v] = data[v] + i;
+    }
+    generic_threshold(rest, nvars, ivar, n - i, threshold, missing_value);
+  }
+}
+
+__attribute__((target("sse2")))
+static
+void
+sse2_exp(real *data, long int n)
+{
+  const real shift = EXP_SHIFT;
+  exp_bits shift_bits;
+  long int i;
+  int d;
+  memcpy(&shift_bits, &shift, sizeof(shift_bits));
+  for (i = 0; i + N128 <= n; i += N128) {
+    vec128 x = V128(loadu)(data + i);
+    vec128 t = V128(add)(V128(mul)(x, V128(set1)(EXP_LOG2E)),
+			 V128(set1)(EXP_SHIFT));
+    vec128 m = V128(sub)(t, V128(set1)(EXP_SHIFT));
+    vec128 r = V128(sub)(V128(sub)(x, V128(mul)(m, V128(set1)(EXP_LN2_HI))),
+			 V128(mul)(m, V128(set1)(EXP_LN2_LO)));
+    vec128 p = V128(set1)(exp_coefft[0]);
+    vec128 scale, big, small;
+    for (d = 1; d <= EXP_DEGREE; d++) {
+      p = V128(add)(V128(mul)(p, r), V128(set1)(exp_coefft[d]));
+    }
+    scale = REAL128(I128(slli)(I128(add)(I128(sub)(BITS128(t),
+					   SET1_BITS128(shift_bits)),
+					 SET1_BITS128(EXP_BIAS)),
+			       EXP_MANTISSA));
+    p = V128(mul)(V128(mul)(p, V128(set1)(2.0)), scale);
+    big = V128(cmpgt)(x, V128(set1)(EXP_MAX));
+    small = V128(cmplt)(x, V128(set1)(EXP_MIN));
+    p = V128(or)(V128(and)(big, V128(set1)(INFINITY)), V128(andnot)(big, p));
+    V128(storeu)(data + i, V128(andnot)(small, p));
+  }
+  generic_exp(data + i, n - i);
+}
+
+__attribute__((target("sse2")))
+static
+void
+sse2_gaussian(real *x, real *y, long int n)
+{
+  long int i;
+  int d;
+  for (i = 0; i + N128 <= n; i += N128) {
+    vec128 u = V128(loadu)(x + i);
+    vec128 v = V128(loadu)(y + i);
+    vec128 k, m, s, z, p, r, t, q, a, sn, cs, big, odd;
+    __m128i csign, ssign;
+    /* r = sqrt(-2 ln u) */
+    k = REAL128(_mm_or_si128(I128(srli)(BITS128(u), EXP_MANTISSA),
+			     SET1_BITS128(GAUSS_MAGIC_BITS)));
+    k = V128(sub)(k, V128(set1)(GAUSS_MAGIC));
+    m = REAL128(_mm_or_si128(_mm_and_si128(BITS128(u),
+					   SET1_BITS128(GAUSS_MANTISSA_MASK)),
+			     SET1_BITS128(GAUSS_ONE_BITS)));
+    big = V128(cmpgt)(m, V128(set1)(GAUSS_SQRT2));
+    m = V128(or)(V128(and)(big, V128(mul)(m, V128(set1)(0.5))),
+		 V128(andnot)(big, m));
+    k = V128(add)(k, V128(and)(big, V128(set1)(1.0)));
+    s = V128(div)(V128(sub)(m, V128(set1)(1.0)),
+		  V128(add)(m, V128(set1)(1.0)));
+    z = V128(mul)(s, s);
+    p = V128(set1)(log_coefft[0]);
+    for (d = 1; d < LOG_TERMS; d++) {
+      p = V128(add)(V128(mul)(p, z), V128(set1)(log_coefft[d]));
+    }
+    r = V128(add)(V128(mul)(V128(sub)(k, V128(set1)(GAUSS_BIAS)),
+			    V128(set1)(GAUSS_LN2)),
+		  V128(add)(V128(add)(s, s), V128(mul)(s, V128(mul)(p, z))));
+    r = V128(sqrt)(V128(mul)(r, V128(set1)(-2.0)));
+    /* sin and cos of 2 pi v */
+    t = V128(add)(V128(mul)(v, V128(set1)(4.0)), V128(set1)(EXP_SHIFT));
+    q = V128(sub)(t, V128(set1)(EXP_SHIFT));
+    a = V128(mul)(V128(sub)(v, V128(mul)(q, V128(set1)(0.25))),
+		  V128(set1)(GAUSS_TWO_PI));
+    z = V128(mul)(a, a);
+    p = V128(set1)(sin_coefft[0]);
+    for (d = 1; d < SIN_TERMS; d++) {
+      p = V128(add)(V128(mul)(p, z), V128(set1)(sin_coefft[d]));
+    }
+    sn = V128(add)(a, V128(mul)(V128(mul)(a, z), p));
+    p = V128(set1)(cos_coefft[0]);
+    for (d = 1; d < COS_TERMS; d++) {
+      p = V128(add)(V128(mul)(p, z), V128(set1)(cos_coefft[d]));
+    }
+    cs = V128(add)(V128(mul)(z, p), V128(set1)(1.0));
+    q = V128(mul)(q, V128(set1)(0.5));
+    odd = V128(cmpneq)(q, V128(sub)(V128(add)(q, V128(set1)(EXP_SHIFT)),
+				    V128(set1)(EXP_SHIFT)));
+    p = V128(or)(V128(and)(odd, cs), V128(andnot)(odd, sn));
+    cs = V128(or)(V128(and)(odd, sn), V128(andnot)(odd, cs));
+    sn = p;
+    ssign = I128(slli)(I128(srli)(BITS128(t), 1), GAUSS_SIGN);
+    csign = I128(slli)(I128(srli)(I128(add)(BITS128(t), SET1_BITS128(1)), 1),
+		       GAUSS_SIGN);
+    cs = REAL128(_mm_xor_si128(BITS128(cs), csign));
+    sn = REAL128(_mm_xor_si128(BITS128(sn), ssign));
+    V128(storeu)(x + i, V128(mul)(r, cs));
+    V128(storeu)(y + i, V128(mul)(r, sn));
+  }
+  generic_gaussian(x + i, y + i, n - i);
+}
+
+static const simd_kernels sse2_kernels = {
+  "sse2", sse2_sum_squares, sse2_scale, sse2_multiply,
+  sse2_multiply_complex, sse2_threshold, sse2_exp, sse2_gaussian
+};
+
+
+/* AVX2 KERNELS */
+
+__attribute__((target("avx2")))
+static
+double
+avx2_sum_squares(const real *data, long int n)
+{
+  double lane[LANES];
+  __m256d acc[2] = {_mm256_setzero_pd(), _mm256_setzero_pd()};
+  long int i, m = n - n % LANES;
+  for (i = 0; i < m; i += LANES) {
+#ifdef FFTW_ENABLE_FLOAT
+    __m256 a = _mm256_loadu_ps(data + i);
+    a = _mm256_mul_ps(a, a);
+    acc[0] = _mm256_add_pd(acc[0],
+			   _mm256_cvtps_pd(_mm256_castps256_ps128(a)));
+    acc[1] = _mm256_add_pd(acc[1],
+			   _mm256_cvtps_pd(_mm256_extractf128_ps(a, 1)));
+#else
+    __m256d a = _mm256_loadu_pd(data + i);
+    __m256d b = _mm256_loadu_pd(data + i + 4);
+    acc[0] = _mm256_add_pd(acc[0], _mm256_mul_pd(a, a));
+    acc[1] = _mm256_add_pd(acc[1], _mm256_mul_pd(b, b));
+#endif
+  }
+  _mm256_storeu_pd(lane, acc[0]);
+  _mm256_storeu_pd(lane + 4, acc[1]);
+  return sum_lanes(lane, data, m, n);
+}
+
+__attribute__((target("avx2")))
+static
+void
+avx2_scale(real *data, long int n, real scale, real offset)
+{
+  vec256 s = V256(set1)(scale);
+  vec256 o = V256(set1)(offset);
+  long int i;
+  for (i = 0; i + N256 <= n; i += N256) {
+    V256(storeu)(data + i, V256(add)(V256(mul)(V256(loadu)(data + i), s), o));
+  }
+  generic_scale(data + i, n - i, scale, offset);
+}
+
+__attribute__((target("avx2")))
+static
+void
+avx2_multiply(real *data, const real *factor, long int n)
+{
+  long int i;
+  for (i = 0; i + N256 <= n; i += N256) {
+    V256(storeu)(data + i, V256(mul)(V256(loadu)(data + i),
+				     V256(loadu)(factor + i)));
+  }
+  generic_multiply(data + i, factor + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static
+void
+avx2_multiply_complex(complex *data, const complex *factor, long int n)
+{
+  real *d = (real *) data;
+  const real *f = (const real *) factor;
+  long int i;
+  for (i = 0; i + N256/2 <= n; i += N256/2) {
+    vec256 a = V256(loadu)(d + 2*i);
+    vec256 c = V256(loadu)(f + 2*i);
+#ifdef FFTW_ENABLE_FLOAT
+    __m256 re = _mm256_moveldup_ps(c);
+    __m256 im = _mm256_movehdup_ps(c);
+    __m256 swap = _mm256_permute_ps(a, 0xB1);
+#else
+    __m256d re = _mm256_movedup_pd(c);
+    __m256d im = _mm256_permute_pd(c, 0xF);
+    __m256d swap = _mm256_permute_pd(a, 0x5);
+#endif
+    V256(storeu)(d + 2*i, V256(addsub)(V256(mul)(a, re),
+				       V256(mul)(swap, im)));
+  }
+  generic_multiply_complex(data + i, factor + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static
+void
+avx2_threshold(real **data, int nvars, int ivar, long int n,
+	       real threshold, real missing_value)
+{
+  vec256 t = V256(set1)(threshold);
+  vec256 missing = V256(set1)(missing_value);
+  long int i;
+  int v;
+  for (i = 0; i + N256 <= n; i += N256) {
+    vec256 mask = V256(cmp)(V256(loadu)(data[ivar] + i), t, _CMP_LT_OQ);
+    for (v = 0; v < nvars; v++) {
+      V256(storeu)(data[v] + i,
+		   V256(blendv)(V256(loadu)(data[v] + i), missing, mask));
+    }
+  }
+  if (i < n) {
+    real *rest[CG_MAX_VARS];
+    for (v = 0; v < nvars; v++) {
+      rest[v] = data[v] + i;
+    }
+    generic_threshold(rest, nvars, ivar, n - i, threshold, missing_value);
+  }
+}
+
+__attribute__((target("avx2")))
+static
+void
+avx2_exp(real *data, long int n)
+{
+  const real shift = EXP_SHIFT;
+  exp_bits shift_bits;
+  long int i;
+  int d;
+  memcpy(&shift_bits, &shift, sizeof(shift_bits));
+  for (i = 0; i + N256 <= n; i += N256) {
+    vec256 x = V256(loadu)(data + i);
+    vec256 t = V256(add)(V256(mul)(x, V256(set1)(EXP_LOG2E)),
+			 V256(set1)(EXP_SHIFT));
+    vec256 m = V256(sub)(t, V256(set1)(EXP_SHIFT));
+    vec256 r = V256(sub)(V256(sub)(x, V256(mul)(m, V256(set1)(EXP_LN2_HI))),
+			 V256(mul)(m, V256(set1)(EXP_LN2_LO)));
+    vec256 p = V256(set1)(exp_coefft[0]);
+    vec256 scale;
+    for (d = 1; d <= EXP_DEGREE; d++) {
+      p = V256(add)(V256(mul)(p, r), V256(set1)(exp_coefft[d]));
+    }
+    scale = REAL256(I256(slli)(I256(add)(I256(sub)(BITS256(t),
+					   SET1_BITS256(shift_bits)),
+					 SET1_BITS256(EXP_BIAS)),
+			       EXP_MANTISSA));
+    p = V256(mul)(V256(mul)(p, V256(set1)(2.0)), scale);
+    p = V256(blendv)(p, V256(set1)(INFINITY),
+		     V256(cmp)(x, V256(set1)(EXP_MAX), _CMP_GT_OQ));
+    p = V256(blendv)(p, V256(setzero)(),
+		     V256(cmp)(x, V256(set1)(EXP_MIN), _CMP_LT_OQ));
+    V256(storeu)(data + i, p);
+  }
+  generic_exp(data + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static
+void
+avx2_gaussian(real *x, real *y, long int n)
+{
+  long int i;
+  int d;
+  for (i = 0; i + N256 <= n; i += N256) {
+    vec256 u = V256(loadu)(x + i);
+    vec256 v = V256(loadu)(y + i);
+    vec256 k, m, s, z, p, r, t, q, a, sn, cs, big, odd;
+    __m256i csign, ssign;
+    /* r = sqrt(-2 ln u) */
+    k = REAL256(_mm256_or_si256(I256(srli)(BITS256(u), EXP_MANTISSA),
+				SET1_BITS256(GAUSS_MAGIC_BITS)));
+    k = V256(sub)(k, V256(set1)(GAUSS_MAGIC));
+    m = REAL256(_mm256_or_si256(
+		  _mm256_and_si256(BITS256(u),
+				   SET1_BITS256(GAUSS_MANTISSA_MASK)),
+		  SET1_BITS256(GAUSS_ONE_BITS)));
+    big = V256(cmp)(m, V256(set1)(GAUSS_SQRT2), _CMP_GT_OQ);
+    m = V256(blendv)(m, V256(mul)(m, V256(set1)(0.5)), big);
+    k = V256(add)(k, V256(and)(big, V256(set1)(1.0)));
+    s = V256(div)(V256(sub)(m, V256(set1)(1.0)),
+		  V256(add)(m, V256(set1)(1.0)));
+    z = V256(mul)(s, s);
+    p = V256(set1)(log_coefft[0]);
+    for (d = 1; d < LOG_TERMS; d++) {
+      p = V256(add)(V256(mul)(p, z), V256(set1)(log_coefft[d]));
+    }
+    r = V256(add)(V256(mul)(V256(sub)(k, V256(set1)(GAUSS_BIAS)),
+			    V256(set1)(GAUSS_LN2)),
+		  V256(add)(V256(add)(s, s), V256(mul)(s, V256(mul)(p, z))));
+    r = V256(sqrt)(V256(mul)(r, V256(set1)(-2.0)));
+    /* sin and cos of 2 pi v */
+    t = V256(add)(V256(mul)(v, V256(set1)(4.0)), V256(set1)(EXP_SHIFT));
+    q = V256(sub)(t, V256(set1)(EXP_SHIFT));
+    a = V256(mul)(V256(sub)(v, V256(mul)(q, V256(set1)(0.25))),
+		  V256(set1)(GAUSS_TWO_PI));
+    z = V256(mul)(a, a);
+    p = V256(set1)(sin_coefft[0]);
+    for (d = 1; d < SIN_TERMS; d++) {
+      p = V256(add)(V256(mul)(p, z), V256(set1)(sin_coefft[d]));
+    }
+    sn = V256(add)(a, V256(mul)(V256(mul)(a, z), p));
+    p = V256(set1)(cos_coefft[0]);
+    for (d = 1; d < COS_TERMS; d++) {
+      p = V256(add)(V256(mul)(p, z), V256(set1)(cos_coefft[d]));
+    }
+    cs = V256(add)(V256(mul)(z, p), V256(set1)(1.0));
+    q = V256(mul)(q, V256(set1)(0.5));
+    odd = V256(cmp)(q, V256(sub)(V256(add)(q, V256(set1)(EXP_SHIFT)),
+				 V256(set1)(EXP_SHIFT)), _CMP_NEQ_OQ);
+    p = V256(blendv)(sn, cs, odd);
+    cs = V256(blendv)(cs, sn, odd);
+    sn = p;
+    ssign = I256(slli)(I256(srli)(BITS256(t), 1), GAUSS_SIGN);
+    csign = I256(slli)(I256(srli)(I256(add)(BITS256(t), SET1_BITS256(1)), 1),
+		       GAUSS_SIGN);
+    cs = REAL256(_mm256_xor_si256(BITS256(cs), csign));
+    sn = REAL256(_mm256_xor_si256(BITS256(sn), ssign));
+    V256(storeu)(x + i, V256(mul)(r, cs));
+    V256(storeu)(y + i, V256(mul)(r, sn));
+  }
+  generic_gaussian(x + i, y + i, n - i);
+}
+
+static const simd_kernels avx2_kernels = {
+  "avx2", avx2_sum_squares, avx2_scale, avx2_multiply,
+  avx2_multiply_complex, avx2_threshold, avx2_exp, avx2_gaussian
+};
+
+
+/* AVX-512 KERNELS */
+
+__attribute__((target("avx512f")))
+static
+double
+avx512_sum_squares(const real *data, long int n)
+{
+  double lane[LANES];
+  __m512d acc = _mm512_setzero_pd();
+  long int i, m = n - n % LANES;
+  for (i = 0; i < m; i += LANES) {
+#ifdef FFTW_ENABLE_FLOAT
+    __m256 a = _mm256_loadu_ps(data + i);
+    acc = _mm512_add_pd(acc, _mm512_cvtps_pd(_mm256_mul_ps(a, a)));
+#else
+    __m512d a = _mm512_loadu_pd(data + i);
+    acc = _mm512_add_pd(acc, _mm512_mul_pd(a, a));
+#endif
+  }
+  _mm512_storeu_pd(lane, acc);
+  return sum_lanes(lane, data, m, n);
+}
+
+__attribute__((target("avx512f")))
+static
+void
+avx512_scale(real *data, long int n, real scale, real offset)
+{
+  vec512 s = V512(set1)(scale);
+  vec512 o = V512(set1)(offset);
+  long int i;
+  for (i = 0; i + N512 <= n; i += N512) {
+    V512(storeu)(data + i, V512(add)(V512(mul)(V512(loadu)(data + i), s), o));
+  }
+  generic_scale(data + i, n - i, scale, offset);
+}
+
+__attribute__((target("avx512f")))
+static
+void
+avx512_multiply(real *data, const real *factor, long int n)
+{
+  long int i;
+  for (i = 0; i + N512 <= n; i += N512) {
+    V512(storeu)(data + i, V512(mul)(V512(loadu)(data + i),
+				     V512(loadu)(factor + i)));
+  }
+  generic_multiply(data + i, factor + i, n - i);
+}
+
+/* AVX-512F has no addsub, so the sign of the real part of the second
+   product is flipped instead, as for SSE2 */
+__attribute__((target("avx512f")))
+static
+void
+avx512_multiply_complex(complex *data, const complex *factor, long int n)
+{
+  real *d = (real *) data;
+  const real *f = (const real *) factor;
+  long int i;
+#ifdef FFTW_ENABLE_FLOAT
+  const __m512i sign = _mm512_set1_epi64(0x80000000LL);
+#else
+  const __m512i sign = _mm512_set_epi64(0, 0x8000000000000000LL,
+					0, 0x8000000000000000LL,
+					0, 0x8000000000000000LL,
+					0, 0x8000000000000000LL);
+#endif
+  for (i = 0; i + N512/2 <= n; i += N512/2) {
+    vec512 a = V512(loadu)(d + 2*i);
+    vec512 c = V512(loadu)(f + 2*i);
+#ifdef FFTW_ENABLE_FLOAT
+    __m512 re = _mm512_moveldup_ps(c);
+    __m512 im = _mm512_movehdup_ps(c);
+    __m512 swap = _mm512_permute_ps(a, 0xB1);
+    __m512 cross = _mm512_castsi512_ps(
+      _mm512_xor_si512(_mm512_castps_si512(_mm512_mul_ps(swap, im)), sign));
+#else
+    __m512d re = _mm512_movedup_pd(c);
+    __m512d im = _mm512_permute_pd(c, 0xFF);
+    __m512d swap = _mm512_permute_pd(a, 0x55);
+    __m512d cross = _mm512_castsi512_pd(
+      _mm512_xor_si512(_mm512_castpd_si512(_mm512_mul_pd(swap, im)), sign));
+#endif
+    V512(storeu)(d + 2*i, V512(add)(V512(mul)(a, re), cross));
+  }
+  generic_multiply_complex(data + i, factor + i, n - i);
+}
+
+__attribute__((target("avx512f")))
+static
+void
+avx512_threshold(real **data, int nvars, int ivar, long int n,
+		 real threshold, real missing_value)
+{
+  vec512 t = V512(set1)(threshold);
+  vec512 missing = V512(set1)(missing_value);
+  long int i;
+  int v;
+  for (i = 0; i + N512 <= n; i += N512) {
+#ifdef FFTW_ENABLE_FLOAT
+    __mmask16 mask = _mm512_cmp_ps_mask(_mm512_loadu_ps(data[ivar] + i), t,
+					_CMP_LT_OQ);
+#else
+    __mmask8 mask = _mm512_cmp_pd_mask(_mm512_loadu_pd(data[ivar] + i), t,
+				       _CMP_LT_OQ);
+#endif
+    for (v = 0; v < nvars; v++) {
+      V512(storeu)(data[v] + i,
+		   V512(mask_mov)(V512(loadu)(data[v] + i), mask, missing));
+    }
+  }
+  if (i < n) {
+    real *rest[CG_MAX_VARS];
+    for (v = 0; v < nvars; v++) {
+      rest[v] = data[v] + i;
+    }
+    generic_threshold(rest, nvars, ivar, n - i, threshold, missing_value);
+  }
+}
+
+__attribute__((target("avx512f")))
+static
+void
+avx512_exp(real *data, long int n)
+{
+  const real shift = EXP_SHIFT;
+  exp_bits shift_bits;
+  long int i;
+  int d;
+  memcpy(&shift_bits, &shift, sizeof(shift_bits));
+  for (i = 0; i + N512 <= n; i += N512) {
+    vec512 x = V512(loadu)(data + i);
+    vec512 t = V512(add)(V512(mul)(x, V512(set1)(EXP_LOG2E)),
+			 V512(set1)(EXP_SHIFT));
+    vec512 m = V512(sub)(t, V512(set1)(EXP_SHIFT));
+    vec512 r = V512(sub)(V512(sub)(x, V512(mul)(m, V512(set1)(EXP_LN2_HI))),
+			 V512(mul)(m, V512(set1)(EXP_LN2_LO)));
+    vec512 p = V512(set1)(exp_coefft[0]);
+    vec512 scale;
+    for (d = 1; d <= EXP_DEGREE; d++) {
+      p = V512(add)(V512(mul)(p, r), V512(set1)(exp_coefft[d]));
+    }
+    scale = REAL512(I512(slli)(I512(add)(I512(sub)(BITS512(t),
+					   SET1_BITS512(shift_bits)),
+					 SET1_BITS512(EXP_BIAS)),
+			       EXP_MANTISSA));
+    p = V512(mul)(V512(mul)(p, V512(set1)(2.0)), scale);
+#ifdef FFTW_ENABLE_FLOAT
+    p = _mm512_mask_mov_ps(p, _mm512_cmp_ps_mask(x, _mm512_set1_ps(EXP_MAX),
+						 _CMP_GT_OQ),
+			   _mm512_set1_ps(INFINITY));
+    p = _mm512_mask_mov_ps(p, _mm512_cmp_ps_mask(x, _mm512_set1_ps(EXP_MIN),
+						 _CMP_LT_OQ),
+			   _mm512_setzero_ps());
+#else
+    p = _mm512_mask_mov_pd(p, _mm512_cmp_pd_mask(x, _mm512_set1_pd(EXP_MAX),
+						 _CMP_GT_OQ),
+			   _mm512_set1_pd(INFINITY));
+    p = _mm512_mask_mov_pd(p, _mm512_cmp_pd_mask(x, _mm512_set1_pd(EXP_MIN),
+						 _CMP_LT_OQ),
+			   _mm512_setzero_pd());
+#endif
+    V512(storeu)(data + i, p);
+  }
+  generic_exp(data + i, n - i);
+}
+
+/* Selections are made with masks, and the signs flipped with integer
+   instructions as AVX-512F has no floating-point logic */
+__attribute__((target("avx512f")))
+static
+void
+avx512_gaussian(real *x, real *y, long int n)
+{
+  long int i;
+  int d;
+  for (i = 0; i + N512 <= n; i += N512) {
+    vec512 u = V512(loadu)(x + i);
+    vec512 v = V512(loadu)(y + i);
+    vec512 k, m, s, z, p, r, t, q, a, sn, cs;
+    __m512i csign, ssign;
+#ifdef FFTW_ENABLE_FLOAT
+    __mmask16 big, odd;
+#else
+    __mmask8 big, odd;
+#endif
+    /* r = sqrt(-2 ln u) */
+    k = REAL512(_mm512_or_si512(I512(srli)(BITS512(u), EXP_MANTISSA),
+				SET1_BITS512(GAUSS_MAGIC_BITS)));
+    k = V512(sub)(k, V512(set1)(GAUSS_MAGIC));
+    m = REAL512(_mm512_or_si512(
+		  _mm512_and_si512(BITS512(u),
+				   SET1_BITS512(GAUSS_MANTISSA_MASK)),
+		  SET1_BITS512(GAUSS_ONE_BITS)));
+#ifdef FFTW_ENABLE_FLOAT
+    big = _mm512_cmp_ps_mask(m, _mm512_set1_ps(GAUSS_SQRT2), _CMP_GT_OQ);
+#else
+    big = _mm512_cmp_pd_mask(m, _mm512_set1_pd(GAUSS_SQRT2), _CMP_GT_OQ);
+#endif
+    m = V512(mask_mul)(m, big, m, V512(set1)(0.5));
+    k = V512(mask_add)(k, big, k, V512(set1)(1.0));
+    s = V512(div)(V512(sub)(m, V512(set1)(1.0)),
+		  V512(add)(m, V512(set1)(1.0)));
+    z = V512(mul)(s, s);
+    p = V512(set1)(log_coefft[0]);
+    for (d = 1; d < LOG_TERMS; d++) {
+      p = V512(add)(V512(mul)(p, z), V512(set1)(log_coefft[d]));
+    }
+    r = V512(add)(V512(mul)(V512(sub)(k, V512(set1)(GAUSS_BIAS)),
+			    V512(set1)(GAUSS_LN2)),
+		  V512(add)(V512(add)(s, s), V512(mul)(s, V512(mul)(p, z))));
+    r = V512(sqrt)(V512(mul)(r, V512(set1)(-2.0)));
+    /* sin and cos of 2 pi v */
+    t = V512(add)(V512(mul)(v, V512(set1)(4.0)), V512(set1)(EXP_SHIFT));
+    q = V512(sub)(t, V512(set1)(EXP_SHIFT));
+    a = V512(mul)(V512(sub)(v, V512(mul)(q, V512(set1)(0.25))),
+		  V512(set1)(GAUSS_TWO_PI));
+    z = V512(mul)(a, a);
+    p = V512(set1)(sin_coefft[0]);
+    for (d = 1; d < SIN_TERMS; d++) {
+      p = V512(add)(V512(mul)(p, z), V512(set1)(sin_coefft[d]));
+    }
+    sn = V512(add)(a, V512(mul)(V512(mul)(a, z), p));
+    p = V512(set1)(cos_coefft[0]);
+    for (d = 1; d < COS_TERMS; d++) {
+      p = V512(add)(V512(mul)(p, z), V512(set1)(cos_coefft[d]));
+    }
+    cs = V512(add)(V512(mul)(z, p), V512(set1)(1.0));
+    q = V512(mul)(q, V512(set1)(0.5));
+#ifdef FFTW_ENABLE_FLOAT
+    odd = _mm512_cmp_ps_mask(q, _mm512_sub_ps(_mm512_add_ps(q,
+			       _mm512_set1_ps(EXP_SHIFT)),
+			     _mm512_set1_ps(EXP_SHIFT)), _CMP_NEQ_OQ);
+#else
+    odd = _mm512_cmp_pd_mask(q, _mm512_sub_pd(_mm512_add_pd(q,
+			       _mm512_set1_pd(EXP_SHIFT)),
+			     _mm512_set1_pd(EXP_SHIFT)), _CMP_NEQ_OQ);
+#endif
+    p = V512(mask_mov)(sn, odd, cs);
+    cs = V512(mask_mov)(cs, odd, sn);
+    sn = p;
+    ssign = I512(slli)(I512(srli)(BITS512(t), 1), GAUSS_SIGN);
+    csign = I512(slli)(I512(srli)(I512(add)(BITS512(t), SET1_BITS512(1)), 1),
+		       GAUSS_SIGN);
+    cs = REAL512(_mm512_xor_si512(BITS512(cs), csign));
+    sn = REAL512(_mm512_xor_si512(BITS512(sn), ssign));
+    V512(storeu)(x + i, V512(mul)(r, cs));
+    V512(storeu)(y + i, V512(mul)(r, sn));
+  }
+  generic_gaussian(x + i, y + i, n - i);
+}
+
+static const simd_kernels avx512_kernels = {
+  "avx512", avx512_sum_squares, avx512_scale, avx512_multiply,
+  avx512_multiply_complex, avx512_threshold, avx512_exp, avx512_gaussian
+};
+#endif
+
+
+/* DISPATCH */
+
+static const simd_kernels *kernels = NULL;
+
+/* Return the kernels for the named instruction set, or for the best
+   one supported by the processor if name is "auto", or NULL if the
+   processor does not support it */
+static
+const simd_kernels *
+find_kernels(const char *name)
+{
+  int automatic = strcmp(name, "auto") == 0;
+#ifdef CG_SIMD_X86
+  __builtin_cpu_init();
+  if ((automatic || strcmp(name, "avx512") == 0)
+      && __builtin_cpu_supports("avx512f")) {
+    return &avx512_kernels;
+  }
+  if ((automatic || strcmp(name, "avx2") == 0)
+      && __builtin_cpu_supports("avx2")) {
+    return &avx2_kernels;
+  }
+  if ((automatic || strcmp(name, "sse2") == 0)
+      && __builtin_cpu_supports("sse2")) {
+    return &sse2_kernels;
+  }
+#endif
+  if (automatic || strcmp(name, "generic") == 0) {
+    return &generic_kernels;
+  }
+  return NULL;
+}
+
+#ifdef CG_SIMD_X86
+/* Choose the kernels before any threads can race to do so */
+__attribute__((constructor))
+static
+void
+init_kernels(void)
+{
+  if (!kernels) {
+    kernels = find_kernels("auto");
+  }
+}
+#endif
+
+static
+const simd_kernels *
+get_kernels(void)
+{
+  if (!kernels) {
+    kernels = find_kernels("auto");
+  }
+  return kernels;
+}
+
+/* Choose the instruction set of the kernels */
+int
+cg_select_simd(const char *name)
+{
+  const simd_kernels *found = find_kernels(name);
+  if (!found) {
+    return 0;
+  }
+  kernels = found;
+  return 1;
+}
+
+/* Return the name of the instruction set of the kernels */
+const char *
+cg_simd_name(void)
+{
+  return get_kernels()->name;
+}
+
+/* Return the sum of the squares of n values */
+double
+cg_sum_squares(const real *data, long int n)
+{
+  return get_kernels()->sum_squares(data, n);
+}
+
+/* Replace each of n values x by x*scale + offset */
+void
+cg_scale_values(real *data, long int n, real scale, real offset)
+{
+  get_kernels()->scale(data, n, scale, offset);
+}
+
+/* Multiply each of n values by the corresponding factor */
+void
+cg_multiply_values(real *data, const real *factor, long int n)
+{
+  get_kernels()->multiply(data, factor, n);
+}
+
+/* Multiply each of n complex values by the corresponding factor */
+void
+cg_multiply_complex_values(complex *data, const complex *factor,
+			   long int n)
+{
+  get_kernels()->multiply_complex(data, factor, n);
+}
+
+/* Whether the exponentials come from libm rather than the kernels */
+#ifdef CG_LIBM_EXP
+static int libm_exp = 1;
+#else
+static int libm_exp = 0;
+#endif
+
+/* Choose between libm and the vectorised exponential */
+void
+cg_select_libm_exp(int use_libm)
+{
+  libm_exp = use_libm;
+}
+
+/* Return 1 if the exponentials come from libm */
+int
+cg_libm_exp(void)
+{
+  return libm_exp;
+}
+
+/* Replace each of n values x by exp(x) */
+void
+cg_exp_values(real *data, long int n)
+{
+  long int i;
+  if (libm_exp) {
+    for (i = 0; i < n; i++) {
+      data[i] = exp(data[i]);
+    }
+  }
+  else {
+    get_kernels()->exponential(data, n);
+  }
+}
+
+/* Replace n pairs of uniform deviates by pairs of Gaussian deviates */
+void
+cg_gaussian_values(real *x, real *y, long int n)
+{
+  get_kernels()->gaussian(x, y, n);
+}
+
+/* Replace each of n values x by exp(x*pre_scale) * post_scale, a
+   block of values at a time so that the three passes stay in the
+   cache. */
+void
+cg_lognormal_values(real *data, long int n, real pre_scale,
+		    real post_scale)
+{
+  const simd_kernels *k = get_kernels();
+  long int i, block = CG_BLOCK;
+  for (i = 0; i < n; i += block) {
+    if (block > n - i) {
+      block = n - i;
+    }
+    k->scale(data + i, block, pre_scale, 0.0);
+    cg_exp_values(data + i, block);
+    k->scale(data + i, block, post_scale, 0.0);
+  }
+}
+
+/* Set the values of every variable to missing_value where variable
+   ivar is below threshold */
+void
+cg_threshold_values(real **data, int nvars, int ivar, long int n,
+		    real threshold, real missing_value)
+{
+  get_kernels()->threshold(data, nvars, ivar, n, threshold, missing_value);
+}
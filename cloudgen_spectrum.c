@@ -0,0 +1,682 @@
+/* cloudgen_spectrum.c -- Generating stochastic fractal clouds
+   This file contains the code for shaping the spectrum of a field
+   Copyright (C) 2003 Robin Hogan <r.j.hogan@reading.ac.uk> */
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "cloudgen.h"
+#include "random.h"
+
+#define PI 3.14159265358979323846
+
+/* Logarithm of the Gamma function, adapted from Numerical Recipies */
+static
+float
+gammaln(float xx)
+{
+  double x, tmp, ser;
+  static double cof[6] = {76.18009173, -86.50532033, 24.01409822,
+			  -1.231739516, 0.120858003e-2, -0.536382e-5};
+  int j;
+
+  x = xx-1.0;
+  tmp = x+5.5;
+  tmp -= (x+0.5) * log(tmp);
+  ser = 1.0;
+  for (j = 0; j <= 5; j++) {
+    x += 1.0;
+    ser += cof[j]/x;
+  }
+  return -tmp+log(2.50662827465*ser);
+}
+
+/* Create the spectrum used by cg_power_law(): a power law with a
+   scale break at outer_scale, a slope of "slope" at small scales and
+   "outer_slope" at large scales. */
+cg_spectrum *
+cg_new_power_law_spectrum(cg_field *field, real outer_scale,
+			  real slope, real outer_slope)
+{
+  cg_spectrum *spectrum;
+  real dkx = field->dkx;
+  real dkz = field->dkz;
+  real max_kx = field->nx * dkx *0.5;
+  /* Locations of scale breaks: note that we use k^2 rather than k for
+     efficiency */
+  real gamma_factor = dkz * exp(gammaln(-0.5*slope)-gammaln(0.5-0.5*slope));
+
+  spectrum = calloc(1, sizeof(cg_spectrum));
+  if (!spectrum) {
+    return NULL;
+  }
+  spectrum->tabulated = 0;
+  spectrum->factor = 1.0 + 0.0 * I;
+  spectrum->slope = slope;
+  spectrum->outer_slope = outer_slope;
+  spectrum->kk_I = 1./(outer_scale * outer_scale);
+  spectrum->kk_II = gamma_factor*gamma_factor * slope*slope * 0.25 / PI;
+  spectrum->kk_III = max_kx * max_kx * 2 * (-slope) / PI;
+  /* Coefficients: note that we are working in amplitude not frequency
+     space, leading to the square-roots */
+  spectrum->coefft_II = sqrt(1/(gamma_factor * sqrt(PI)));
+  spectrum->coefft_I = spectrum->coefft_II
+    * pow(spectrum->kk_I, (slope-outer_slope-1)*0.25);
+  spectrum->coefft_III = sqrt(-0.5 * slope / PI);
+  spectrum->coefft_IV = sqrt(0.25 / (max_kx * max_kx));
+  return spectrum;
+}
+
+/* Create a spectrum interpolated from n values of the spectral
+   energy density "energy" at increasing wavenumbers "wavenumber". */
+cg_spectrum *
+cg_new_tabulated_spectrum(int n, const real *wavenumber,
+			  const real *energy)
+{
+  cg_spectrum *spectrum;
+  int i;
+
+  if (n < 2) {
+    return NULL;
+  }
+  for (i = 0; i < n; i++) {
+    if (wavenumber[i] <= 0.0 || energy[i] <= 0.0
+	|| (i > 0 && wavenumber[i] <= wavenumber[i-1])) {
+      return NULL;
+    }
+  }
+
+  spectrum = calloc(1, sizeof(cg_spectrum));
+  if (!spectrum) {
+    return NULL;
+  }
+  spectrum->tabulated = 1;
+  spectrum->factor = 1.0 + 0.0 * I;
+  spectrum->n = n;
+  spectrum->log_k = malloc(n * sizeof(real));
+  spectrum->log_amplitude = malloc(n * sizeof(real));
+  if (!spectrum->log_k || !spectrum->log_amplitude) {
+    cg_delete_spectrum(spectrum);
+    return NULL;
+  }
+  for (i = 0; i < n; i++) {
+    spectrum->log_k[i] = log(wavenumber[i]);
+    spectrum->log_amplitude[i] = 0.5 * log(energy[i]);
+  }
+  return spectrum;
+}
+
+/* Free a spectrum */
+void
+cg_delete_spectrum(cg_spectrum *spectrum)
+{
+  if (!spectrum) {
+    return;
+  }
+  free(spectrum->log_k);
+  free(spectrum->log_amplitude);
+  free(spectrum);
+}
+
+/* Return the amplitude of the spectrum at squared wavenumber kk */
+real
+cg_spectrum_amplitude(const cg_spectrum *spectrum, real kk)
+{
+  if (spectrum->tabulated) {
+    const real *log_k = spectrum->log_k;
+    const real *log_amplitude = spectrum->log_amplitude;
+    int lower = 0;
+    int upper = spectrum->n - 1;
+    real x;
+    if (kk <= 0.0) {
+      return 0.0;
+    }
+    x = 0.5 * log(kk);
+    /* Find the interval containing x, or the end interval to
+       extrapolate from */
+    while (upper - lower > 1) {
+      int middle = (lower + upper) / 2;
+      if (x < log_k[middle]) {
+	upper = middle;
+      }
+      else {
+	lower = middle;
+      }
+    }
+    return exp(log_amplitude[lower]
+	       + (log_amplitude[upper] - log_amplitude[lower])
+	       * (x - log_k[lower]) / (log_k[upper] - log_k[lower]));
+  }
+  else if (kk < spectrum->kk_I) {
+    /* Region I: outer scale */
+    return spectrum->coefft_I * pow(kk, spectrum->outer_slope*0.25);
+  }
+  else if (kk < spectrum->kk_II) {
+    /* Region II: quasi-2D behaviour (x-y) */
+    return spectrum->coefft_II * pow(kk, (spectrum->slope-1)*0.25);
+  }
+  else if (kk < spectrum->kk_III) {
+    /* Region III: 3D behaviour */
+    return spectrum->coefft_III * pow(kk, (spectrum->slope-2)*0.25);
+  }
+  else {
+    /* Region IV: quasi-1D behaviour (z) */
+    return spectrum->coefft_IV * pow(kk, spectrum->slope*0.25);
+  }
+}
+
+static
+int
+compare_reals(const void *a, const void *b)
+{
+  real x = *(const real *) a;
+  real y = *(const real *) b;
+  return (x > y) - (x < y);
+}
+
+/* The amplitude only depends on kx^2+ky^2+kz^2, so rather than
+   evaluating it for every Fourier component it is tabulated exactly
+   for the distinct values of kx^2+ky^2 in a plane, once for each
+   distinct kz^2, and then applied by table lookup. The table is built
+   on the first use of a field. The amplitudes are kept, without the
+   factor of the spectrum, for as long as the same spectrum is
+   applied, so that the variables of a field and the passes over the
+   windows of a stream evaluate them only once. */
+struct cg_plane_table {
+  long int ndistinct;
+  real *distinct;       /* Distinct values of kx^2+ky^2 */
+  int *index;           /* Index into distinct of each component */
+  complex *amplitude;   /* Amplitude at each distinct value */
+  cg_spectrum spectrum; /* Spectrum the rows below were evaluated for,
+			   with its own copy of any table */
+  int max_rows, nrows;  /* Number of rows there is room for and used */
+  int *row;             /* Row of each |kz| index, or -1 */
+  real *rows;           /* Amplitudes at each distinct value */
+};
+typedef struct cg_plane_table plane_table;
+
+/* Free the table of field */
+void
+cg_delete_plane_table(cg_field *field)
+{
+  plane_table *table = field->plane_table;
+  if (table) {
+    free(table->distinct);
+    free(table->index);
+    free(table->amplitude);
+    free(table->spectrum.log_k);
+    free(table->row);
+    free(table->rows);
+    free(table);
+    field->plane_table = NULL;
+  }
+}
+
+/* Return the table for the horizontal wavenumbers of field, building
+   it on first use, or NULL if out of memory */
+static
+plane_table *
+get_plane_table(cg_field *field)
+{
+  real *kx = field->kx;
+  real *ky = field->ky;
+  int nx = field->nx;
+  int ny = field->ny;
+  long int plane = (nx/2+1) * ny;
+  plane_table *table;
+  real *kk_plane;
+  long int n;
+  int i, j;
+
+  if (field->plane_table) {
+    return field->plane_table;
+  }
+  table = field->plane_table = calloc(1, sizeof(plane_table));
+  kk_plane = malloc(plane * sizeof(real));
+  if (table) {
+    table->distinct = malloc(plane * sizeof(real));
+    table->index = malloc(plane * sizeof(int));
+    table->amplitude = malloc(plane * sizeof(complex));
+  }
+  if (!table || !kk_plane || !table->distinct || !table->index
+      || !table->amplitude) {
+    free(kk_plane);
+    cg_delete_plane_table(field);
+    return NULL;
+  }
+
+  for (j = 0; j < ny; j++) {
+    for (i = 0; i < (nx/2+1); i++) {
+      kk_plane[i + (nx/2+1)*j] = kx[i]*kx[i] + ky[j]*ky[j];
+    }
+  }
+  memcpy(table->distinct, kk_plane, plane * sizeof(real));
+  qsort(table->distinct, plane, sizeof(real), compare_reals);
+  for (n = 1, table->ndistinct = 1; n < plane; n++) {
+    if (table->distinct[n] != table->distinct[table->ndistinct-1]) {
+      table->distinct[table->ndistinct++] = table->distinct[n];
+    }
+  }
+  for (n = 0; n < plane; n++) {
+    real *found = bsearch(kk_plane + n, table->distinct, table->ndistinct,
+			  sizeof(real), compare_reals);
+    table->index[n] = found - table->distinct;
+  }
+  free(kk_plane);
+
+  /* Room for the amplitudes of every layer held, or of every
+     distinct kz^2 if fewer; without it they are evaluated on each
+     use */
+  table->max_rows = field->local_nz < field->nz/2+1
+    ? field->local_nz : field->nz/2+1;
+  table->row = malloc((field->nz/2+1) * sizeof(int));
+  table->rows = malloc(table->max_rows * table->ndistinct * sizeof(real));
+  if (!table->row || !table->rows) {
+    table->max_rows = 0;
+  }
+  table->spectrum.tabulated = -1;
+  return table;
+}
+
+/* Return 1 if spectra a and b have the same amplitudes, whatever
+   their factors, and 0 otherwise */
+static
+int
+same_amplitudes(const cg_spectrum *a, const cg_spectrum *b)
+{
+  if (a->tabulated != b->tabulated) {
+    return 0;
+  }
+  if (a->tabulated) {
+    return a->n == b->n
+      && memcmp(a->log_k, b->log_k, a->n * sizeof(real)) == 0
+      && memcmp(a->log_amplitude, b->log_amplitude,
+		a->n * sizeof(real)) == 0;
+  }
+  return a->slope == b->slope && a->outer_slope == b->outer_slope
+    && a->kk_I == b->kk_I && a->kk_II == b->kk_II && a->kk_III == b->kk_III
+    && a->coefft_I == b->coefft_I && a->coefft_II == b->coefft_II
+    && a->coefft_III == b->coefft_III && a->coefft_IV == b->coefft_IV;
+}
+
+/* Index of the distinct kz^2 of layer k of the domain */
+static
+int
+kz_index(const cg_field *field, int k)
+{
+  return k <= field->nz - k ? k : field->nz - k;
+}
+
+/* Make sure the table holds the amplitudes of spectrum for the
+   local layers of field, if there is room, evaluating those that it
+   does not already hold. */
+static
+void
+keep_amplitudes(cg_field *field, plane_table *table,
+		const cg_spectrum *spectrum)
+{
+  int nkz = field->nz/2+1;
+  int first_new, attempt, k, m;
+
+  if (table->max_rows == 0) {
+    return;
+  }
+  if (!same_amplitudes(&table->spectrum, spectrum)) {
+    /* Forget the amplitudes of the previous spectrum */
+    free(table->spectrum.log_k);
+    table->spectrum = *spectrum;
+    table->spectrum.log_k = table->spectrum.log_amplitude = NULL;
+    if (spectrum->tabulated) {
+      table->spectrum.log_k = malloc(2 * spectrum->n * sizeof(real));
+      if (!table->spectrum.log_k) {
+	/* Hold no amplitudes, so that none of the old ones is used */
+	table->spectrum.tabulated = -1;
+	table->nrows = 0;
+	for (m = 0; m < nkz; m++) {
+	  table->row[m] = -1;
+	}
+	return;
+      }
+      table->spectrum.log_amplitude = table->spectrum.log_k + spectrum->n;
+      memcpy(table->spectrum.log_k, spectrum->log_k,
+	     spectrum->n * sizeof(real));
+      memcpy(table->spectrum.log_amplitude, spectrum->log_amplitude,
+	     spectrum->n * sizeof(real));
+    }
+    table->nrows = 0;
+  }
+  if (table->nrows == 0) {
+    for (m = 0; m < nkz; m++) {
+      table->row[m] = -1;
+    }
+  }
+
+  /* Give each new kz^2 a row, starting again if there is no room
+     for them all, as when the window of a stream moves */
+  first_new = table->nrows;
+  for (attempt = 0; attempt < 2; attempt++) {
+    for (k = 0; k < field->local_nz; k++) {
+      m = kz_index(field, k + field->z_start);
+      if (table->row[m] < 0) {
+	if (table->nrows == table->max_rows) {
+	  break;
+	}
+	table->row[m] = table->nrows++;
+      }
+    }
+    if (k == field->local_nz) {
+      break;
+    }
+    for (m = 0; m < nkz; m++) {
+      table->row[m] = -1;
+    }
+    table->nrows = first_new = 0;
+  }
+
+#pragma omp parallel for num_threads(field->nthreads) schedule(static)
+  for (m = 0; m < nkz; m++) {
+    if (table->row[m] >= first_new) {
+      real *rows = table->rows + table->ndistinct * table->row[m];
+      real kk_z = field->kz[m]*field->kz[m];
+      long int n;
+      for (n = 0; n < table->ndistinct; n++) {
+	rows[n] = cg_spectrum_amplitude(spectrum, table->distinct[n] + kk_z);
+      }
+    }
+  }
+}
+
+/* Fill in the amplitude at each distinct value of the table for
+   layer k of the domain, after keep_amplitudes() */
+static
+void
+layer_amplitudes(const cg_field *field, const plane_table *table,
+		 const cg_spectrum *spectrum, int k, complex *amplitude)
+{
+  int m = kz_index(field, k);
+  long int n;
+  if (table->max_rows > 0 && table->row[m] >= 0) {
+    const real *rows = table->rows + table->ndistinct * table->row[m];
+    for (n = 0; n < table->ndistinct; n++) {
+      amplitude[n] = rows[n] * spectrum->factor;
+    }
+  }
+  else {
+    real kk_z = field->kz[k]*field->kz[k];
+    for (n = 0; n < table->ndistinct; n++) {
+      amplitude[n]
+	= cg_spectrum_amplitude(spectrum, table->distinct[n] + kk_z)
+	* spectrum->factor;
+    }
+  }
+}
+
+/* Multiply layer k of variable ivar by the amplitude of the spectrum
+   evaluated for every component */
+static
+void
+apply_spectrum_direct(cg_field *field, int ivar, int k,
+		      const cg_spectrum *spectrum)
+{
+  complex *p = field->p[ivar];
+  real *kx = field->kx;
+  real *ky = field->ky;
+  real kz = field->kz[k + field->z_start];
+  int nx = field->nx;
+  int ny = field->ny;
+  int i, j;
+  for (j = 0; j < ny; j++) {
+    for (i = 0; i < (nx/2+1); i++) {
+      real kk = kx[i]*kx[i] + ky[j]*ky[j] + kz*kz;
+      p[i + (nx/2+1)*(j + ny*k)]
+	*= cg_spectrum_amplitude(spectrum, kk) * spectrum->factor;
+    }
+  }
+}
+
+/* Multiply the Fourier components of variable ivar by the amplitude
+   of the spectrum. The layers are shared between the threads. */
+void
+cg_apply_spectrum(cg_field *field, int ivar, const cg_spectrum *spectrum)
+{
+  complex *p = field->p[ivar];
+  int nz = field->nz;
+  int local_nz = field->local_nz;
+  int z_start = field->z_start;
+  long int plane = (field->nx/2+1) * field->ny;
+  plane_table *table = get_plane_table(field);
+  int k;
+
+  if (table) {
+    keep_amplitudes(field, table, spectrum);
+  }
+  if (!table) {
+    /* Out of memory: evaluate the spectrum for every component */
+#pragma omp parallel for num_threads(field->nthreads) schedule(static)
+    for (k = 0; k < local_nz; k++) {
+      apply_spectrum_direct(field, ivar, k, spectrum);
+    }
+  }
+  else {
+#pragma omp parallel num_threads(field->nthreads)
+    {
+      complex *amplitude = malloc(table->ndistinct * sizeof(complex));
+      complex factor[CG_BLOCK];
+      long int n, i;
+
+      /* Layers k and nz-k have the same kz^2 */
+#pragma omp for schedule(dynamic)
+      for (k = 0; k <= nz/2; k++) {
+	int layer[2];
+	int m, nlayers = 0;
+	if (k >= z_start && k < z_start + local_nz) {
+	  layer[nlayers++] = k - z_start;
+	}
+	if (k > 0 && nz-k != k
+	    && nz-k >= z_start && nz-k < z_start + local_nz) {
+	  layer[nlayers++] = nz-k - z_start;
+	}
+	if (nlayers > 0 && amplitude) {
+	  layer_amplitudes(field, table, spectrum, k, amplitude);
+	}
+	for (m = 0; m < nlayers; m++) {
+	  complex *target = p + plane * layer[m];
+	  if (!amplitude) {
+	    apply_spectrum_direct(field, ivar, layer[m], spectrum);
+	    continue;
+	  }
+	  for (n = 0; n < plane; n += CG_BLOCK) {
+	    long int len = plane - n < CG_BLOCK ? plane - n : CG_BLOCK;
+	    for (i = 0; i < len; i++) {
+	      factor[i] = amplitude[table->index[n+i]];
+	    }
+	    cg_multiply_complex_values(target + n, factor, len);
+	  }
+	}
+      }
+      free(amplitude);
+    }
+  }
+
+  if (z_start == 0 && local_nz > 0) {
+    *p = 0.0 + 0.0 * I;
+  }
+}
+
+/* Set the amplitudes of the len components of layer k of the domain
+   starting at component n, from the table filled by
+   layer_amplitudes() for the layer, or if there is no table by
+   evaluating the spectrum for each component. */
+static
+void
+block_amplitudes(const cg_field *field, const plane_table *table,
+		 const cg_spectrum *spectrum, int k, long int n,
+		 long int len, complex *amplitude)
+{
+  int row = field->nx/2+1;
+  real kz = field->kz[k];
+  long int m;
+  if (table) {
+    for (m = 0; m < len; m++) {
+      amplitude[m] = table->amplitude[table->index[n+m]];
+    }
+    return;
+  }
+  for (m = 0; m < len; m++) {
+    real kx = field->kx[(n+m) % row];
+    real ky = field->ky[(n+m) / row];
+    real kk = kx*kx + ky*ky + kz*kz;
+    amplitude[m] = cg_spectrum_amplitude(spectrum, kk) * spectrum->factor;
+  }
+}
+
+/* Fill the local layers of variable ivar with random phases
+   multiplied by the amplitude of the spectrum, in a single pass. If
+   the table cannot be allocated the spectrum is evaluated for every
+   component instead. */
+int
+cg_synthesize_layers(cg_field *field, int ivar, int ikeep,
+		     const cg_spectrum *spectrum)
+{
+  complex *p = field->p[ivar];
+  complex *keep = ikeep >= 0 ? field->p[ikeep] : NULL;
+  random_state *state = cg_random_state(field);
+  long int plane = (field->nx/2+1) * field->ny;
+  plane_table *table = get_plane_table(field);
+  long int n, first;
+  int k;
+
+  if (table) {
+    keep_amplitudes(field, table, spectrum);
+  }
+  for (k = 0; k < field->local_nz; k++) {
+    complex *target = p + plane * k;
+    int kk = k + field->z_start;
+    if (table) {
+      layer_amplitudes(field, table, spectrum, kk, table->amplitude);
+    }
+    first = 0;
+    if (kk == 0) {
+      /* The mean is zero */
+      target[0] = 0.0 + 0.0 * I;
+      if (keep) {
+	keep[0] = 0.0 + 0.0 * I;
+      }
+      first = 1;
+    }
+    if (state->counter) {
+      /* Blocks of the layer can be drawn independently */
+      long int index = plane * kk;
+#pragma omp parallel for num_threads(field->nthreads) schedule(static)
+      for (n = first; n < plane; n += CG_BLOCK) {
+	long int len = plane - n < CG_BLOCK ? plane - n : CG_BLOCK;
+	complex phase[CG_BLOCK], amplitude[CG_BLOCK];
+	long int m;
+	cg_counter_phase_values(field, phase, ivar, index + n, len);
+	block_amplitudes(field, table, spectrum, kk, n, len, amplitude);
+	for (m = 0; m < len; m++) {
+	  target[n+m] = phase[m] * amplitude[m];
+	}
+	if (keep) {
+	  memcpy(keep + n + plane * k, phase, len*sizeof(complex));
+	}
+      }
+      continue;
+    }
+    for (n = first; n < plane; n += CG_BLOCK) {
+      long int len = plane - n < CG_BLOCK ? plane - n : CG_BLOCK;
+      complex phase[CG_BLOCK], amplitude[CG_BLOCK];
+      long int m;
+      cg_next_phase_values(field, phase, len);
+      block_amplitudes(field, table, spectrum, kk, n, len, amplitude);
+      for (m = 0; m < len; m++) {
+	target[n+m] = phase[m] * amplitude[m];
+      }
+      if (keep) {
+	memcpy(keep + n + plane * k, phase, len*sizeof(complex));
+      }
+    }
+  }
+  return 1;
+}
+
+/* Replace the raw phases of another variable held in variable ivar
+   by phases partially correlated with them, multiplied by the
+   amplitude of the spectrum, in a single pass. As in
+   cg_synthesize_layers(), the spectrum is evaluated for every
+   component if the table cannot be allocated. */
+int
+cg_correlate_layers(cg_field *field, int ivar, real correlation,
+		    const cg_spectrum *spectrum)
+{
+  complex *p = field->p[ivar];
+  long int plane = (field->nx/2+1) * field->ny;
+  real comp_correlation = 1.0-correlation;
+  random_state *state = cg_random_state(field);
+  plane_table *table;
+  long int n, first;
+  int k;
+
+  if (correlation <= 0.0) {
+    /* Use completely new random numbers */
+    return cg_synthesize_layers(field, ivar, -1, spectrum);
+  }
+  if ((table = get_plane_table(field))) {
+    keep_amplitudes(field, table, spectrum);
+  }
+  for (k = 0; k < field->local_nz; k++) {
+    complex *target = p + plane * k;
+    int kk = k + field->z_start;
+    if (table) {
+      layer_amplitudes(field, table, spectrum, kk, table->amplitude);
+    }
+    first = 0;
+    if (kk == 0) {
+      target[0] = 0.0 + 0.0 * I;
+      first = 1;
+    }
+    if (correlation >= 1.0) {
+      /* Keep the phases */
+      for (n = first; n < plane; n += CG_BLOCK) {
+	long int len = plane - n < CG_BLOCK ? plane - n : CG_BLOCK;
+	complex amplitude[CG_BLOCK];
+	long int m;
+	block_amplitudes(field, table, spectrum, kk, n, len, amplitude);
+	for (m = 0; m < len; m++) {
+	  target[n+m] *= amplitude[m];
+	}
+      }
+    }
+    else if (state->counter) {
+      long int index = plane * kk;
+#pragma omp parallel for num_threads(field->nthreads) schedule(static)
+      for (n = first; n < plane; n += CG_BLOCK) {
+	long int len = plane - n < CG_BLOCK ? plane - n : CG_BLOCK;
+	complex phase[CG_BLOCK], amplitude[CG_BLOCK];
+	long int m;
+	cg_counter_phase_values(field, phase, ivar, index + n, len);
+	block_amplitudes(field, table, spectrum, kk, n, len, amplitude);
+	for (m = 0; m < len; m++) {
+	  target[n+m] = (correlation * target[n+m]
+			 + comp_correlation * phase[m]) * amplitude[m];
+	}
+      }
+    }
+    else {
+      /* Use weighting of new random numbers and the phases of the
+	 other variable */
+      for (n = first; n < plane; n += CG_BLOCK) {
+	long int len = plane - n < CG_BLOCK ? plane - n : CG_BLOCK;
+	complex phase[CG_BLOCK], amplitude[CG_BLOCK];
+	long int m;
+	cg_next_phase_values(field, phase, len);
+	block_amplitudes(field, table, spectrum, kk, n, len, amplitude);
+	for (m = 0; m < len; m++) {
+	  target[n+m] = (correlation * target[n+m]
+			 + comp_correlation * phase[m]) * amplitude[m];
+	}
+      }
+    }
+  }
+  return 1;
+}
@@ -0,0 +1,368 @@
+/* cloudgen_stream.c -- Generating stochastic fractal clouds
+   This file contains the code for generating a field out of core
+   Copyright (C) 2003 Robin Hogan <r.j.hogan@reading.ac.uk> */
+#define _FILE_OFFSET_BITS 64
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "cloudgen.h"
+#include "random.h"
+
+/* The inverse 3D transform of a field held in memory is equivalent to
+   a 1D inverse transform in the vertical followed by the inverse 2D
+   transforms of the layers. The scratch file therefore holds, for
+   each variable, the (nx/2+1)*ny*nz Fourier components in the same
+   order as field->p, which are first transformed in the vertical in
+   pencils of whole columns, and then read back a window of layers at
+   a time for the 2D transforms and the layer functions. The final
+   result of each window is written back in place of its layers. If
+   the other variables are correlated with variable 0, its raw random
+   phases are first written in their place. */
+
+/* Offset in the scratch file of layer k of variable ivar */
+static
+off_t
+scratch_offset(cg_stream *stream, int ivar, int k)
+{
+  cg_field *window = stream->window;
+  off_t plane = (off_t) (window->nx/2+1) * window->ny * sizeof(complex);
+  return plane * ((off_t) ivar * window->nz + k);
+}
+
+/* Read (if writing is zero) or write size bytes at offset in the
+   scratch file. Returns 1 on success and 0 on failure. */
+static
+int
+scratch_io(cg_stream *stream, void *data, size_t size, off_t offset,
+	   int writing)
+{
+  int fd = fileno(stream->scratch);
+  char *buffer = data;
+  while (size > 0) {
+    ssize_t done = writing ? pwrite(fd, buffer, size, offset)
+      : pread(fd, buffer, size, offset);
+    if (done <= 0) {
+      return 0;
+    }
+    buffer += done;
+    offset += done;
+    size -= done;
+  }
+  return 1;
+}
+
+/* Read or write the layers of the window for variable ivar, from or
+   to the layers of variable iscratch in the scratch file. */
+static
+int
+window_io(cg_stream *stream, int ivar, int iscratch, int writing)
+{
+  cg_field *window = stream->window;
+  size_t size = (size_t) (window->nx/2+1) * window->ny * window->local_nz
+    * sizeof(complex);
+  return scratch_io(stream, window->p[ivar], size,
+		    scratch_offset(stream, iscratch, window->z_start),
+		    writing);
+}
+
+/* Size of the parts when n is split into as few parts of no more
+   than max as possible, all of the same size apart from the last,
+   which may be shorter, or 0 if max is less than 1 */
+static
+int
+part_size(int n, long int max)
+{
+  long int nparts;
+  if (max < 1) {
+    return 0;
+  }
+  nparts = (n + max - 1) / max;
+  return (n + nparts - 1) / nparts;
+}
+
+/* Move the window to window iwindow, which holds stream->nlayers
+   layers unless it is the last and fewer remain. The layer
+   transforms still act on all stream->nlayers layers, so the unused
+   ones are set to zero. */
+static
+void
+move_window(cg_stream *stream, int iwindow)
+{
+  cg_field *window = stream->window;
+  long int plane = (long int) (window->nx/2+1) * window->ny;
+  int n;
+  window->z_start = iwindow * stream->nlayers;
+  window->local_nz = window->nz - window->z_start < stream->nlayers
+    ? window->nz - window->z_start : stream->nlayers;
+  if (window->local_nz < stream->nlayers) {
+    for (n = 0; n < window->nvars; n++) {
+      memset(window->p[n] + plane * window->local_nz, 0,
+	     plane * (stream->nlayers - window->local_nz) * sizeof(complex));
+    }
+  }
+}
+
+/* Create a field to be generated out of core. */
+cg_stream *
+cg_new_stream(int nx, int ny, int nz,
+	      real dx, real dy, real dz,
+	      real x_offset, real y_offset, real z_offset,
+	      int nvars, int nthreads, cg_planner_effort effort,
+	      size_t memory_budget, const char *scratch_file)
+{
+  cg_stream *stream;
+  size_t plane = (size_t) (nx/2+1) * ny * sizeof(complex);
+  size_t column = (size_t) (nx/2+1) * nz * sizeof(complex);
+  int nlayers, pencil_ny;
+
+  if (nvars < 1 || nvars > CG_MAX_VARS) {
+    return NULL;
+  }
+
+  /* Half the budget for the window and half for the pencils */
+  nlayers = part_size(nz, memory_budget / 2 / (plane * nvars));
+  pencil_ny = part_size(ny, memory_budget / 2 / column);
+  if (nlayers < 1 || pencil_ny < 1) {
+    return NULL;
+  }
+
+  stream = calloc(1, sizeof(cg_stream));
+  if (!stream) {
+    return NULL;
+  }
+  stream->nlayers = nlayers;
+  stream->nwindows = (nz + nlayers - 1) / nlayers;
+  stream->iwindow = -1;
+  stream->pencil_ny = pencil_ny;
+
+  if (scratch_file) {
+    /* The file is removed straight away, so is deleted when closed */
+    stream->scratch = fopen(scratch_file, "w+b");
+    if (stream->scratch) {
+      remove(scratch_file);
+    }
+  }
+  else {
+    stream->scratch = tmpfile();
+  }
+  if (!stream->scratch) {
+    cg_delete_stream(stream);
+    return NULL;
+  }
+
+  stream->window = cg_new_window_field(nx, ny, nz, dx, dy, dz,
+				       x_offset, y_offset, z_offset,
+				       nvars, nthreads, effort, 0, nlayers);
+  if (!stream->window) {
+    cg_delete_stream(stream);
+    return NULL;
+  }
+  return stream;
+}
+
+/* Free the window and close the scratch file */
+void
+cg_delete_stream(cg_stream *stream)
+{
+  if (!stream) {
+    return;
+  }
+  if (stream->window) {
+    cg_delete_field(stream->window);
+  }
+  if (stream->scratch) {
+    fclose(stream->scratch);
+  }
+  free(stream);
+}
+
+/* Perform the inverse 1D transform in the vertical of every column
+   of each variable, a pencil of stream->pencil_ny rows at a time,
+   apart from the last pencil, which may have fewer rows and then has
+   its own plan. */
+static
+int
+vertical_transforms(cg_stream *stream)
+{
+  cg_field *window = stream->window;
+  int nz = window->nz;
+  int ny = window->ny;
+  int pencil_ny = stream->pencil_ny;
+  int row = window->nx/2+1;
+  int howmany = row * pencil_ny;
+  int last_howmany = row * (ny - (ny - 1) / pencil_ny * pencil_ny);
+  complex *pencil;
+  fftw_plan plan, last_plan = NULL;
+  int status = 1;
+  int j, k, n;
+
+  pencil = fftw_malloc(howmany * sizeof(complex) * nz);
+  if (!pencil) {
+    return 0;
+  }
+  cg_lock_planner();
+#ifdef CG_ENABLE_THREADS
+  fftw_plan_with_nthreads(window->nthreads);
+#endif
+  plan = fftw_plan_many_dft(1, &nz, howmany,
+			    pencil, NULL, howmany, 1,
+			    pencil, NULL, howmany, 1,
+			    FFTW_BACKWARD, cg_planner_flags(window->effort));
+  if (plan && last_howmany < howmany) {
+    last_plan = fftw_plan_many_dft(1, &nz, last_howmany,
+				   pencil, NULL, howmany, 1,
+				   pencil, NULL, howmany, 1,
+				   FFTW_BACKWARD,
+				   cg_planner_flags(window->effort));
+    if (!last_plan) {
+      fftw_destroy_plan(plan);
+      plan = NULL;
+    }
+  }
+  cg_unlock_planner();
+  if (!plan) {
+    fftw_free(pencil);
+    return 0;
+  }
+
+  for (n = 0; n < window->nvars && status; n++) {
+    for (j = 0; j < ny && status; j += pencil_ny) {
+      off_t offset = (off_t) j * row * sizeof(complex);
+      int last = j + pencil_ny > ny;
+      size_t size = (last ? last_howmany : howmany) * sizeof(complex);
+      for (k = 0; k < nz && status; k++) {
+	status = scratch_io(stream, pencil + (size_t) k * howmany, size,
+			    scratch_offset(stream, n, k) + offset, 0);
+      }
+      if (!status) {
+	break;
+      }
+      fftw_execute_dft(last ? last_plan : plan, pencil, pencil);
+      for (k = 0; k < nz && status; k++) {
+	status = scratch_io(stream, pencil + (size_t) k * howmany, size,
+			    scratch_offset(stream, n, k) + offset, 1);
+      }
+    }
+  }
+
+  cg_lock_planner();
+  fftw_destroy_plan(plan);
+  if (last_plan) {
+    fftw_destroy_plan(last_plan);
+  }
+  cg_unlock_planner();
+  fftw_free(pencil);
+  return status;
+}
+
+/* Generate the spectrum of every variable and perform the vertical
+   part of the inverse 3D transform. */
+int
+cg_stream_generate(cg_stream *stream, const cg_spectrum *spectrum,
+		   real correlation)
+{
+  cg_field *window = stream->window;
+  int nvars = window->nvars;
+  /* Variables other than 0 need its raw random phases */
+  int keep_phases = nvars > 1 && correlation > 0.0;
+  int i, n;
+
+  /* The windows are filled in order, so the random numbers are drawn
+     in the same order as for the whole field */
+  stream->iwindow = -1;
+  for (i = 0; i < stream->nwindows; i++) {
+    move_window(stream, i);
+    if (!cg_synthesize_layers(window, 0, keep_phases ? 1 : -1, spectrum)
+	|| !window_io(stream, 0, 0, 1)) {
+      return 0;
+    }
+    for (n = 1; n < nvars && keep_phases; n++) {
+      if (!window_io(stream, 1, n, 1)) {
+	return 0;
+      }
+    }
+  }
+  for (n = 1; n < nvars; n++) {
+    for (i = 0; i < stream->nwindows; i++) {
+      move_window(stream, i);
+      if ((keep_phases && !window_io(stream, n, n, 0))
+	  || !cg_correlate_layers(window, n, correlation, spectrum)
+	  || !window_io(stream, n, n, 1)) {
+	return 0;
+      }
+    }
+  }
+
+  return vertical_transforms(stream);
+}
+
+/* Move the window to iwindow and read in the layers of every
+   variable. */
+static
+cg_field *
+load_window(cg_stream *stream, int iwindow)
+{
+  cg_field *window = stream->window;
+  int n;
+
+  if (iwindow < 0 || iwindow >= stream->nwindows) {
+    return NULL;
+  }
+  stream->iwindow = iwindow;
+  move_window(stream, iwindow);
+  for (n = 0; n < window->nvars; n++) {
+    if (!window_io(stream, n, n, 0)) {
+      stream->iwindow = -1;
+      return NULL;
+    }
+  }
+  return window;
+}
+
+/* Load window iwindow of the fractal */
+cg_field *
+cg_stream_fractal_window(cg_stream *stream, int iwindow)
+{
+  cg_field *window = load_window(stream, iwindow);
+  if (window) {
+    cg_revert_layers(window);
+  }
+  return window;
+}
+
+/* Load window iwindow of the fractal, leaving the layers in
+   horizontal Fourier space */
+cg_field *
+cg_stream_layers_window(cg_stream *stream, int iwindow)
+{
+  cg_field *window = load_window(stream, iwindow);
+  if (window) {
+    cg_finish_layers(window);
+  }
+  return window;
+}
+
+/* Save the layers of the window in memory as the final result */
+int
+cg_stream_store_window(cg_stream *stream)
+{
+  int n;
+  if (stream->iwindow < 0) {
+    return 0;
+  }
+  for (n = 0; n < stream->window->nvars; n++) {
+    if (!window_io(stream, n, n, 1)) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/* Load window iwindow of the final result */
+cg_field *
+cg_stream_result_window(cg_stream *stream, int iwindow)
+{
+  return load_window(stream, iwindow);
+}
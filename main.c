@@ -5,6 +5,7 @@
 #include <ctype.h>
 #include <stdarg.h>
 #include <netcdf.h>
+#include <netcdf_meta.h>
 
 #include "cloudgen.h"
 #include "readconfig.h"
@@ -13,7 +14,30 @@
 
 #include "config.h"
 
-char verbose = 0;
+#ifdef CG_ENABLE_ASYNC_OUTPUT
+#include <pthread.h>
+#endif
+
+#ifndef NC_HAS_PARALLEL4
+#define NC_HAS_PARALLEL4 0
+#endif
+#if defined(CG_ENABLE_MPI) && NC_HAS_PARALLEL4
+#include <netcdf_par.h>
+#endif
+
+/* In a build of both precisions this file is compiled once for
+   each, with main() renamed, and precision.c chooses between them */
+#ifdef CG_MAIN
+#define main CG_MAIN
+#endif
+
+static char verbose = 0;
+
+#ifdef CG_ENABLE_MPI
+/* Rank of this process and number of processes in MPI_COMM_WORLD */
+static int mpi_rank = 0;
+static int mpi_size = 1;
+#endif
 
 /* Send a message to standard output if verbose is true.  */
 static
@@ -30,25 +54,39 @@ chat(char *format, ...)
   }
 }
 
+/* Quit with the given status, taking any other MPI processes down
+   too. */
+static
+void
+quit(int status)
+{
+#ifdef CG_ENABLE_MPI
+  if (mpi_size > 1) {
+    MPI_Abort(MPI_COMM_WORLD, status);
+  }
+#endif
+  exit(status);
+}
+
 /* Check the return value from a call to a NetCDF function and quit
    semi-elegantly if an error occurred. */
-int ncstatus;
+static int ncstatus;
 #define nc_check(a) if ((ncstatus = (a)) != NC_NOERR) { \
     fprintf(stderr, "NetCDF error on line %d of %s: %s\n", __LINE__, \
       __FILE__, nc_strerror(ncstatus)); \
-    exit(-1); \
+    quit(-1); \
 }
 
 /* Add a NetCDF dimension and a coordinate variable with axis, units
    and long_name attributes. */
 static
 void
-add_dimension(int ncid, char *name, int n, int *dimid,
+add_dimension(int ncid, nc_type xtype, char *name, int n, int *dimid,
 	      int *varid, char *long_name)
 {
   char axis[2] = {'X', '\0'};
   nc_check(nc_def_dim(ncid, name, n, dimid));
-  nc_check(nc_def_var(ncid, name, NC_REAL, 1, dimid, varid));
+  nc_check(nc_def_var(ncid, name, xtype, 1, dimid, varid));
   nc_check(nc_put_att_text(ncid, *varid, "long_name",
 			   strlen(long_name), long_name));
   nc_check(nc_put_att_text(ncid, *varid, "units", 1, "m"));
@@ -59,10 +97,10 @@ add_dimension(int ncid, char *name, int n, int *dimid,
 /* Add a vector of floats with long_name and units attributes. */
 static
 void
-add_vector(int ncid, char *name, int dimid,
+add_vector(int ncid, nc_type xtype, char *name, int dimid,
 	   int *varid, char *units, char *long_name)
 {
-  nc_check(nc_def_var(ncid, name, NC_REAL, 1, &dimid, varid));
+  nc_check(nc_def_var(ncid, name, xtype, 1, &dimid, varid));
   if (long_name) {
     nc_check(nc_put_att_text(ncid, *varid, "long_name",
 			     strlen(long_name),long_name));
@@ -76,9 +114,10 @@ add_vector(int ncid, char *name, int dimid,
 /* Add a scalar float variable with long_name and units attributes. */
 static
 void
-add_scalar(int ncid, char *name, int *varid, char *units, char *long_name)
+add_scalar(int ncid, nc_type xtype, char *name, int *varid, char *units,
+	   char *long_name)
 {
-  nc_check(nc_def_var(ncid, name, NC_REAL, 0, NULL, varid));
+  nc_check(nc_def_var(ncid, name, xtype, 0, NULL, varid));
   if (long_name) {
     nc_check(nc_put_att_text(ncid, *varid, "long_name",
 			     strlen(long_name),long_name));
@@ -105,6 +144,634 @@ add_scalar_int(int ncid, char *name, int *varid, char *units, char *long_name)
   }
 }
 
+#ifndef NC_HAS_CDF5
+#define NC_HAS_CDF5 0
+#endif
+#ifndef NC_HAS_NC4
+#define NC_HAS_NC4 1
+#endif
+
+/* The formats the output can be written in, in the order they are
+   tried when none is given, with whether this NetCDF library can
+   write them and the most data they can hold in bytes: in all the
+   3D variables together, for the classic format, whose offsets are
+   32-bit, and in each of them, for the 64-bit offset format, whose
+   variable sizes are still 32-bit. The classic limit leaves 1 MiB for
+   the header and the profiles. A limit of 0 means none. */
+static const struct {
+  char *name;
+  int cmode;
+  int available;
+  double total_limit;
+  double variable_limit;
+} output_formats[] = {
+  {"classic", 0, 1, 2147483648.0 - 1048576.0, 0.0},
+  {"64bit_offset", NC_64BIT_OFFSET, 1, 0.0, 4294967292.0},
+  {"cdf5", NC_64BIT_DATA, NC_HAS_CDF5, 0.0, 0.0},
+  {"netcdf4", NC_NETCDF4, NC_HAS_NC4, 0.0, 0.0},
+  {"netcdf4_classic", NC_NETCDF4 | NC_CLASSIC_MODEL, NC_HAS_NC4, 0.0, 0.0},
+  {NULL, 0, 0, 0.0, 0.0}
+};
+
+/* How the output file and its 3D variables are stored */
+typedef struct {
+  /* Name of the format and its flags for nc_create() */
+  char *format;
+  int cmode;
+  /* Chunk shape in z, y and x, or 0 to let the library choose */
+  int chunk[3];
+  /* Compression, 0 for none */
+  int deflate_level;
+  int shuffle;
+  /* Significant digits kept by quantisation, 0 to keep every bit */
+  int significant_digits;
+  /* Whether all the MPI processes write to the file together */
+  int parallel;
+  /* Type of the real values in the file. NetCDF converts them to it
+     as they are written, through a buffer as large as each write. */
+  nc_type xtype;
+} output_storage;
+
+/* Return whether format iformat can hold nvars 3D variables of
+   "size" bytes each */
+static
+int
+format_holds(int iformat, double size, int nvars)
+{
+  return (output_formats[iformat].total_limit == 0.0
+	  || size*nvars <= output_formats[iformat].total_limit)
+    && (output_formats[iformat].variable_limit == 0.0
+	|| size <= output_formats[iformat].variable_limit);
+}
+
+/* Read the format of the output file and the storage of its 3D
+   variables from config. Without output_format, or if it is "auto",
+   the first format that can hold the field is used, or NetCDF-4 if
+   chunking, compression, quantisation or parallel output is asked
+   for, as these need it. This is checked from the shape in config,
+   before the field is created. Returns 1 on success and 0 if the
+   options cannot be met. */
+static
+int
+read_output_storage(rc_data *config, output_storage *storage)
+{
+  char *format = NULL;
+  char *precision = NULL;
+  int *chunk;
+  int nchunk = 0;
+  int netcdf4_options;
+  int max_digits;
+  int nx, ny, nz, nvars;
+  double size;
+  int i;
+
+  memset(storage, 0, sizeof(output_storage));
+  storage->xtype = NC_REAL;
+  if (rc_assign_string(config, "output_precision", &precision)) {
+    if (strcmp(precision, "single") == 0) {
+      storage->xtype = NC_FLOAT;
+    }
+    else if (strcmp(precision, "double") == 0) {
+      storage->xtype = NC_DOUBLE;
+    }
+    else {
+      fprintf(stderr, "Error: output_precision must be \"single\" or \"double\"\n");
+      free(precision);
+      return 0;
+    }
+    free(precision);
+  }
+  max_digits = storage->xtype == NC_FLOAT ? 7 : 15;
+  rc_assign_int(config, "deflate_level", &storage->deflate_level);
+  storage->shuffle = rc_get_boolean(config, "shuffle");
+  rc_assign_int(config, "significant_digits",
+		&storage->significant_digits);
+  chunk = rc_get_int_array(config, "chunk_sizes", &nchunk);
+
+  if (storage->deflate_level < 0 || storage->deflate_level > 9) {
+    fprintf(stderr, "Error: deflate_level must be between 0 and 9\n");
+    return 0;
+  }
+  if (storage->significant_digits < 0
+      || storage->significant_digits > max_digits) {
+    fprintf(stderr, "Error: significant_digits must be between 0 and %d\n",
+	    max_digits);
+    return 0;
+  }
+#ifndef NC_QUANTIZE_BITGROOM
+  if (storage->significant_digits) {
+    fprintf(stderr, "Error: significant_digits needs NetCDF 4.9.0 or later\n");
+    return 0;
+  }
+#endif
+  if (nchunk) {
+    if (nchunk != 3) {
+      fprintf(stderr, "Error: chunk_sizes must have three values (z y x)\n");
+      free(chunk);
+      return 0;
+    }
+    for (i = 0; i < 3; i++) {
+      if (chunk[i] <= 0) {
+	fprintf(stderr, "Error: chunk_sizes must be positive\n");
+	free(chunk);
+	return 0;
+      }
+      storage->chunk[i] = chunk[i];
+    }
+    free(chunk);
+  }
+  if (rc_get_boolean(config, "parallel_io")) {
+#if defined(CG_ENABLE_MPI) && NC_HAS_PARALLEL4
+    storage->parallel = mpi_size > 1;
+#else
+    fprintf(stderr, "Error: parallel_io needs MPI and a NetCDF library built for parallel I/O\n");
+    return 0;
+#endif
+  }
+  netcdf4_options = nchunk || storage->deflate_level || storage->shuffle
+    || storage->significant_digits || storage->parallel;
+
+  rc_get_shape(config, &nx, &ny, &nz, &nvars);
+  size = (double) nx * ny * nz
+    * (storage->xtype == NC_FLOAT ? sizeof(float) : sizeof(double));
+
+  if (!rc_assign_string(config, "output_format", &format)
+      || strcmp(format, "auto") == 0) {
+    free(format);
+    for (i = 0; output_formats[i].name; i++) {
+      if (output_formats[i].available
+	  && (!netcdf4_options || (output_formats[i].cmode & NC_NETCDF4))
+	  && format_holds(i, size, nvars)) {
+	break;
+      }
+    }
+    if (!output_formats[i].name) {
+      fprintf(stderr, "Error: no output format supported by this NetCDF library can hold the field\n");
+      return 0;
+    }
+  }
+  else {
+    for (i = 0; output_formats[i].name; i++) {
+      if (strcmp(format, output_formats[i].name) == 0) {
+	break;
+      }
+    }
+    if (!output_formats[i].name) {
+      fprintf(stderr, "Error: output_format \"%s\" not recognised\n", format);
+      free(format);
+      return 0;
+    }
+    free(format);
+    if (!output_formats[i].available) {
+      fprintf(stderr, "Error: this NetCDF library cannot write %s files\n",
+	      output_formats[i].name);
+      return 0;
+    }
+    if (netcdf4_options && !(output_formats[i].cmode & NC_NETCDF4)) {
+      fprintf(stderr, "Error: chunk_sizes, deflate_level, shuffle, significant_digits and parallel_io need a NetCDF-4 output_format\n");
+      return 0;
+    }
+    if (!format_holds(i, size, nvars)) {
+      fprintf(stderr, "Error: a %dx%dx%d field is too large for the %s format\n",
+	      nx, ny, nz, output_formats[i].name);
+      return 0;
+    }
+  }
+  storage->format = output_formats[i].name;
+  storage->cmode = output_formats[i].cmode;
+  return 1;
+}
+
+/* Set the chunking, compression and quantisation of 3D variable
+   varid. Unless chunk_sizes was given, a compressed variable is
+   stored in chunks of one layer, which are written whole. */
+static
+void
+define_storage(int ncid, int varid, cg_field *field,
+	       const output_storage *storage)
+{
+  size_t dims[3], chunk[3];
+  int i;
+
+  if (!(storage->cmode & NC_NETCDF4)) {
+    return;
+  }
+  dims[0] = field->nz;
+  dims[1] = field->ny;
+  dims[2] = field->nx;
+  if (storage->chunk[0]) {
+    for (i = 0; i < 3; i++) {
+      chunk[i] = (size_t) storage->chunk[i] < dims[i]
+	? (size_t) storage->chunk[i] : dims[i];
+    }
+    nc_check(nc_def_var_chunking(ncid, varid, NC_CHUNKED, chunk));
+  }
+  else if (storage->deflate_level || storage->shuffle
+	   || storage->significant_digits) {
+    chunk[0] = 1;
+    chunk[1] = dims[1];
+    chunk[2] = dims[2];
+    nc_check(nc_def_var_chunking(ncid, varid, NC_CHUNKED, chunk));
+  }
+  if (storage->deflate_level || storage->shuffle) {
+    nc_check(nc_def_var_deflate(ncid, varid, storage->shuffle,
+				storage->deflate_level > 0,
+				storage->deflate_level));
+  }
+#ifdef NC_QUANTIZE_BITGROOM
+  if (storage->significant_digits) {
+    nc_check(nc_def_var_quantize(ncid, varid, NC_QUANTIZE_BITGROOM,
+				 storage->significant_digits));
+  }
+#endif
+}
+
+/* Create the output file, shared by all the processes if they write
+   to it together */
+static
+void
+create_output(char *output_filename, const output_storage *storage,
+	      int *ncid)
+{
+#if defined(CG_ENABLE_MPI) && NC_HAS_PARALLEL4
+  if (storage->parallel) {
+    nc_check(nc_create_par(output_filename, NC_CLOBBER | storage->cmode,
+			   MPI_COMM_WORLD, MPI_INFO_NULL, ncid));
+    return;
+  }
+#endif
+  nc_check(nc_create(output_filename, NC_CLOBBER | storage->cmode, ncid));
+}
+
+/* Add to the history attribute. Every process defining a shared file
+   must give the same value, so the time and host are those of rank
+   0. */
+static
+void
+add_history(int ncid, char *user, const output_storage *storage)
+{
+#ifdef CG_ENABLE_MPI
+  if (storage->parallel) {
+    char history[NCT_HISTORY_LENGTH];
+    if (mpi_rank == 0) {
+      nct_history_entry(history, NCT_HISTORY_LENGTH, "Generated", user);
+    }
+    MPI_Bcast(history, NCT_HISTORY_LENGTH, MPI_CHAR, 0, MPI_COMM_WORLD);
+    nct_append_attribute(ncid, NC_GLOBAL, "history", history, "\n");
+    return;
+  }
+#else
+  (void) storage;
+#endif
+  nct_add_history(ncid, "Generated", user);
+}
+
+/* Write nz contiguous layers of nx by ny values from data to varid,
+   starting at layer z_start of the file. They are written in one go,
+   unless they are converted to another type xtype, when they are
+   written a layer at a time so that NetCDF's conversion buffer holds
+   only one layer rather than a copy of them all. At least nwrites
+   writes are made, the extra ones empty, as every process must take
+   part in each collective write. */
+static
+void
+put_layers(int ncid, int varid, nc_type xtype, int z_start, int nz,
+	   int nx, int ny, const real *data, int nwrites)
+{
+  size_t start[3] = {0, 0, 0};
+  size_t count[3] = {0, 0, 0};
+  int slab = xtype == NC_REAL ? nz : 1;
+  int nslabs = nz > 0 ? (nz + slab - 1) / slab : 0;
+  int i;
+
+  if (nslabs < nwrites) {
+    nslabs = nwrites;
+  }
+  count[1] = ny;
+  count[2] = nx;
+  for (i = 0; i < nslabs; i++) {
+    int k = i*slab;
+    if (k < nz) {
+      start[0] = z_start + k;
+      count[0] = k + slab < nz ? slab : nz - k;
+      nc_check(NC_PUT_VARA_REAL(ncid, varid, start, count,
+				data + (size_t) nx*ny*k));
+    }
+    else {
+      start[0] = 0;
+      count[0] = 0;
+      nc_check(NC_PUT_VARA_REAL(ncid, varid, start, count, data));
+    }
+  }
+}
+
+/* Write the layers of variable ivar held by this process to varid,
+   once cg_finish_join_layers() has made them contiguous. In a
+   collective write every process takes part, even with no layers. */
+static
+void
+write_layers(int ncid, int varid, cg_field *field, int ivar,
+	     nc_type xtype, int collective)
+{
+  int nwrites = 0;
+
+  if (collective) {
+    nwrites = 1;
+#ifdef CG_ENABLE_MPI
+    if (xtype != NC_REAL) {
+      MPI_Allreduce(&field->local_nz, &nwrites, 1, MPI_INT, MPI_MAX,
+		    MPI_COMM_WORLD);
+    }
+#endif
+  }
+  put_layers(ncid, varid, xtype, field->z_start, field->local_nz,
+	     field->nx, field->ny, field->field[ivar], nwrites);
+}
+
+#ifdef CG_ENABLE_ASYNC_OUTPUT
+/* The layers of each window are finished in this many batches, each
+   written while the next is being finished */
+#define OUTPUT_BATCHES 8
+
+/* A thread writing the layers of the output as they are finished,
+   so that the file is written while later layers are processed. The
+   queue is the run of layers of the current window from "written"
+   up to "finished": as cg_finish_join_layers() leaves them where
+   they are to be written from, the queue needs no memory of its own
+   and is bounded by the window. All the layers waiting are written
+   at once, in one hyperslab per variable. Out of core, the window
+   alternates between two sets of arrays, so that the next window is
+   loaded and processed while the last is still being written. Only
+   this thread calls NetCDF while it runs. */
+typedef struct {
+  int ncid;
+  int varids[CG_MAX_VARS];
+  int nvars;
+  nc_type xtype;
+  int nx, ny;
+  real *data[CG_MAX_VARS];     /* Layers of the window being written */
+  int z_start;                 /* Index of its first layer */
+  int written;
+  int finished;
+  int stop;
+  complex *spare[CG_MAX_VARS]; /* The arrays not in the window, or NULL */
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
+} layer_writer;
+
+static
+void *
+run_writer(void *arg)
+{
+  layer_writer *writer = arg;
+
+  pthread_mutex_lock(&writer->lock);
+  for (;;) {
+    int k_begin = writer->written;
+    int k_end = writer->finished;
+    long int size = (long int) writer->nx * writer->ny;
+    int ivar;
+
+    if (k_begin == k_end) {
+      if (writer->stop) {
+	break;
+      }
+      pthread_cond_wait(&writer->changed, &writer->lock);
+      continue;
+    }
+    pthread_mutex_unlock(&writer->lock);
+
+    /* The window is only changed once its queue is empty */
+    for (ivar = 0; ivar < writer->nvars; ivar++) {
+      put_layers(writer->ncid, writer->varids[ivar], writer->xtype,
+		 writer->z_start + k_begin, k_end - k_begin,
+		 writer->nx, writer->ny,
+		 writer->data[ivar] + size*k_begin, 0);
+    }
+
+    pthread_mutex_lock(&writer->lock);
+    writer->written = k_end;
+    pthread_cond_broadcast(&writer->changed);
+  }
+  pthread_mutex_unlock(&writer->lock);
+  return NULL;
+}
+
+/* Start a thread writing the first nvars variables of the windows
+   handed to begin_window() to varids, of type xtype */
+static
+void
+start_writer(layer_writer *writer, int ncid, const int *varids, int nvars,
+	     nc_type xtype)
+{
+  int ivar;
+  writer->ncid = ncid;
+  writer->xtype = xtype;
+  for (ivar = 0; ivar < nvars; ivar++) {
+    writer->varids[ivar] = varids[ivar];
+  }
+  writer->nvars = nvars;
+  writer->written = writer->finished = 0;
+  writer->stop = 0;
+  for (ivar = 0; ivar < CG_MAX_VARS; ivar++) {
+    writer->spare[ivar] = NULL;
+  }
+  pthread_mutex_init(&writer->lock, NULL);
+  pthread_cond_init(&writer->changed, NULL);
+  if (pthread_create(&writer->thread, NULL, run_writer, writer)) {
+    fprintf(stderr, "Error starting the output thread\n");
+    quit(1);
+  }
+}
+
+/* Wait for the layers queued to be written, so that the arrays they
+   are written from may be reused */
+static
+void
+drain_writer(layer_writer *writer)
+{
+  pthread_mutex_lock(&writer->lock);
+  while (writer->written < writer->finished) {
+    pthread_cond_wait(&writer->changed, &writer->lock);
+  }
+  pthread_mutex_unlock(&writer->lock);
+}
+
+/* Once the layers of the last window have been written, start the
+   queue again at the first layer of "window" */
+static
+void
+begin_window(layer_writer *writer, cg_field *window)
+{
+  int ivar;
+  drain_writer(writer);
+  pthread_mutex_lock(&writer->lock);
+  writer->nx = window->nx;
+  writer->ny = window->ny;
+  for (ivar = 0; ivar < writer->nvars; ivar++) {
+    writer->data[ivar] = window->field[ivar];
+  }
+  writer->z_start = window->z_start;
+  writer->written = writer->finished = 0;
+  pthread_mutex_unlock(&writer->lock);
+}
+
+/* Queue the layers of the window finished since the last call, up to
+   local layer k_end, to be written */
+static
+void
+queue_layers(layer_writer *writer, int k_end)
+{
+  pthread_mutex_lock(&writer->lock);
+  writer->finished = k_end;
+  pthread_cond_broadcast(&writer->changed);
+  pthread_mutex_unlock(&writer->lock);
+}
+
+/* Give "window" the other set of arrays, so that the next window may
+   be loaded while this one is still being written. The other arrays
+   were last written from by the window before, which begin_window()
+   has waited for. If they cannot be allocated, wait for this window
+   to be written instead. */
+static
+void
+swap_window(layer_writer *writer, cg_field *window)
+{
+  size_t size = (size_t) (window->nx/2+1) * window->ny * window->local_nz
+    * sizeof(complex);
+  int ivar;
+  for (ivar = 0; ivar < window->nvars; ivar++) {
+    complex *p = writer->spare[ivar];
+    if (!p && !(p = writer->spare[ivar] = fftw_malloc(size))) {
+      drain_writer(writer);
+      return;
+    }
+  }
+  for (ivar = 0; ivar < window->nvars; ivar++) {
+    complex *p = writer->spare[ivar];
+    writer->spare[ivar] = window->p[ivar];
+    window->p[ivar] = p;
+    window->field[ivar] = (real *) p;
+  }
+}
+
+/* Write what is left in the queue and stop the thread */
+static
+void
+stop_writer(layer_writer *writer)
+{
+  int ivar;
+  pthread_mutex_lock(&writer->lock);
+  writer->stop = 1;
+  pthread_cond_broadcast(&writer->changed);
+  pthread_mutex_unlock(&writer->lock);
+  pthread_join(writer->thread, NULL);
+  pthread_cond_destroy(&writer->changed);
+  pthread_mutex_destroy(&writer->lock);
+  for (ivar = 0; ivar < CG_MAX_VARS; ivar++) {
+    if (writer->spare[ivar]) {
+      fftw_free(writer->spare[ivar]);
+    }
+  }
+}
+
+/* Finish the layers of "window" for output a batch at a time,
+   handing each batch to the writer as soon as the last window has
+   been written */
+static
+void
+finish_and_write(cg_field *window, const cg_output *output,
+		 layer_writer *writer)
+{
+  int batch = (window->local_nz + OUTPUT_BATCHES - 1) / OUTPUT_BATCHES;
+  int k, k_end;
+
+  begin_window(writer, window);
+  for (k = 0; k < window->local_nz; k = k_end) {
+    k_end = k + batch < window->local_nz ? k + batch : window->local_nz;
+    cg_finish_join_layers(window, output, k, k_end);
+    queue_layers(writer, k_end);
+  }
+}
+#endif
+
+/* When generating out of core, save the window just processed,
+   unless "store" is zero because it has already been written out,
+   and load window iwindow of the fractal, with its layers in
+   horizontal Fourier space if "layers" is set, returning NULL after
+   the last window. Returns NULL straight away for a field held in
+   memory. */
+static
+cg_field *
+next_window(cg_stream *stream, int iwindow, int layers, int store)
+{
+  cg_field *window;
+  if (!stream || iwindow >= stream->nwindows) {
+    if (stream && store && !cg_stream_store_window(stream)) {
+      fprintf(stderr, "Error writing the scratch file\n");
+      quit(1);
+    }
+    return NULL;
+  }
+  if ((store && !cg_stream_store_window(stream))
+      || !(window = layers ? cg_stream_layers_window(stream, iwindow)
+	   : cg_stream_fractal_window(stream, iwindow))) {
+    fprintf(stderr, "Error accessing the scratch file\n");
+    quit(1);
+  }
+  return window;
+}
+
+/* Return the layers of the final field to write out: the whole field
+   if held in memory, or window iwindow of the result if generating
+   out of core. Returns NULL when all the layers have been returned. */
+static
+cg_field *
+result_window(cg_stream *stream, cg_field *field, int iwindow)
+{
+  cg_field *window;
+  if (!stream) {
+    return iwindow == 0 ? field : NULL;
+  }
+  if (iwindow >= stream->nwindows) {
+    return NULL;
+  }
+  if (!(window = cg_stream_result_window(stream, iwindow))) {
+    fprintf(stderr, "Error reading the scratch file\n");
+    quit(1);
+  }
+  return window;
+}
+
+#ifdef CG_ENABLE_MPI
+/* Add the layers held by a process other than rank 0 to the file
+   that rank 0 has created. The processes take it in turns, each
+   waiting for the previous rank to close the file. */
+static
+void
+append_layers(char *output_filename, char *name, char *size_name,
+	      cg_field *field, int is_size, nc_type xtype)
+{
+  int ncid, varid;
+  int token = 0;
+
+  MPI_Recv(&token, 1, MPI_INT, mpi_rank-1, 0, MPI_COMM_WORLD,
+	   MPI_STATUS_IGNORE);
+  nc_check(nc_open(output_filename, NC_WRITE, &ncid));
+  nc_check(nc_inq_varid(ncid, name, &varid));
+  write_layers(ncid, varid, field, 0, xtype, 0);
+  if (is_size) {
+    nc_check(nc_inq_varid(ncid, size_name, &varid));
+    write_layers(ncid, varid, field, 1, xtype, 0);
+  }
+  nc_check(nc_close(ncid));
+  if (mpi_rank < mpi_size-1) {
+    MPI_Send(&token, 1, MPI_INT, mpi_rank+1, 0, MPI_COMM_WORLD);
+  }
+}
+#endif
+
 /* Show usage information and then quit. */
 static
 void
@@ -141,8 +808,16 @@ main(int argc, char **argv)
   char *title = NULL;
   real default_interp_height[] = {0.0};
   int n_interp = 0;
+  int skip_roundtrip = 0;
+  double *layer_power = NULL;
+  double *size_layer_power = NULL;
+  cg_output output;
+  output_storage storage;
   int seed = 1;
   char *dev_random = NULL;
+  char *wisdom_file = NULL;
+  char *simd = NULL;
+  char *precision = NULL;
   real default_x_displacement[] = {0.0};
   real default_y_displacement[] = {0.0};
   real default_horizontal_exponent[] = {0.0};
@@ -181,20 +856,38 @@ main(int argc, char **argv)
   real *grid_size_mean = NULL;
   real *grid_size_std = NULL;
 
+  real *spectrum_wavenumber = NULL;
+  real *spectrum_energy = NULL;
+  int n_spectrum = 0;
+
   /* Other variables */
   rc_data *config;
   real dx;
   real dz;
   cg_field *field;
-  int j, k;
+  cg_field *window;
+  cg_stream *stream = NULL;
+  cg_spectrum *spectrum;
+  int iwindow;
+  int status;
+  char was_verbose;
+  int out_of_core = 0;
+  int defines_file;
+  int async_output;
+#ifdef CG_ENABLE_MPI
+  int mpi_thread_level = MPI_THREAD_SINGLE;
+#endif
+  char is_written = 0;
+#ifdef CG_ENABLE_ASYNC_OUTPUT
+  layer_writer writer_data;
+  layer_writer *writer = NULL;
+#endif
   char is_lognormal = 0;
   char is_threshold = 0;
   char is_size = 0;
   int is_mean = 0;
   char *version = "Cloudgen version " PROJECT_VERSION;
   char *confstring = NULL;
-  size_t start[3] = {0, 0, 0};
-  size_t count[3] = {1, 1, 0};
 
   /* NetCDF identifiers */
   int ncid, fieldid;
@@ -206,6 +899,14 @@ main(int argc, char **argv)
   int vertexponentid, genlevelid, outerscaleid, seedid;
   int dimids[3];
 
+#ifdef CG_ENABLE_MPI
+  /* Only the main thread makes MPI calls, but the FFTW, OpenMP and
+     writer threads need the library to allow other threads */
+  MPI_Init_thread(&argc, &argv, MPI_THREAD_FUNNELED, &mpi_thread_level);
+  MPI_Comm_rank(MPI_COMM_WORLD, &mpi_rank);
+  MPI_Comm_size(MPI_COMM_WORLD, &mpi_size);
+#endif
+
   /* Find the first config file on the command line. */
   int ifile = rc_get_file(argc, argv);
 
@@ -245,6 +946,11 @@ main(int argc, char **argv)
 
   /* First whether to be verbose - if not then chat() does nothing. */
   verbose = rc_get_boolean(config, "verbose");
+#ifdef CG_ENABLE_MPI
+  if (mpi_rank > 0) {
+    verbose = 0;
+  }
+#endif
 
   /* Check precision */
 #ifdef FFTW_ENABLE_FLOAT
@@ -264,6 +970,18 @@ main(int argc, char **argv)
     chat("Cloudgen " PROJECT_VERSION ": compiled to use double-precision internally");
   }
 #endif
+  if (rc_assign_string(config, "precision", &precision)) {
+    if (strcmp(precision, "single") != 0
+	&& strcmp(precision, "double") != 0) {
+      fprintf(stderr, "Error: precision must be \"single\" or \"double\"\n");
+      quit(1);
+    }
+    if (strcmp(precision, sizeof(real) == 4 ? "single" : "double") != 0) {
+      fprintf(stderr, "Error: %s precision needs cloudgen built with USE_MIXED_PRECISION\n",
+	      precision);
+      quit(1);
+    }
+  }
 
   if (ifile) {
     chat("Reading configuration information from %s", argv[ifile]);
@@ -295,6 +1013,30 @@ main(int argc, char **argv)
   title = rc_get_string(config, "title");
   user = rc_get_string(config, "user");
 
+  /* How to store the output, checked before the field is created
+     rather than once it has been generated */
+  if (!read_output_storage(config, &storage)) {
+    quit(1);
+  }
+  chat("Writing in %s format with %s-precision values", storage.format,
+       storage.xtype == NC_FLOAT ? "single" : "double");
+
+  /* Whether to write the layers from another thread as they are
+     finished */
+  async_output = rc_get_boolean(config, "async_output");
+#ifndef CG_ENABLE_ASYNC_OUTPUT
+  if (async_output) {
+    fprintf(stderr, "Error: async_output needs cloudgen built with USE_ASYNC_OUTPUT\n");
+    quit(1);
+  }
+#endif
+#ifdef CG_ENABLE_MPI
+  if (async_output && mpi_thread_level < MPI_THREAD_FUNNELED) {
+    chat("The MPI library does not support threads: writing the layers in turn");
+    async_output = 0;
+  }
+#endif
+
   /* Do we threshold the field? */
   is_threshold = rc_assign_real(config, "threshold", &threshold);
   rc_assign_real(config, "missing_value", &missing_value);
@@ -307,7 +1049,14 @@ main(int argc, char **argv)
     seed = kernel_int_seed();
     close_kernel_random_file();
   }
+#ifdef CG_ENABLE_MPI
+  /* Every process must draw the same sequence of random numbers */
+  MPI_Bcast(&seed, 1, MPI_INT, 0, MPI_COMM_WORLD);
+#endif
   seed_random_number_generator(seed);
+  if (rc_get_boolean(config, "counter_phases")) {
+    cg_select_counter_phases(1, seed);
+  }
 
   /* The height dependent properties depend on the presence of interp_height. */
   n_interp = rc_assign_real_array(config, "interp_height",
@@ -336,7 +1085,83 @@ main(int argc, char **argv)
     }
   }
 
-  field = rc_generate_base_field(config);
+  /* A tabulated spectrum replaces the power law */
+  n_spectrum = rc_assign_real_array(config, "spectrum_wavenumber",
+				    &spectrum_wavenumber, 1);
+  if (n_spectrum
+      && rc_assign_real_array(config, "spectrum_energy",
+			      &spectrum_energy, n_spectrum) != n_spectrum) {
+    fprintf(stderr, "Error: spectrum_energy must have the same length as spectrum_wavenumber\n");
+    quit(1);
+  }
+
+  /* Choose the instruction set of the vectorised kernels */
+  if (rc_assign_string(config, "simd", &simd) && !cg_select_simd(simd)) {
+    fprintf(stderr, "Error: instruction set \"%s\" is not supported\n",
+	    simd);
+    quit(1);
+  }
+  chat("Using %s vectorised kernels", cg_simd_name());
+  if (rc_exists(config, "libm_exp")) {
+    cg_select_libm_exp(rc_get_boolean(config, "libm_exp"));
+  }
+  if (cg_libm_exp()) {
+    chat("Using the C library's exponential");
+  }
+
+  /* Load the FFTW wisdom from previous runs before any transforms
+     are planned. */
+  if (rc_assign_string(config, "wisdom_file", &wisdom_file)) {
+#ifdef CG_ENABLE_MPI
+    if (cg_import_wisdom_mpi(wisdom_file, MPI_COMM_WORLD)) {
+#else
+    if (cg_import_wisdom(wisdom_file)) {
+#endif
+      chat("Loaded FFTW wisdom from %s", wisdom_file);
+    }
+    else {
+      chat("No FFTW wisdom found in %s", wisdom_file);
+    }
+  }
+
+  /* Generate the field out of core if a memory budget is given,
+     unless it is distributed across MPI processes. */
+  out_of_core = rc_exists(config, "memory_budget");
+#ifdef CG_ENABLE_MPI
+  if (mpi_size > 1) {
+    out_of_core = 0;
+  }
+#endif
+  if (out_of_core) {
+    if (!(stream = rc_generate_stream(config))) {
+      quit(1);
+    }
+    field = stream->window;
+    chat("Holding %d of %d layers in memory at a time",
+	 field->local_nz, field->nz);
+  }
+  else {
+    field = rc_generate_base_field(config);
+  }
+  if (!field) {
+    fprintf(stderr, "Error creating cloud field\n");
+    quit(1);
+  }
+
+  /* The layers are manipulated in horizontal Fourier space, so
+     unless the field is distributed the fractal need not be taken
+     back to real space and transformed again. */
+  skip_roundtrip = n_interp && !field->distributed
+    && rc_get_boolean(config, "skip_layer_roundtrip");
+
+  /* Space for the variance of each layer; without it the layers are
+     read in real space instead */
+  if (n_interp && field->local_nz > 0) {
+    layer_power = malloc(field->local_nz * sizeof(double));
+    if (is_size) {
+      size_layer_power = malloc(field->local_nz * sizeof(double));
+    }
+  }
 
   /* Interpolate vectors on to the field->z grid. */
   if (n_interp) {
@@ -376,263 +1201,445 @@ main(int argc, char **argv)
     }
   }
 
-  /* Generate initial isotropic fractal. */
-  chat("Generating random phases with seed %d", seed);
-  cg_random_phase(field, 0);
-  /*  cg_unity_phase(field, 0);*/
-
-  if (is_size) {
-    cg_correlated_phase(field, 1, 0, size_correlation);
+  /* Tabulate the spectrum */
+  if (n_spectrum) {
+    chat("Using tabulated spectrum with %d points", n_spectrum);
+    spectrum = cg_new_tabulated_spectrum(n_spectrum, spectrum_wavenumber,
+					 spectrum_energy);
   }
-
-  chat("Calculating power law with exponent %g and outer scale %g m",
-       vertical_exponent, outer_scale);
-  cg_power_law(field, 0, outer_scale, vertical_exponent, 0.0);
-
-  if (is_size) {
-    cg_power_law(field, 1, outer_scale, vertical_exponent, 0.0);
+  else {
+    chat("Calculating power law with exponent %g and outer scale %g m",
+	 vertical_exponent, outer_scale);
+    spectrum = cg_new_power_law_spectrum(field, outer_scale,
+					 vertical_exponent, 0.0);
+    if (spectrum) {
+      /* As cg_power_law() */
+      spectrum->factor = 1.0 + 1.0 * I;
+    }
+  }
+  if (!spectrum) {
+    fprintf(stderr, "Error creating the spectrum: the wavenumbers must be strictly increasing and the energies positive\n");
+    quit(1);
   }
 
-  chat("Generating fractal (inverse 3D Fourier transform)");
-  cg_generate_fractal(field);
-
-  /* If interp_height is present then manipulate the individual layers. */
-  if (n_interp) {
-    chat("Transforming individual layers (2D Fourier transforms)");
-    cg_transform_layers(field);
-    /* Manipulate 2D phases to simulate displacement and a different
-       power spectrum */
-    chat("Displacing layers horizontally");
-    cg_translate_layers(field, grid_x_displacement, grid_y_displacement);
-    if (rc_get_boolean(config, "anisotropic_mixing")) {
-      chat("Changing spectral slope of each layer anisotropically");
-      cg_anisotropic_change_slope_layers(field, 0, outer_scale,
-					 grid_horizontal_exponent,
-					 vertical_exponent,
-					 grid_x_displacement,
-					 grid_y_displacement);
-      if (is_size) {
-	cg_anisotropic_change_slope_layers(field, 1, outer_scale,
-					   grid_horizontal_exponent,
-					   vertical_exponent,
-					   grid_x_displacement,
-					   grid_y_displacement);
-      }
+  /* Generate initial isotropic fractal. */
+  chat("Generating %srandom phases with seed %d",
+       cg_field_counter_phases(field) ? "counter-based " : "", seed);
+  if (stream) {
+    chat("Generating fractal (inverse 3D Fourier transform) out of core");
+    if (!cg_stream_generate(stream, spectrum, size_correlation)
+	|| !(field = skip_roundtrip ? cg_stream_layers_window(stream, 0)
+	     : cg_stream_fractal_window(stream, 0))) {
+      fprintf(stderr, "Error generating the field out of core\n");
+      quit(1);
+    }
+  }
+  else {
+    /* The random phases and the spectrum are applied in one pass */
+    if (is_size) {
+      status = cg_correlated_spectra(field, 0, 1, size_correlation,
+				     spectrum, spectrum);
     }
     else {
-      chat("Changing spectral slope of each layer");
-      cg_change_slope_layers(field, 0, outer_scale,
-			     grid_horizontal_exponent, vertical_exponent);
-      if (is_size) {
-	cg_change_slope_layers(field, 1, outer_scale,
-			       grid_horizontal_exponent, vertical_exponent);
-      }
+      status = cg_random_spectrum(field, 0, spectrum);
+    }
+    if (!status) {
+      fprintf(stderr, "Error generating the spectrum\n");
+      quit(1);
     }
-    chat("Reverting layers (inverse 2D Fourier transforms)");
-    cg_revert_layers(field);
 
-    if (is_mean) {
-      if ((is_lognormal = rc_get_boolean(config, "lognormal_distribution"))) {
-	chat("Converting to lognormal distribution");
-	cg_lognormal_layers(field, 0, grid_std, grid_mean);
+    if (skip_roundtrip) {
+      chat("Generating fractal layers (inverse Fourier transform along z)");
+      if (!cg_generate_layers(field)) {
+	fprintf(stderr, "Error generating the fractal layers\n");
+	quit(1);
       }
-      else {
-	chat("Scaling");
-	cg_scale_layers(field, 0, grid_std, grid_mean);    
-      }
-    }
-    if (is_size) {
-      cg_lognormal_layers(field, 1, grid_size_std, grid_size_mean);
-    }
-  }
-  
-  /* Threshold the field. */
-  if (is_threshold) {
-    if (units[0] == '1' || units[1] == '\0') {
-      chat("Thresholding field at %g", threshold);
     }
     else {
-      chat("Thresholding field at %g %s", threshold, units);
+      chat("Generating fractal (inverse 3D Fourier transform)");
+      cg_generate_fractal(field);
     }
-    cg_threshold(field, 0, threshold, missing_value);
   }
+  cg_delete_spectrum(spectrum);
 
-  /* Write a netcdf file */
-  chat("Writing %s in %s", name, output_filename);
-  nc_check(nc_create(output_filename, NC_CLOBBER, &ncid));
-
-  /* Add dimensions and coordinate variables. */ 
-  add_dimension(ncid, "x", field->nx, &xdimid, &xid, "Distance east");
-  add_dimension(ncid, "y", field->ny, &ydimid, &yid, "Distance north");
-  add_dimension(ncid, "z", field->nz, &zdimid, &zid, "Height");
-  dimids[0] = zdimid; dimids[1] = ydimid; dimids[2] = xdimid;
+  /* What to do to the layers of each variable once in real space */
+  output.transform[0] = output.transform[1] = CG_OUTPUT_AS_IS;
+  if (n_interp && is_mean) {
+    is_lognormal = rc_get_boolean(config, "lognormal_distribution");
+    output.transform[0] = is_lognormal ? CG_OUTPUT_LOGNORMAL
+      : CG_OUTPUT_SCALE;
+    output.std[0] = grid_std;
+    output.mean[0] = grid_mean;
+    output.power[0] = layer_power;
+  }
+  if (n_interp && is_size) {
+    output.transform[1] = CG_OUTPUT_LOGNORMAL;
+    output.std[1] = grid_size_std;
+    output.mean[1] = grid_size_mean;
+    output.power[1] = size_layer_power;
+  }
+  output.threshold_var = is_threshold ? 0 : -1;
+  output.threshold = threshold;
+  output.missing_value = missing_value;
 
-  /* Add scalar variables. */
-  add_scalar_int(ncid, "seed", &seedid, "1",
-		 "Seed for random number generator");
-  add_scalar(ncid, "outer_scale", &outerscaleid, "m",
-	     "Horizontal scale at which the power spectrum becomes flat");
-  add_scalar(ncid, "vertical_exponent", &vertexponentid, "1",
-	     "Exponent of power spectrum in the vertical");
-  
-  if (n_interp) {
-    if (u_wind && v_wind && fall_speed) {
-      add_scalar(ncid, "generating_level", &genlevelid, "m",
-		 "Height from which the fallstreaks originate");
-    }
-
-    /* Add height-dependent variables */
-    add_vector(ncid, "x_displacement", dimids[0], &deltaxid, "m",
-	       "Eastward displacement of fallstreak relative to cloud top");
-    add_vector(ncid, "y_displacement", dimids[0], &deltayid, "m",
-	       "Northward displacement of fallstreak relative to cloud top");
-    add_vector(ncid, "horizontal_exponent", dimids[0], &slopeid, "1",
-	       "Exponent of power spectrum in the horizontal");
-    add_vector(ncid, "mean", dimids[0], &meanid, units,
-	       "Requested horizontal mean");
-    if (is_lognormal) {
-      add_vector(ncid, "standard_deviation", dimids[0], &stdid, "1",
-		 "Requested fractional standard deviation");
+  /* Define the file before the layers are processed, so that they
+     can be written as they are finished. Unless all the processes
+     write to the file together, rank 0 defines it and writes the
+     first layers, then the other processes add theirs in turn. */
+  defines_file = 1;
+#ifdef CG_ENABLE_MPI
+  defines_file = mpi_rank == 0 || storage.parallel;
+#endif
+  if (defines_file) {
+    /* Write a netcdf file */
+    chat("Writing %s in %s", name, output_filename);
+    if (storage.deflate_level) {
+      chat("Compressing %s with deflate level %d%s", name,
+	   storage.deflate_level, storage.shuffle ? " and shuffle" : "");
     }
-    else {
-      add_vector(ncid, "standard_deviation", dimids[0], &stdid, units,
-		 "Requested standard deviation");
+    if (storage.significant_digits) {
+      chat("Keeping %d significant digits", storage.significant_digits);
     }
-    if (u_wind && v_wind) {
-      add_vector(ncid, "u_wind", dimids[0], &uwindid, "m s-1",
-		 "Eastward wind");
-      add_vector(ncid, "v_wind", dimids[0], &vwindid, "m s-1",
-		 "Northward wind");
+#ifdef CG_ENABLE_MPI
+    if (storage.parallel) {
+      chat("Writing from all %d processes together", mpi_size);
+    }
+#endif
+    create_output(output_filename, &storage, &ncid);
+
+    /* Add dimensions and coordinate variables. */ 
+    add_dimension(ncid, storage.xtype, "x",
+		  field->nx, &xdimid, &xid, "Distance east");
+    add_dimension(ncid, storage.xtype, "y",
+		  field->ny, &ydimid, &yid, "Distance north");
+    add_dimension(ncid, storage.xtype, "z",
+		  field->nz, &zdimid, &zid, "Height");
+    dimids[0] = zdimid; dimids[1] = ydimid; dimids[2] = xdimid;
+
+    /* Add scalar variables. */
+    add_scalar_int(ncid, "seed", &seedid, "1",
+		   "Seed for random number generator");
+    add_scalar(ncid, storage.xtype, "outer_scale", &outerscaleid, "m",
+	       "Horizontal scale at which the power spectrum becomes flat");
+    add_scalar(ncid, storage.xtype, "vertical_exponent", &vertexponentid, "1",
+	       "Exponent of power spectrum in the vertical");
+  
+    if (n_interp) {
+      if (u_wind && v_wind && fall_speed) {
+	add_scalar(ncid, storage.xtype, "generating_level", &genlevelid, "m",
+		   "Height from which the fallstreaks originate");
+      }
+
+      /* Add height-dependent variables */
+      add_vector(ncid, storage.xtype, "x_displacement",
+		 dimids[0], &deltaxid, "m",
+		 "Eastward displacement of fallstreak relative to cloud top");
+      add_vector(ncid, storage.xtype, "y_displacement",
+		 dimids[0], &deltayid, "m",
+		 "Northward displacement of fallstreak relative to cloud top");
+      add_vector(ncid, storage.xtype, "horizontal_exponent",
+		 dimids[0], &slopeid, "1",
+		 "Exponent of power spectrum in the horizontal");
+      add_vector(ncid, storage.xtype, "mean", dimids[0], &meanid, units,
+		 "Requested horizontal mean");
+      if (is_lognormal) {
+	add_vector(ncid, storage.xtype, "standard_deviation",
+		   dimids[0], &stdid, "1",
+		   "Requested fractional standard deviation");
+      }
+      else {
+	add_vector(ncid, storage.xtype, "standard_deviation",
+		   dimids[0], &stdid, units,
+		   "Requested standard deviation");
+      }
+      if (u_wind && v_wind) {
+	add_vector(ncid, storage.xtype, "u_wind", dimids[0], &uwindid, "m s-1",
+		   "Eastward wind");
+	add_vector(ncid, storage.xtype, "v_wind", dimids[0], &vwindid, "m s-1",
+		   "Northward wind");
+      }
+      if (fall_speed) {
+	add_vector(ncid, storage.xtype, "fall_speed",
+		   dimids[0], &fallspeedid, "m s-1",
+		   "Cloud particle fall speed");
+      }
+
+      if (is_size) {
+	add_vector(ncid, storage.xtype, "size_mean",
+		   dimids[0], &size_meanid, size_units,
+		   "Requested horizontal mean of particle size");
+	add_vector(ncid, storage.xtype, "size_standard_deviation",
+		   dimids[0], &size_stdid, "1",
+		   "Requested fractional standard deviation of particle size");
+      }
     }
-    if (fall_speed) {
-      add_vector(ncid, "fall_speed", dimids[0], &fallspeedid, "m s-1",
-		 "Cloud particle fall speed");
+
+    /* Add the three-dimensional cloud field variable itself. */
+    nc_check(nc_def_var(ncid, name, storage.xtype, 3, dimids,
+			&fieldid));
+    define_storage(ncid, fieldid, field, &storage);
+    nc_check(nc_put_att_text(ncid, fieldid, "long_name",
+			     strlen(long_name), long_name));
+    nc_check(nc_put_att_text(ncid, fieldid, "units", strlen(units), units));
+    if (is_threshold) {
+      nc_check(NC_PUT_ATT_REAL(ncid, fieldid, "missing_value",
+				storage.xtype, 1, &missing_value));
+      nc_check(NC_PUT_ATT_REAL(ncid, fieldid, "_FillValue",
+				storage.xtype, 1, &missing_value));
     }
 
     if (is_size) {
-      add_vector(ncid, "size_mean", dimids[0], &size_meanid, size_units,
-		 "Requested horizontal mean of particle size");
-      add_vector(ncid, "size_standard_deviation", dimids[0], &size_stdid, "1",
-		 "Requested fractional standard deviation of particle size");
+      nc_check(nc_def_var(ncid, size_name, storage.xtype, 3, dimids,
+			  &sizeid));
+      define_storage(ncid, sizeid, field, &storage);
+      nc_check(nc_put_att_text(ncid, sizeid, "long_name",
+			     strlen(size_long_name), size_long_name));
+      nc_check(nc_put_att_text(ncid, sizeid, "units", strlen(size_units), size_units));
+      if (is_threshold) {
+	nc_check(NC_PUT_ATT_REAL(ncid, sizeid, "missing_value",
+				  storage.xtype, 1, &missing_value));
+	nc_check(NC_PUT_ATT_REAL(ncid, sizeid, "_FillValue",
+				  storage.xtype, 1, &missing_value));
+      }
     }
-  }
 
-  /* Add the three-dimensional cloud field variable itself. */
-  nc_check(nc_def_var(ncid, name, NC_REAL, 3, dimids, &fieldid));
-  nc_check(nc_put_att_text(ncid, fieldid, "long_name",
-			   strlen(long_name), long_name));
-  nc_check(nc_put_att_text(ncid, fieldid, "units", strlen(units), units));
-  if (is_threshold) {
-    nc_check(NC_PUT_ATT_REAL(ncid, fieldid, "missing_value",
-			      NC_REAL, 1, &missing_value));
-    nc_check(NC_PUT_ATT_REAL(ncid, fieldid, "_FillValue",
-			      NC_REAL, 1, &missing_value));
-  }
+    /* Global attributes. */
+    add_history(ncid, user, &storage);
+    nct_add_command_line(ncid, argc, argv);
 
-  if (is_size) {
-    nc_check(nc_def_var(ncid, size_name, NC_REAL, 3, dimids, &sizeid));
-    nc_check(nc_put_att_text(ncid, sizeid, "long_name",
-			   strlen(size_long_name), size_long_name));
-    nc_check(nc_put_att_text(ncid, sizeid, "units", strlen(size_units), size_units));
-    if (is_threshold) {
-      nc_check(NC_PUT_ATT_REAL(ncid, sizeid, "missing_value",
-				NC_REAL, 1, &missing_value));
-      nc_check(NC_PUT_ATT_REAL(ncid, sizeid, "_FillValue",
-				NC_REAL, 1, &missing_value));
+    if (title) {
+      nc_check(nc_put_att_text(ncid, NC_GLOBAL, "title",
+			       strlen(title), title));
+    }
+    nc_check(nc_put_att_text(ncid, NC_GLOBAL, "source",
+			     strlen(version), version));
+    if (institution) {
+      nc_check(nc_put_att_text(ncid, NC_GLOBAL, "institution",
+			       strlen(institution), institution));
+    }
+    if (references) {
+      nc_check(nc_put_att_text(ncid, NC_GLOBAL, "references",
+			       strlen(references), references));
+    }
+    if (comment) {
+      nc_check(nc_put_att_text(ncid, NC_GLOBAL, "comment",
+			       strlen(comment), comment));
+    }
+    if ((confstring = rc_sprint(config))) {
+      nc_check(nc_put_att_text(ncid, NC_GLOBAL, "config",
+			       strlen(confstring), confstring));
     }
-  }
 
-  /* Global attributes. */
-  nct_add_history(ncid, "Generated", user);
-  nct_add_command_line(ncid, argc, argv);
+    /* Leave define mode. */
+    nc_check(nc_enddef(ncid));
+#if defined(CG_ENABLE_MPI) && NC_HAS_PARALLEL4
+    if (storage.parallel) {
+      /* Each process writes its own layers of the 3D variables */
+      nc_check(nc_var_par_access(ncid, fieldid, NC_COLLECTIVE));
+      if (is_size) {
+	nc_check(nc_var_par_access(ncid, sizeid, NC_COLLECTIVE));
+      }
+    }
+#endif
 
-  if (title) {
-    nc_check(nc_put_att_text(ncid, NC_GLOBAL, "title",
-			     strlen(title), title));
-  }
-  nc_check(nc_put_att_text(ncid, NC_GLOBAL, "source",
-			   strlen(version), version));
-  if (institution) {
-    nc_check(nc_put_att_text(ncid, NC_GLOBAL, "institution",
-			     strlen(institution), institution));
-  }
-  if (references) {
-    nc_check(nc_put_att_text(ncid, NC_GLOBAL, "references",
-			     strlen(references), references));
-  }
-  if (comment) {
-    nc_check(nc_put_att_text(ncid, NC_GLOBAL, "comment",
-			     strlen(comment), comment));
-  }
-  if ((confstring = rc_sprint(config))) {
-    nc_check(nc_put_att_text(ncid, NC_GLOBAL, "config",
-			     strlen(confstring), confstring));
-  }
+    /* Assign the coordinate variables. */
+    NC_PUT_VAR_REAL(ncid, xid, field->x);
+    NC_PUT_VAR_REAL(ncid, yid, field->y);
+    NC_PUT_VAR_REAL(ncid, zid, field->z);
 
-  /* Leave define mode. */
-  nc_check(nc_enddef(ncid));
+    /* Assign the scalars. */
+    nc_put_var_int(ncid, seedid, &seed);
+    NC_PUT_VAR_REAL(ncid, outerscaleid, &outer_scale);
+    NC_PUT_VAR_REAL(ncid, vertexponentid, &vertical_exponent);
+    if (n_interp) {
+      if (u_wind && v_wind && fall_speed) {
+	NC_PUT_VAR_REAL(ncid, genlevelid, &generating_level);
+      }
 
-  /* Assign the coordinate variables. */
-  NC_PUT_VAR_REAL(ncid, xid, field->x);
-  NC_PUT_VAR_REAL(ncid, yid, field->y);
-  NC_PUT_VAR_REAL(ncid, zid, field->z);
+      /* Assign the vectors. */
+      NC_PUT_VAR_REAL(ncid, deltaxid, grid_x_displacement);
+      NC_PUT_VAR_REAL(ncid, deltayid, grid_y_displacement);
+      NC_PUT_VAR_REAL(ncid, slopeid, grid_horizontal_exponent);
 
-  /* Assign the scalars. */
-  nc_put_var_int(ncid, seedid, &seed);
-  NC_PUT_VAR_REAL(ncid, outerscaleid, &outer_scale);
-  NC_PUT_VAR_REAL(ncid, vertexponentid, &vertical_exponent);
-  if (n_interp) {
-    if (u_wind && v_wind && fall_speed) {
-      NC_PUT_VAR_REAL(ncid, genlevelid, &generating_level);
-    }
+      NC_PUT_VAR_REAL(ncid, meanid, grid_mean);
+      NC_PUT_VAR_REAL(ncid, stdid, grid_std);
+
+      if (is_size) {
+	NC_PUT_VAR_REAL(ncid, size_meanid, grid_size_mean);
+	NC_PUT_VAR_REAL(ncid, size_stdid, grid_size_std);
+      }
 
-    /* Assign the vectors. */
-    NC_PUT_VAR_REAL(ncid, deltaxid, grid_x_displacement);
-    NC_PUT_VAR_REAL(ncid, deltayid, grid_y_displacement);
-    NC_PUT_VAR_REAL(ncid, slopeid, grid_horizontal_exponent);
+      if (u_wind && v_wind) {
+	NC_PUT_VAR_REAL(ncid, uwindid, grid_u_wind);
+	NC_PUT_VAR_REAL(ncid, vwindid, grid_v_wind);
+      }
+      if (fall_speed) {
+	NC_PUT_VAR_REAL(ncid, fallspeedid, grid_fall_speed);
+      }
+    }
+  }
+#ifdef CG_ENABLE_ASYNC_OUTPUT
+  /* Collective writes are made by all the processes together, so
+     only from the main thread */
+  if (defines_file && async_output && !storage.parallel) {
+    int varids[2];
+    varids[0] = fieldid;
+    varids[1] = sizeid;
+    chat("Writing the layers as they are finished");
+    start_writer(&writer_data, ncid, varids, is_size ? 2 : 1,
+		 storage.xtype);
+    writer = &writer_data;
+    is_written = 1;
+  }
+#endif
 
-    NC_PUT_VAR_REAL(ncid, meanid, grid_mean);
-    NC_PUT_VAR_REAL(ncid, stdid, grid_std);
+  /* Process the layers, one window at a time if generating out of
+     core, only reporting progress for the first. */
+  was_verbose = verbose;
+  for (window = field, iwindow = 0; window;
+       window = next_window(stream, ++iwindow, skip_roundtrip,
+			    !is_written)) {
+    /* If interp_height is present then manipulate the individual layers. */
+    if (n_interp) {
+      if (!skip_roundtrip) {
+	chat("Transforming individual layers (2D Fourier transforms)");
+	cg_transform_layers(window);
+      }
+      /* Manipulate 2D phases to simulate displacement and a different
+	 power spectrum */
+      chat("Displacing layers horizontally");
+      cg_translate_layers(window, grid_x_displacement, grid_y_displacement);
+      if (rc_get_boolean(config, "anisotropic_mixing")) {
+	chat("Changing spectral slope of each layer anisotropically");
+	cg_anisotropic_change_slope_layers(window, 0, outer_scale,
+					   grid_horizontal_exponent,
+					   vertical_exponent,
+					   grid_x_displacement,
+					   grid_y_displacement);
+	if (is_size) {
+	  cg_anisotropic_change_slope_layers(window, 1, outer_scale,
+					     grid_horizontal_exponent,
+					     vertical_exponent,
+					     grid_x_displacement,
+					     grid_y_displacement);
+	}
+      }
+      else {
+	chat("Changing spectral slope of each layer");
+	cg_change_slope_layers(window, 0, outer_scale,
+			       grid_horizontal_exponent, vertical_exponent);
+	if (is_size) {
+	  cg_change_slope_layers(window, 1, outer_scale,
+				 grid_horizontal_exponent, vertical_exponent);
+	}
+      }
+      /* The variance of each layer is known from its spectrum, so
+	 the layers need not be read before being scaled */
+      if (layer_power) {
+	cg_layer_powers(window, 0, layer_power);
+      }
+      if (size_layer_power) {
+	cg_layer_powers(window, 1, size_layer_power);
+      }
+      chat("Reverting layers (inverse 2D Fourier transforms)");
+      cg_revert_layers(window);
 
-    if (is_size) {
-      NC_PUT_VAR_REAL(ncid, size_meanid, grid_size_mean);
-      NC_PUT_VAR_REAL(ncid, size_stdid, grid_size_std);
+      if (is_mean) {
+	if (is_lognormal) {
+	  chat("Converting to lognormal distribution");
+	}
+	else {
+	  chat("Scaling");
+	}
+      }
+    }
+  
+    /* Threshold the field. */
+    if (is_threshold) {
+      if (units[0] == '1' || units[1] == '\0') {
+	chat("Thresholding field at %g", threshold);
+      }
+      else {
+	chat("Thresholding field at %g %s", threshold, units);
+      }
     }
 
-    if (u_wind && v_wind) {
-      NC_PUT_VAR_REAL(ncid, uwindid, grid_u_wind);
-      NC_PUT_VAR_REAL(ncid, vwindid, grid_v_wind);
+    /* Scale and threshold the layers and pack them together for
+       output in one pass */
+#ifdef CG_ENABLE_ASYNC_OUTPUT
+    if (writer) {
+      finish_and_write(window, &output, writer);
+      if (stream) {
+	swap_window(writer, window);
+      }
     }
-    if (fall_speed) {
-      NC_PUT_VAR_REAL(ncid, fallspeedid, grid_fall_speed);
+    else {
+      cg_finish_join_layers(window, &output, 0, window->local_nz);
     }
+#else
+    cg_finish_join_layers(window, &output, 0, window->local_nz);
+#endif
+    verbose = 0;
   }
+  verbose = was_verbose;
+  free(layer_power);
+  free(size_layer_power);
 
-  /* Assign the cloud field - note that this has to be done row by row
-     because there are two dummy values in each. Should use
-     cg_squeeze() first and write out the whole lot in one go... */
-  count[2] = field->nx;
-  for (k = 0; k < field->nz; k++) {
-    start[0] = k;
-    for (j = 0; j < field->nx; j++) {
-      start[1] = j;
-      nc_check(NC_PUT_VARA_REAL(ncid, fieldid, start, count,
-		 field->field[0]+(field->nx+2)*(j + field->nx*k)));
+  /* Save any wisdom gathered while planning for the next run. */
+  if (wisdom_file) {
+#ifdef CG_ENABLE_MPI
+    if (cg_export_wisdom_mpi(wisdom_file, MPI_COMM_WORLD)) {
+#else
+    if (cg_export_wisdom(wisdom_file)) {
+#endif
+      chat("Saved FFTW wisdom to %s", wisdom_file);
+    }
+    else {
+      fprintf(stderr, "Warning: could not write FFTW wisdom to %s\n",
+	      wisdom_file);
     }
   }
-  if (is_size) {
-    for (k = 0; k < field->nz; k++) {
-      start[0] = k;
-      for (j = 0; j < field->nx; j++) {
-	start[1] = j;
-	nc_check(NC_PUT_VARA_REAL(ncid, sizeid, start, count,
-		   field->field[1]+(field->nx+2)*(j + field->nx*k)));
-      }
+
+#ifdef CG_ENABLE_MPI
+  if (!defines_file) {
+    append_layers(output_filename, name, size_name, field, is_size,
+		  storage.xtype);
+    MPI_Finalize();
+    return 0;
+  }
+#endif
+
+  /* Assign the cloud field, unless it has been written as it was
+     finished. */
+#ifdef CG_ENABLE_ASYNC_OUTPUT
+  if (writer) {
+    stop_writer(writer);
+  }
+#endif
+  for (iwindow = 0;
+       !is_written && (window = result_window(stream, field, iwindow));
+       iwindow++) {
+    write_layers(ncid, fieldid, window, 0, storage.xtype,
+		 storage.parallel);
+    if (is_size) {
+      write_layers(ncid, sizeid, window, 1, storage.xtype,
+		   storage.parallel);
     }
   }
 
   /* Close file */
   nc_check(nc_close(ncid));
 
+  /* Remove the scratch file */
+  cg_delete_stream(stream);
+
+#ifdef CG_ENABLE_MPI
+  if (mpi_size > 1 && !storage.parallel) {
+    int token = 0;
+    MPI_Send(&token, 1, MPI_INT, 1, 0, MPI_COMM_WORLD);
+  }
+  MPI_Finalize();
+#endif
+
   return 0;
 }
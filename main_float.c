@@ -0,0 +1,6 @@
+/* main_float.c -- The single-precision cloudgen program
+
+   In a build of both precisions, main.c is compiled a second time
+   through this file in single precision, and precision.c runs it
+   when asked. */
+#include "main.c"
@@ -9,6 +9,8 @@
 
 #include <netcdf.h>
 
+#include "nctools.h"
+
 #define MAX_STRING_LENGTH 512
 
 /* Prepend "string" to the attribute "attname" of the variable with ID
@@ -90,19 +92,14 @@ nct_append_attribute(int ncid, int varid, char *attname, char *string, char *sep
   }
 }
 
-/* Append information to the "history" global attribute of a NetCDF
- * dataset.  The information is of the form "$action at $time by $user
- * on $host", where action and user are given as arguments (a value of
- * NULL for user causes the username to be used), time is the current
- * time and host is the name of the machine. Histories are separated
- * by semicolons. */
-int
-nct_add_history(int ncid, char *action, char *user)
+/* Write the entry nct_add_history() would add into "history", which
+ * has room for "length" characters. */
+void
+nct_history_entry(char *history, int length, char *action, char *user)
 {
   struct timeval tv;
   char *name;
   char hostname[MAX_STRING_LENGTH] = "unknown";
-  char history[MAX_STRING_LENGTH] = "";
 
   if (gettimeofday(&tv, NULL)) {
     name = "";
@@ -123,9 +120,21 @@ nct_add_history(int ncid, char *action, char *user)
     }
   }
   
-  snprintf(history, MAX_STRING_LENGTH, "%s- %s by %s on %s", name, action, user, hostname);
-  history[MAX_STRING_LENGTH-1] = '\0';
+  snprintf(history, length, "%s- %s by %s on %s", name, action, user, hostname);
+  history[length-1] = '\0';
+}
 
+/* Append information to the "history" global attribute of a NetCDF
+ * dataset.  The information is of the form "$action at $time by $user
+ * on $host", where action and user are given as arguments (a value of
+ * NULL for user causes the username to be used), time is the current
+ * time and host is the name of the machine. Histories are separated
+ * by semicolons. */
+int
+nct_add_history(int ncid, char *action, char *user)
+{
+  char history[NCT_HISTORY_LENGTH];
+  nct_history_entry(history, NCT_HISTORY_LENGTH, action, user);
   return nct_append_attribute(ncid, NC_GLOBAL, "history", history, "\n");
 }
 
@@ -0,0 +1,39 @@
+/* precision.c -- Run cloudgen in the precision asked for
+
+   When the library is built in both precisions, main.c is compiled
+   once for each and the "precision" parameter, "single" or "double",
+   chooses which of them runs. Anything else is left for the double
+   precision version to report. */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "readconfig.h"
+
+int cloudgen_main_single(int argc, char **argv);
+int cloudgen_main_double(int argc, char **argv);
+
+int
+main(int argc, char **argv)
+{
+  int ifile = rc_get_file(argc, argv);
+  rc_data *config = rc_read(ifile ? argv[ifile] : NULL, stderr);
+  char *precision = NULL;
+  int single = 0;
+
+  if (!config) {
+    fprintf(stderr, "Error initializing configuration information\n");
+    exit(1);
+  }
+  rc_register_args(config, argc, argv);
+  if (rc_assign_string(config, "precision", &precision)) {
+    single = strcmp(precision, "single") == 0;
+    free(precision);
+  }
+  rc_clear(config);
+
+  if (single) {
+    return cloudgen_main_single(argc, argv);
+  }
+  return cloudgen_main_double(argc, argv);
+}
@@ -130,6 +130,78 @@ class Cloudgen:
     def z_offset(self, value: Union[float, str]) -> None:
         self._real_setter("z_offset", value)
 
+    @property
+    def threads(self) -> Optional[int]:
+        """Number of threads used by the Fourier transforms and loops"""
+        return self._int_getter("threads")
+
+    @threads.setter
+    def threads(self, value: Union[int, str]) -> None:
+        self._int_setter("threads", value)
+
+    @property
+    def planner_effort(self) -> str:
+        """FFTW planner effort (estimate, measure, patient, exhaustive)"""
+        return self._str_getter("planner_effort")
+
+    @planner_effort.setter
+    def planner_effort(self, value: str) -> None:
+        self._str_setter("planner_effort", value)
+
+    @property
+    def wisdom_file(self) -> str:
+        """Path to the FFTW wisdom cache"""
+        return self._str_getter("wisdom_file")
+
+    @wisdom_file.setter
+    def wisdom_file(self, value: str) -> None:
+        self._str_setter("wisdom_file", value)
+
+    @property
+    def memory_budget(self) -> Optional[float]:
+        """Memory (MiB) to generate the field within out of core"""
+        return self._real_getter("memory_budget")
+
+    @memory_budget.setter
+    def memory_budget(self, value: Union[float, str]) -> None:
+        self._real_setter("memory_budget", value)
+
+    @property
+    def scratch_file(self) -> str:
+        """Path to the scratch file used out of core"""
+        return self._str_getter("scratch_file")
+
+    @scratch_file.setter
+    def scratch_file(self, value: str) -> None:
+        self._str_setter("scratch_file", value)
+
+    @property
+    def simd(self) -> str:
+        """The instruction set of the vectorised kernels"""
+        return self._str_getter("simd")
+
+    @simd.setter
+    def simd(self, value: str) -> None:
+        self._str_setter("simd", value)
+
+    @property
+    def libm_exp(self) -> bool:
+        """Use the C library's exponential instead of the vectorised one"""
+        return self._bool_getter("libm_exp")
+
+    @libm_exp.setter
+    def libm_exp(self, value: Union[bool, str]) -> None:
+        self._bool_setter("libm_exp", value)
+
+    @property
+    def skip_layer_roundtrip(self) -> bool:
+        """Skip the 2D transforms out of and back into Fourier space"""
+        return self._bool_getter("skip_layer_roundtrip")
+
+    @skip_layer_roundtrip.setter
+    def skip_layer_roundtrip(self, value: Union[bool, str]) -> None:
+        self._bool_setter("skip_layer_roundtrip", value)
+
     @property
     def seed(self) -> Optional[int]:
         """The random seed for the number generator"""
@@ -148,6 +220,15 @@ class Cloudgen:
     def system_random_file(self, value: str) -> None:
         self._str_setter("system_random_file", value)
 
+    @property
+    def counter_phases(self) -> bool:
+        """Draw the phases from the counter-based generator"""
+        return self._bool_getter("counter_phases")
+
+    @counter_phases.setter
+    def counter_phases(self, value: Union[bool, str]) -> None:
+        self._bool_setter("counter_phases", value)
+
     @property
     def vertical_exponent(self) -> Optional[float]:
         """The vertical direction power spectrum exponent"""
@@ -166,6 +247,24 @@ class Cloudgen:
     def outer_scale(self, value: Union[float, str]) -> None:
         self._real_setter("outer_scale", value)
 
+    @property
+    def spectrum_wavenumber(self) -> Sequence[float]:
+        """The wavenumbers of a tabulated spectrum (m⁻¹)"""
+        return self._real_array_getter("spectrum_wavenumber")
+
+    @spectrum_wavenumber.setter
+    def spectrum_wavenumber(self, value: Union[Sequence[float], str]) -> None:
+        self._real_array_setter("spectrum_wavenumber", value)
+
+    @property
+    def spectrum_energy(self) -> Sequence[float]:
+        """The spectral energy density of a tabulated spectrum"""
+        return self._real_array_getter("spectrum_energy")
+
+    @spectrum_energy.setter
+    def spectrum_energy(self, value: Union[Sequence[float], str]) -> None:
+        self._real_array_setter("spectrum_energy", value)
+
     @property
     def interp_height(self) -> Sequence[float]:
         """The heights for interpolated values"""
@@ -301,6 +400,15 @@ class Cloudgen:
     def missing_value(self, value: Union[float, str]) -> None:
         self._real_setter("missing_value", value)
 
+    @property
+    def precision(self) -> str:
+        """The precision the field is generated in"""
+        return self._str_getter("precision")
+
+    @precision.setter
+    def precision(self, value: str) -> None:
+        self._str_setter("precision", value)
+
     @property
     def output_filename(self) -> str:
         """Path to the output file"""
@@ -310,6 +418,78 @@ class Cloudgen:
     def output_filename(self, value: str) -> None:
         self._str_setter("output_filename", value)
 
+    @property
+    def output_format(self) -> str:
+        """The NetCDF format of the output file"""
+        return self._str_getter("output_format")
+
+    @output_format.setter
+    def output_format(self, value: str) -> None:
+        self._str_setter("output_format", value)
+
+    @property
+    def output_precision(self) -> str:
+        """The precision of the values in the output file"""
+        return self._str_getter("output_precision")
+
+    @output_precision.setter
+    def output_precision(self, value: str) -> None:
+        self._str_setter("output_precision", value)
+
+    @property
+    def chunk_sizes(self) -> Sequence[int]:
+        """The chunk shape in z, y and x of a NetCDF-4 output file"""
+        return self._int_array_getter("chunk_sizes")
+
+    @chunk_sizes.setter
+    def chunk_sizes(self, value: Union[str, Sequence[int]]) -> None:
+        self._int_array_setter("chunk_sizes", value)
+
+    @property
+    def deflate_level(self) -> Optional[int]:
+        """The zlib compression level of a NetCDF-4 output file"""
+        return self._int_getter("deflate_level")
+
+    @deflate_level.setter
+    def deflate_level(self, value: Union[int, str]) -> None:
+        self._int_setter("deflate_level", value)
+
+    @property
+    def shuffle(self) -> bool:
+        """Shuffle the bytes of the output before compressing them"""
+        return self._bool_getter("shuffle")
+
+    @shuffle.setter
+    def shuffle(self, value: Union[bool, str]) -> None:
+        self._bool_setter("shuffle", value)
+
+    @property
+    def significant_digits(self) -> Optional[int]:
+        """The decimal digits kept in a NetCDF-4 output file"""
+        return self._int_getter("significant_digits")
+
+    @significant_digits.setter
+    def significant_digits(self, value: Union[int, str]) -> None:
+        self._int_setter("significant_digits", value)
+
+    @property
+    def parallel_io(self) -> bool:
+        """Write the output from all the MPI processes together"""
+        return self._bool_getter("parallel_io")
+
+    @parallel_io.setter
+    def parallel_io(self, value: Union[bool, str]) -> None:
+        self._bool_setter("parallel_io", value)
+
+    @property
+    def async_output(self) -> bool:
+        """Write the layers from another thread as they are finished"""
+        return self._bool_getter("async_output")
+
+    @async_output.setter
+    def async_output(self, value: Union[bool, str]) -> None:
+        self._bool_setter("async_output", value)
+
     @property
     def variable_name(self) -> str:
         """Primary output variable name in the output file"""
@@ -465,6 +645,30 @@ class Cloudgen:
         else:
             self.rc_data[param] = _value
 
+    def _int_array_getter(self, param: str) -> Sequence[int]:
+        """Extract an array of integers"""
+        return [int(_) for _ in self.rc_data.get(param, "").split()]
+
+    def _int_array_setter(self,
+                          param: str,
+                          value: Union[str, Sequence[int]]
+                          ) -> None:
+        """Set an array of integers"""
+        try:
+            if isinstance(value, str):
+                _ = [int(_) for _ in value.split()]
+                _value = value
+            else:
+                _ = [int(_) for _ in value]
+                _value = " ".join([str(_) for _ in value])
+
+        except ValueError:
+            raise ValueError(
+                f"Could not convert {value} to rc_data integer array"
+            )
+        else:
+            self.rc_data[param] = _value
+
     @property
     def updated(self) -> bool:
         """Have any updates been made to the inputs"""
@@ -4,7 +4,8 @@
 #include <math.h>
 #include "random.h"
 
-static FILE *dev_random = NULL;
+/* The state used by the functions without a state argument */
+static random_state default_state;
 
 /* This is essentially the "ran2" function from "Numerical Recipies"
    (Press et al. 1988). It has been split into two functions, one to
@@ -14,42 +15,75 @@ static FILE *dev_random = NULL;
 #define IA 1366
 #define IC 150889
 
-static long iy, ir[98];
-static int iff = 0;
-static long idum;
-
 void
-seed_random_number_generator(long seed)
+seed_random_state(random_state *state, long seed)
 {
   int j;
-  iff = 1;
+  state->iff = 1;
   if ((seed=(IC-seed) % M) < 0)
     seed = -seed;
   for (j = 1; j <= 97; j++) {
     seed = (IA*seed+IC) % M;
-    ir[j] = seed;
+    state->ir[j] = seed;
+  }
+  state->iy = (IA*seed+IC) % M;
+  state->idum = seed;
+}
+
+void
+seed_random_number_generator(long seed)
+{
+  seed_random_state(&default_state, seed);
+}
+
+random_state *
+new_random_state(long seed)
+{
+  random_state *state = calloc(1, sizeof(random_state));
+  if (state) {
+    seed_random_state(state, seed);
   }
-  iy = (IA*seed+IC) % M;
-  idum = seed;
+  return state;
+}
+
+void
+delete_random_state(random_state *state)
+{
+  if (state && state != &default_state) {
+    free(state);
+  }
+}
+
+random_state *
+default_random_state(void)
+{
+  return &default_state;
 }
 
 static
 float
-nr_uniform_deviate(void)
+state_nr_uniform_deviate(random_state *state)
 {
   int j;
-  if (iff == 0) {
-    seed_random_number_generator(-1);
+  if (state->iff == 0) {
+    seed_random_state(state, -1);
   }
-  j = 1 + 97.0*iy/M;
+  j = 1 + 97.0*state->iy/M;
   if (j > 97 || j < 1) {
     fprintf(stderr, "Error in random number generator\n");
     exit(1);
   }
-  iy = ir[j];
-  idum = (IA*idum+IC) % M;
-  ir[j] = idum;
-  return (float) iy/M;
+  state->iy = state->ir[j];
+  state->idum = (IA*state->idum+IC) % M;
+  state->ir[j] = state->idum;
+  return (float) state->iy/M;
+}
+
+static
+float
+nr_uniform_deviate(void)
+{
+  return state_nr_uniform_deviate(&default_state);
 }
 
 /* By default we use the nr_uniform_deviate function */
@@ -64,19 +98,26 @@ float (*uniform_deviate) (void) = *nr_uniform_deviate;
 
 static
 float
-kernel_uniform_deviate(void)
+state_kernel_uniform_deviate(random_state *state)
 {
   unsigned short value;
-  fread(&value, 2, 1, dev_random);
+  fread(&value, 2, 1, state->dev_random);
   return ((float) value)/65536.0;
 }
 
+static
+float
+kernel_uniform_deviate(void)
+{
+  return state_kernel_uniform_deviate(&default_state);
+}
+
 int
 kernel_int_seed(void)
 {
   int value;
-  if (dev_random) {
-    fread(&value, sizeof(int), 1, dev_random);
+  if (default_state.dev_random) {
+    fread(&value, sizeof(int), 1, default_state.dev_random);
     return value;
   }
   else {
@@ -87,50 +128,114 @@ kernel_int_seed(void)
 FILE *
 open_kernel_random_file(char *file_name)
 {
-  dev_random = fopen(file_name, "r");
-  if (dev_random) {
+  default_state.dev_random = fopen(file_name, "r");
+  if (default_state.dev_random) {
     uniform_deviate = kernel_uniform_deviate;
   }
-  return dev_random;
+  return default_state.dev_random;
 }
 
 void
 close_kernel_random_file(void)
 {
-  if (dev_random) {
-    fclose(dev_random);
+  if (default_state.dev_random) {
+    fclose(default_state.dev_random);
+    default_state.dev_random = NULL;
   }
   uniform_deviate = nr_uniform_deviate;
 }
 
+float
+random_uniform_deviate(random_state *state)
+{
+  if (state == &default_state) {
+    /* uniform_deviate may have been replaced */
+    return uniform_deviate();
+  }
+  else if (state->dev_random) {
+    return state_kernel_uniform_deviate(state);
+  }
+  return state_nr_uniform_deviate(state);
+}
+
 /* Calculate Gaussian deviates from uniform deviates - this is the
    "gasdev" function from Numerical Recipies */
 float
-gaussian_deviate(void)
+random_gaussian_deviate(random_state *state)
 {
-  static int iset = 0;
-  static float gset;
   float fac, r, v1, v2;
 
-  if (iset == 0) {
+  if (state->iset == 0) {
     do {
-      v1 = 2.0 * uniform_deviate() - 1.0;
-      v2 = 2.0 * uniform_deviate() - 1.0;
+      v1 = 2.0 * random_uniform_deviate(state) - 1.0;
+      v2 = 2.0 * random_uniform_deviate(state) - 1.0;
       r = v1*v1 + v2*v2;
     }
     while (r >= 1.0 || r == 0.0);
 
     fac = sqrt(-2.0*log(r)/r);
-    gset = v1*fac;
-    iset = 1;
+    state->gset = v1*fac;
+    state->iset = 1;
     return v2*fac;
   }
   else {
-    iset = 0;
-    return gset;
+    state->iset = 0;
+    return state->gset;
   }
 }
 
+float
+gaussian_deviate(void)
+{
+  return random_gaussian_deviate(&default_state);
+}
+
+/* As random_gaussian_deviate(), a pair at a time, but drawing the
+   uniform deviates from "ran2" directly */
+static
+void
+nr_gaussian_pair(random_state *state, float *first, float *second)
+{
+  float fac, r, v1, v2;
+
+  do {
+    v1 = 2.0 * state_nr_uniform_deviate(state) - 1.0;
+    v2 = 2.0 * state_nr_uniform_deviate(state) - 1.0;
+    r = v1*v1 + v2*v2;
+  }
+  while (r >= 1.0 || r == 0.0);
+
+  fac = sqrt(-2.0*log(r)/r);
+  *first = v2*fac;
+  *second = v1*fac;
+}
+
+void
+random_gaussian_deviates(random_state *state, long int n, float *target)
+{
+  long int i = 0;
+  if (n > 0 && state->iset) {
+    target[i++] = random_gaussian_deviate(state);
+  }
+  if (state == &default_state ? uniform_deviate == nr_uniform_deviate
+      : state->dev_random == NULL) {
+    for (; i + 1 < n; i += 2) {
+      nr_gaussian_pair(state, target + i, target + i + 1);
+    }
+  }
+  for (; i < n; i++) {
+    target[i] = random_gaussian_deviate(state);
+  }
+}
+
+void
+select_counter_generator(random_state *state, int use_counter,
+			 unsigned int seed)
+{
+  state->counter = use_counter;
+  state->counter_seed = seed;
+}
+
 /* A function for generating 32 random bits */
 unsigned int
 bitfield32_deviate(void)
@@ -164,3 +269,43 @@ seeded_uniform_deviates(int n, float *target, unsigned int seed)
   }
   return seed;
 }
+
+/* Counter-based generator: Philox-2x32 with 10 rounds (Salmon et al.
+   2011, "Parallel random numbers: as easy as 1, 2, 3") */
+#define PHILOX_M 0xD256D353U
+#define PHILOX_W 0x9E3779B9U
+#define PHILOX_ROUNDS 10
+
+unsigned int
+counter_key(unsigned int seed, unsigned int stream)
+{
+  unsigned char octets[8];
+  int i;
+  for (i = 0; i < 4; ++i) {
+    octets[i] = (seed >> (8*i)) & 0xFF;
+    octets[i+4] = (stream >> (8*i)) & 0xFF;
+  }
+  return hash_32(8, octets, FNV_32_INIT);
+}
+
+void
+counter_random_bits(unsigned int key, unsigned long long int counter,
+		    long int n, unsigned int *first, unsigned int *second)
+{
+  long int i;
+  int j;
+  for (i = 0; i < n; ++i) {
+    unsigned int x0 = (unsigned int) (counter + i);
+    unsigned int x1 = (unsigned int) ((counter + i) >> 32);
+    unsigned int k = key;
+    for (j = 0; j < PHILOX_ROUNDS; ++j) {
+      unsigned long long int product
+	= (unsigned long long int) PHILOX_M * x0;
+      x0 = ((unsigned int) (product >> 32)) ^ k ^ x1;
+      x1 = (unsigned int) product;
+      k += PHILOX_W;
+    }
+    first[i] = x0;
+    second[i] = x1;
+  }
+}
@@ -1,7 +1,52 @@
 /* random.c -- Random number generator 
    Copyright (C) 2003 Robin Hogan <r.j.hogan@reading.ac.uk> */
+#ifndef RANDOM_H
+#define RANDOM_H
+
 #include <stdio.h>
 
+/* The state of a generator. The functions without a state argument
+   share one default state for the whole process; a separate state for
+   each thread lets them draw random numbers at the same time. */
+typedef struct random_state {
+  long iy, ir[98];      /* "ran2" shuffle table */
+  long idum;
+  int iff;              /* 1 once seeded */
+  int iset;             /* 1 if gset holds the second of a pair */
+  float gset;           /* The second Gaussian deviate of a pair */
+  FILE *dev_random;     /* Source of random bits, if not NULL */
+  int counter;          /* 1 to draw phases from the counter-based
+			   generator below */
+  unsigned int counter_seed; /* Its seed */
+} random_state;
+
+/* Return a new state seeded with seed, or NULL if out of memory */
+random_state *new_random_state(long seed);
+
+/* Free a state from new_random_state() */
+void delete_random_state(random_state *state);
+
+/* Return the default state used by the functions without a state
+   argument */
+random_state *default_random_state(void);
+
+/* Seed the pseudo-random number generator of state */
+void seed_random_state(random_state *state, long seed);
+
+/* As uniform_deviate() and gaussian_deviate(), but for state */
+float random_uniform_deviate(random_state *state);
+float random_gaussian_deviate(random_state *state);
+
+/* Fill target with the next n Gaussian deviates of state, the same
+   as n calls to random_gaussian_deviate() but faster */
+void random_gaussian_deviates(random_state *state, long int n,
+			      float *target);
+
+/* Draw phases from the counter-based generator with seed if
+   use_counter is non-zero, or from the sequence of state otherwise */
+void select_counter_generator(random_state *state, int use_counter,
+			      unsigned int seed);
+
 /* Seed the pseudo-random number generator */
 void seed_random_number_generator(long seed);
 
@@ -54,3 +99,22 @@ unsigned int hash_32(int n, unsigned char *sequence, unsigned int init);
    hash_32(), returning the new seed for further calls */
 unsigned int seeded_uniform_deviates(int n, float *target, unsigned int seed);
 
+
+/* Counter-based generator: every pair of random words is a pure
+   function of a key and its position in the sequence, so any subset
+   of them can be drawn independently, in any order and by any thread
+   or process. The Philox-2x32-10 generator of Salmon et al. (2011) is
+   used, its key derived from the seed and stream with hash_32(). */
+
+/* Return the key of the counter-based generator for stream number
+   stream of seed */
+unsigned int counter_key(unsigned int seed, unsigned int stream);
+
+/* Fill first and second with the n pairs of 32 random bits starting
+   at pair number counter of the generator keyed by key. The Gaussian
+   deviates are made from them by cg_gaussian_values(). */
+void counter_random_bits(unsigned int key, unsigned long long int counter,
+			 long int n, unsigned int *first,
+			 unsigned int *second);
+
+#endif
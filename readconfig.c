@@ -103,12 +103,16 @@ rc_read(char *file_name, FILE *err_file)
     fprintf(err_file, "Error parsing %s\n", file_name);
     if (parsed_data != NULL) {
       free(parsed_data);
+      parsed_data = NULL;
       return NULL;
     }
   }
 
   fclose(file);
+  /* The list now belongs to the caller, so a later rc_read() must not
+     clear it */
   data = parsed_data;
+  parsed_data = NULL;
   return data;
 }
 
@@ -577,43 +581,210 @@ rc_get_real_array(rc_data *data, char *param, int *length)
   }
 }
 
-/* Generate the base field */
-cg_field *
-rc_generate_base_field(rc_data * config) {
-  /* Determine if we are using an effective size parameter */
-  char is_size = 0;
-  is_size = rc_get_boolean(config, "size_variable_name");
+/* Interpret the value associated with param as a planner effort
+   ("estimate", "measure", "patient" or "exhaustive") and store it in
+   effort, which is CG_PLAN_ESTIMATE if param is absent. Returns 0,
+   after reporting an error, if the value is not recognised, or 1
+   otherwise. */
+static
+int
+rc_get_planner_effort(rc_data *data, char *param, cg_planner_effort *effort)
+{
+  static const char *names[] = {"estimate", "measure", "patient",
+                                "exhaustive"};
+  int status = 1;
+  char *value = rc_get_string(data, param);
+  *effort = CG_PLAN_ESTIMATE;
+  if (value) {
+    int i;
+    status = 0;
+    for (i = 0; i < 4; i++) {
+      if (strcasecmp(value, names[i]) == 0) {
+        *effort = (cg_planner_effort) i;
+        status = 1;
+      }
+    }
+    if (!status) {
+      fprintf(stderr, "Error: %s must be \"estimate\", \"measure\", "
+              "\"patient\" or \"exhaustive\", not \"%s\"\n", param, value);
+    }
+    rc_free(value);
+  }
+  return status;
+}
+
+/* The domain of the field as described by a configuration */
+typedef struct {
+  int nvars;
+  int x_pixels, z_pixels;
+  real dx, dz;
+  real x_offset, y_offset, z_offset;
+  int threads;
+  cg_planner_effort effort;
+  char verbose;
+} rc_domain;
+
+/* Find the shape of the field described by config */
+void
+rc_get_shape(rc_data * config, int * nx, int * ny, int * nz, int * nvars) {
+  int x_pixels = 128;
+  int z_pixels = 32;
+
+  rc_assign_int(config, "x_pixels", &x_pixels);
+  rc_assign_int(config, "z_pixels", &z_pixels);
+  /* ny=nx, and there is a second variable if an effective size
+     parameter is used */
+  *nx = x_pixels;
+  *ny = x_pixels;
+  *nz = z_pixels;
+  *nvars = rc_get_boolean(config, "size_variable_name") + 1;
+}
 
+/* Read the domain parameters from config into domain, reporting the
+   size of the field if verbose. Returns 0 if a parameter is invalid,
+   or 1 otherwise. */
+static
+int
+rc_get_domain(rc_data * config, rc_domain * domain) {
   /* Create the base field */
   real x_domain_size = 200000;
   real z_domain_size = 2000;
-  int x_pixels = 128;
-  int z_pixels = 32;
+  int x_pixels, y_pixels, z_pixels, nvars;
   real x_offset = 0.0;
   real y_offset = 0.0;
   real z_offset = 0.0;
+  int threads = 1;
+  cg_planner_effort effort;
+
+  if (!rc_get_planner_effort(config, "planner_effort", &effort)) {
+    return 0;
+  }
 
   rc_assign_real(config, "x_domain_size", &x_domain_size);
   rc_assign_real(config, "z_domain_size", &z_domain_size);
-  rc_assign_int(config, "x_pixels", &x_pixels);
-  rc_assign_int(config, "z_pixels", &z_pixels);
+  rc_get_shape(config, &x_pixels, &y_pixels, &z_pixels, &nvars);
   rc_assign_real(config, "x_offset", &x_offset);
   rc_assign_real(config, "y_offset", &y_offset);
   rc_assign_real(config, "z_offset", &z_offset);
+  rc_assign_int(config, "threads", &threads);
+#ifdef CG_ENABLE_MPI
+  /* Threads may only be used if the MPI library allows them */
+  int mpi_thread_initialized = 0;
+  int mpi_thread_level = MPI_THREAD_FUNNELED;
+  int mpi_thread_rank = 0;
+  MPI_Initialized(&mpi_thread_initialized);
+  if (mpi_thread_initialized) {
+    MPI_Query_thread(&mpi_thread_level);
+    MPI_Comm_rank(MPI_COMM_WORLD, &mpi_thread_rank);
+  }
+  if (threads > 1 && mpi_thread_level < MPI_THREAD_FUNNELED) {
+    if (mpi_thread_rank == 0) {
+      fprintf(stderr, "Warning: the MPI library does not support threads, so only one thread is used\n");
+    }
+    threads = 1;
+  }
+#endif
 
   /* Set the domain parameters - note that ny=nx and dy=dx. */
-  real dx = x_domain_size/x_pixels;
-  real dz = z_domain_size/z_pixels;
+  domain->nvars = nvars;
+  domain->x_pixels = x_pixels;
+  domain->z_pixels = z_pixels;
+  domain->dx = x_domain_size/x_pixels;
+  domain->dz = z_domain_size/z_pixels;
+  domain->x_offset = x_offset;
+  domain->y_offset = y_offset;
+  domain->z_offset = z_offset;
+  domain->threads = threads;
+  domain->effort = effort;
 
   /* Create cloud field structure */
   char verbose = 0;
   verbose = rc_get_boolean(config, "verbose");
+#ifdef CG_ENABLE_MPI
+  /* Only the first MPI process reports progress */
+  int mpi_initialized = 0;
+  int mpi_rank = 0;
+  MPI_Initialized(&mpi_initialized);
+  if (mpi_initialized) {
+    MPI_Comm_rank(MPI_COMM_WORLD, &mpi_rank);
+  }
+  if (mpi_rank > 0) {
+    verbose = 0;
+  }
+#endif
+  domain->verbose = verbose;
   if (verbose != 0) {
     fprintf(stderr, "Creating new field measureing %dx%dx%d pixels\n",
             x_pixels, x_pixels, z_pixels);
+    if (threads > 1) {
+      fprintf(stderr, "Planning Fourier transforms for %d threads\n",
+              threads);
+    }
   }
-  cg_field * field = cg_new_multi_field(x_pixels, x_pixels, z_pixels,
-                                        dx, dx, dz, x_offset, y_offset,
-                                        z_offset, is_size + 1);
+  return 1;
+}
+
+/* Generate the base field */
+cg_field *
+rc_generate_base_field(rc_data * config) {
+  rc_domain d;
+  if (!rc_get_domain(config, &d)) {
+    return NULL;
+  }
+#ifdef CG_ENABLE_MPI
+  /* When run with more than one MPI process, split the layers of the
+     field between them */
+  int mpi_initialized = 0;
+  int mpi_size = 1;
+  MPI_Initialized(&mpi_initialized);
+  if (mpi_initialized) {
+    MPI_Comm_size(MPI_COMM_WORLD, &mpi_size);
+  }
+  if (mpi_size > 1) {
+    if (d.verbose != 0) {
+      fprintf(stderr, "Distributing field across %d processes\n", mpi_size);
+    }
+    return cg_new_distributed_field(d.x_pixels, d.x_pixels, d.z_pixels,
+                                    d.dx, d.dx, d.dz, d.x_offset, d.y_offset,
+                                    d.z_offset, d.nvars, d.threads,
+                                    d.effort, MPI_COMM_WORLD);
+  }
+#endif
+  cg_field * field = cg_new_planned_field(d.x_pixels, d.x_pixels, d.z_pixels,
+                                          d.dx, d.dx, d.dz, d.x_offset,
+                                          d.y_offset, d.z_offset, d.nvars,
+                                          d.threads, d.effort);
   return field;
 }
+
+/* Generate an out-of-core field if a memory budget is given */
+cg_stream *
+rc_generate_stream(rc_data * config) {
+  real memory_budget = 0.0;
+  char *scratch_file = NULL;
+  cg_stream *stream;
+  rc_domain d;
+
+  if (!rc_assign_real(config, "memory_budget", &memory_budget)) {
+    return NULL;
+  }
+  if (!rc_get_domain(config, &d)) {
+    return NULL;
+  }
+  rc_assign_string(config, "scratch_file", &scratch_file);
+  if (d.verbose != 0) {
+    fprintf(stderr, "Generating field out of core within %g MiB\n",
+            memory_budget);
+  }
+  stream = cg_new_stream(d.x_pixels, d.x_pixels, d.z_pixels,
+                         d.dx, d.dx, d.dz, d.x_offset, d.y_offset,
+                         d.z_offset, d.nvars, d.threads, d.effort,
+                         (size_t) (memory_budget * 1024 * 1024),
+                         scratch_file);
+  rc_free(scratch_file);
+  if (!stream) {
+    fprintf(stderr, "Error: cannot generate field out of core within "
+            "%g MiB\n", memory_budget);
+  }
+  return stream;
+}
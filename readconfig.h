@@ -128,10 +128,23 @@ int rc_assign_real_array(rc_data *data, char *param,
 int rc_assign_real_array_default(rc_data *data, char *param,
 	  real **value, int min_length, real default_value);
 
+/* Find the number of pixels in each direction and the number of
+   variables of the field described by a configuration, without
+   creating it. */
+void rc_get_shape(rc_data * data, int * nx, int * ny, int * nz,
+                  int * nvars);
+
 /* Generate a base field from a configuration data. If an error occurs,
    the field is freed and NULL is returned. */
 cg_field * rc_generate_base_field(rc_data * data);
 
+/* Generate a field to be processed out of core if "memory_budget"
+   (MiB) is given in the configuration, with its scratch file at
+   "scratch_file" if given. Returns NULL if there is no memory budget
+   or the stream cannot be created, printing a message in the latter
+   case. */
+cg_stream * rc_generate_stream(rc_data * data);
+
 #ifdef __cplusplus
 }
 #endif
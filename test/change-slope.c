@@ -0,0 +1,72 @@
+// Copyright 2022 Keith F. Prussing
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "cloudgen.h"  // NOLINT(build/include_subdir)
+
+/* Check that the slope changes from the table of log wavenumbers
+   match (kk/kk_outer)^power evaluated for every Fourier component,
+   isotropically and along the direction of the displacement, and
+   that the table kept in the field is refilled for a new outer
+   scale. */
+int main(void) {
+  int success = EXIT_SUCCESS;
+  int i, j, k, pass, nx = 16, ny = 12, nz = 4;
+  real new_slope[4] = {-2.0, -1.5, -1.0, -3.0};
+  real deltax[4] = {0.0, 100.0, 100.0, -50.0};
+  real deltay[4] = {0.0, 50.0, 50.0, 200.0};
+  real old_slope = -5.0 / 3.0;
+
+  cg_field * field = cg_new_field(nx, ny, nz, 100.0, 100.0, 50.0,
+                                  0.0, 0.0, 0.0);
+  if (field == NULL) {
+    fprintf(stderr, "Error creating the field\n");
+    return EXIT_FAILURE;
+  }
+
+  for (pass = 0; pass < 3; pass++) {
+    int anisotropic = pass == 1;
+    real outer_scale = pass == 2 ? 200.0 : 400.0;
+    real kk_outer = 1 / (outer_scale * outer_scale);
+    cg_unity_phase(field, 0);
+    if (anisotropic) {
+      cg_anisotropic_change_slope_layers(field, 0, outer_scale, new_slope,
+                                         old_slope, deltax, deltay);
+    } else {
+      cg_change_slope_layers(field, 0, outer_scale, new_slope, old_slope);
+    }
+    for (k = 0; k < nz; k++) {
+      real theta = (deltax[k] != 0.0 || deltay[k] != 0.0)
+          ? atan2(deltax[k], deltay[k]) : 0.0;
+      for (j = 0; j < ny; j++) {
+        for (i = 0; i < nx / 2 + 1; i++) {
+          real kk, expected;
+          if (anisotropic) {
+            real k_theta = field->kx[i] * sin(theta)
+                + field->ky[j] * cos(theta);
+            kk = k_theta * k_theta;
+          } else {
+            kk = field->kx[i] * field->kx[i] + field->ky[j] * field->ky[j];
+          }
+          expected = kk > kk_outer
+              ? pow(kk / kk_outer, 0.25 * (new_slope[k] - old_slope)) : 1.0;
+          if (i + j + k == 0) {
+            /* cg_unity_phase() leaves the mean at zero */
+            expected = 0.0;
+          }
+          complex value = field->p[0][i + (nx / 2 + 1) * (j + ny * k)];
+          if (fabs(creal(value) - expected) > 1.0e-5 * expected
+              || cimag(value) != 0.0) {
+            fprintf(stderr, "Scaling at (%d,%d,%d) is %g, expected %g\n",
+                    i, j, k, (double) creal(value), (double) expected);
+            success = EXIT_FAILURE;
+          }
+        }
+      }
+    }
+  }
+
+  cg_delete_field(field);
+  return success;
+}
@@ -0,0 +1,109 @@
+// Copyright 2022 Keith F. Prussing
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "cloudgen.h"  // NOLINT(build/include_subdir)
+#include "random.h"  // NOLINT(build/include_subdir)
+
+#define NJOBS 6
+
+typedef struct {
+  int nx, ny, nz;
+  long seed;
+  int counter;
+  random_state * state;
+  cg_field * field;
+} job;
+
+/* Generate the fractal of a job, drawing the random phases from state
+   or, if it is NULL, from the default generator, which is then left
+   sequential */
+static cg_field * generate(job * work, random_state * state) {
+  cg_field * field = cg_new_field(work->nx, work->ny, work->nz,
+                                  100.0, 100.0, 50.0, 0.0, 0.0, 0.0);
+  cg_spectrum * law = field ? cg_new_power_law_spectrum(field, 1000.0,
+                                                        -2.0, 0.0) : NULL;
+  if (field == NULL || law == NULL) {
+    cg_delete_field(field);
+    return NULL;
+  }
+  cg_set_random_state(field, state);
+  cg_select_field_counter_phases(field, work->counter, work->seed);
+  cg_random_spectrum(field, 0, law);
+  cg_generate_fractal(field);
+  cg_delete_spectrum(law);
+  if (state == NULL) {
+    cg_select_counter_phases(0, 0);
+  }
+  return field;
+}
+
+static void * run(void * arg) {
+  job * work = arg;
+  work->field = generate(work, work->state);
+  return NULL;
+}
+
+/* Check that fields generated at the same time from different
+   threads, each with its own sequential or counter-based generator,
+   are those generated one at a time from the default generator with
+   the same seeds, and that choosing the generator of a field with its
+   own leaves the default one alone. */
+int main(void) {
+  int success = EXIT_SUCCESS;
+  pthread_t threads[NJOBS];
+  job jobs[NJOBS];
+  int i, n;
+
+  for (i = 0; i < NJOBS; i++) {
+    /* Fields of two shapes, so plans are both created and shared */
+    jobs[i].nx = i % 2 ? 16 : 12;
+    jobs[i].ny = i % 2 ? 12 : 10;
+    jobs[i].nz = i % 2 ? 8 : 6;
+    jobs[i].seed = i + 1;
+    jobs[i].counter = i % 3 == 0;
+    jobs[i].state = new_random_state(jobs[i].seed);
+    jobs[i].field = NULL;
+    if (jobs[i].state == NULL
+        || pthread_create(&threads[i], NULL, run, &jobs[i])) {
+      fprintf(stderr, "Error starting job %d\n", i);
+      return EXIT_FAILURE;
+    }
+  }
+  for (i = 0; i < NJOBS; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  if (cg_counter_phases()) {
+    fprintf(stderr, "The default generator was made counter-based\n");
+    success = EXIT_FAILURE;
+  }
+
+  for (i = 0; i < NJOBS; i++) {
+    cg_field * expected;
+    long int len;
+    seed_random_number_generator(jobs[i].seed);
+    expected = generate(&jobs[i], NULL);
+    if (jobs[i].field == NULL || expected == NULL) {
+      fprintf(stderr, "Error creating the fields of job %d\n", i);
+      return EXIT_FAILURE;
+    }
+    if (cg_field_counter_phases(jobs[i].field) != jobs[i].counter) {
+      fprintf(stderr, "Job %d used the wrong generator\n", i);
+      success = EXIT_FAILURE;
+    }
+    len = 2L * (jobs[i].nx / 2 + 1) * jobs[i].ny * jobs[i].nz;
+    for (n = 0; n < len; n++) {
+      if (jobs[i].field->field[0][n] != expected->field[0][n]) {
+        fprintf(stderr, "Job %d differs at %d: %g, expected %g\n",
+                i, n, jobs[i].field->field[0][n], expected->field[0][n]);
+        success = EXIT_FAILURE;
+        break;
+      }
+    }
+    cg_delete_field(expected);
+    cg_delete_field(jobs[i].field);
+    delete_random_state(jobs[i].state);
+  }
+  return success;
+}
@@ -0,0 +1,96 @@
+// Copyright 2022 Keith F. Prussing
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "cloudgen.h"  // NOLINT(build/include_subdir)
+#include "random.h"  // NOLINT(build/include_subdir)
+
+/* Check that the fused output pass gives the same values as scaling,
+   converting to a lognormal distribution and thresholding in
+   separate passes, and that the layers can then be joined, all at
+   once or a few at a time. */
+int main(void) {
+  int success = EXIT_SUCCESS;
+  int i, j, k, n, nx = 16, ny = 12, nz = 6;
+  real std[6] = {0.5, 1.0, 1.5, 2.0, 2.5, 3.0};
+  real mean[6] = {1.0, 2.0, 3.0, 4.0, 5.0, 6.0};
+  cg_output output;
+  cg_field * fields[3];
+
+  for (n = 0; n < 3; n++) {
+    fields[n] = cg_new_multi_field(nx, ny, nz, 100.0, 100.0, 50.0,
+                                   0.0, 0.0, 0.0, 2);
+    cg_spectrum * law = fields[n] ?
+        cg_new_power_law_spectrum(fields[n], 1000.0, -2.0, 0.0) : NULL;
+    if (law == NULL) {
+      fprintf(stderr, "Error creating the fields\n");
+      return EXIT_FAILURE;
+    }
+    seed_random_number_generator(1);
+    cg_correlated_spectra(fields[n], 0, 1, 0.5, law, law);
+    cg_generate_fractal(fields[n]);
+    cg_delete_spectrum(law);
+  }
+
+  cg_scale_layers(fields[0], 0, std, mean);
+  cg_lognormal_layers(fields[0], 1, std, mean);
+  cg_threshold(fields[0], 0, 2.0, -1.0);
+
+  output.transform[0] = CG_OUTPUT_SCALE;
+  output.transform[1] = CG_OUTPUT_LOGNORMAL;
+  for (n = 0; n < 2; n++) {
+    output.std[n] = std;
+    output.mean[n] = mean;
+    output.power[n] = NULL;
+  }
+  output.threshold_var = 0;
+  output.threshold = 2.0;
+  output.missing_value = -1.0;
+  cg_finish_output(fields[1], &output);
+  cg_finish_join_layers(fields[2], &output, 0, 4);
+  cg_finish_join_layers(fields[2], &output, 4, nz);
+
+  for (n = 0; n < 2; n++) {
+    for (k = 0; k < nz; k++) {
+      real * layer = cg_output_layer(fields[1], n, k);
+      for (j = 0; j < ny; j++) {
+        for (i = 0; i < nx; i++) {
+          real expected = fields[0]->field[n][i + (nx + 2) * (j + ny * k)];
+          if (layer[i + nx * j] != expected) {
+            fprintf(stderr, "Variable %d differs at (%d,%d,%d)\n",
+                    n, i, j, k);
+            success = EXIT_FAILURE;
+          }
+        }
+      }
+    }
+  }
+
+  /* The joined layers are contiguous */
+  cg_join_layers(fields[1]);
+  for (n = 0; n < 2; n++) {
+    for (k = 0; k < nz; k++) {
+      for (j = 0; j < ny; j++) {
+        for (i = 0; i < nx; i++) {
+          real expected = fields[0]->field[n][i + (nx + 2) * (j + ny * k)];
+          if (fields[1]->field[n][i + nx * (j + ny * k)] != expected) {
+            fprintf(stderr, "Joined variable %d differs at (%d,%d,%d)\n",
+                    n, i, j, k);
+            success = EXIT_FAILURE;
+          }
+          if (fields[2]->field[n][i + nx * (j + ny * k)] != expected) {
+            fprintf(stderr,
+                    "Variable %d joined in batches differs at (%d,%d,%d)\n",
+                    n, i, j, k);
+            success = EXIT_FAILURE;
+          }
+        }
+      }
+    }
+  }
+
+  cg_delete_field(fields[0]);
+  cg_delete_field(fields[1]);
+  cg_delete_field(fields[2]);
+  return success;
+}
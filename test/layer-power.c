@@ -0,0 +1,73 @@
+// Copyright 2022 Keith F. Prussing
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "cloudgen.h"  // NOLINT(build/include_subdir)
+#include "random.h"  // NOLINT(build/include_subdir)
+
+/* Check that the mean square of each layer found from its spectrum
+   agrees with that of the layer in real space, including after
+   translations by fractions of a pixel, which leave the kx=nx/2
+   column non-Hermitian. */
+static int check(int nx, int ny, int nz) {
+  int success = EXIT_SUCCESS;
+  int i, j, k;
+  cg_field * field = cg_new_field(nx, ny, nz, 100.0, 100.0, 50.0,
+                                  0.0, 0.0, 0.0);
+  cg_spectrum * law = field ? cg_new_power_law_spectrum(field, 1000.0,
+                                                        -2.0, 0.0) : NULL;
+  real * deltax = malloc(nz * sizeof(real));
+  real * deltay = malloc(nz * sizeof(real));
+  double * power = malloc(nz * sizeof(double));
+  if (field == NULL || law == NULL || !deltax || !deltay || !power) {
+    fprintf(stderr, "Error creating the field\n");
+    return EXIT_FAILURE;
+  }
+  for (k = 0; k < nz; k++) {
+    deltax[k] = 37.0 * k;
+    deltay[k] = -61.0 * k;
+  }
+
+  seed_random_number_generator(1);
+  cg_random_spectrum(field, 0, law);
+  cg_generate_fractal(field);
+  cg_transform_layers(field);
+  cg_translate_layers(field, deltax, deltay);
+  cg_layer_powers(field, 0, power);
+  cg_revert_layers(field);
+
+  for (k = 0; k < nz; k++) {
+    double sum2 = 0.0;
+    for (j = 0; j < ny; j++) {
+      for (i = 0; i < nx; i++) {
+        real value = field->field[0][i + (nx + 2) * (j + ny * k)];
+        sum2 += value * value;
+      }
+    }
+    sum2 /= nx * ny;
+    if (fabs(power[k] - sum2) > 1.0e-4 * sum2) {
+      fprintf(stderr, "%dx%d layer %d has power %g, expected %g\n",
+              nx, ny, k, power[k], sum2);
+      success = EXIT_FAILURE;
+    }
+  }
+
+  cg_delete_spectrum(law);
+  cg_delete_field(field);
+  free(deltax);
+  free(deltay);
+  free(power);
+  return success;
+}
+
+int main(void) {
+  int success = EXIT_SUCCESS;
+  if (check(16, 12, 6) != EXIT_SUCCESS) {
+    success = EXIT_FAILURE;
+  }
+  if (check(8, 9, 5) != EXIT_SUCCESS) {
+    success = EXIT_FAILURE;
+  }
+  return success;
+}
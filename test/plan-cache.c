@@ -0,0 +1,50 @@
+// Copyright 2022 Keith F. Prussing
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "cloudgen.h"  // NOLINT(build/include_subdir)
+
+/* Check that fields of the same shape share their Fourier transform
+   plans and that the plans survive the deletion of one of them. */
+int main(void) {
+  int success = EXIT_SUCCESS;
+
+  cg_field * first = cg_new_multi_field(16, 16, 8, 1.0, 1.0, 1.0,
+                                        0.0, 0.0, 0.0, 2);
+  cg_field * second = cg_new_field(16, 16, 8, 1.0, 1.0, 1.0,
+                                   0.0, 0.0, 0.0);
+  cg_field * other = cg_new_field(16, 16, 4, 1.0, 1.0, 1.0,
+                                  0.0, 0.0, 0.0);
+  if (first == NULL || second == NULL || other == NULL) {
+    fprintf(stderr, "Error creating the fields\n");
+    return EXIT_FAILURE;
+  }
+
+  if (first->fft_plan != second->fft_plan ||
+      first->fft_plan_2d_1 != second->fft_plan_2d_1 ||
+      first->fft_plan_2d_2 != second->fft_plan_2d_2) {
+    fprintf(stderr, "Fields of the same shape do not share plans\n");
+    success = EXIT_FAILURE;
+  }
+  if (first->fft_plan == other->fft_plan) {
+    fprintf(stderr, "Fields of different shapes share plans\n");
+    success = EXIT_FAILURE;
+  }
+
+  /* The remaining field must still be able to run its transforms. */
+  cg_delete_field(first);
+  cg_unity_phase(second, 0);
+  cg_generate_fractal(second);
+
+  cg_field * third = cg_new_field(16, 16, 8, 1.0, 1.0, 1.0,
+                                  0.0, 0.0, 0.0);
+  if (third == NULL || third->fft_plan != second->fft_plan) {
+    fprintf(stderr, "Cached plans were not reused\n");
+    success = EXIT_FAILURE;
+  }
+
+  cg_delete_field(second);
+  cg_delete_field(third);
+  cg_delete_field(other);
+  return success;
+}
@@ -0,0 +1,172 @@
+// Copyright 2022 Keith F. Prussing
+#include <float.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cloudgen.h"  // NOLINT(build/include_subdir)
+
+#define LENGTH 1003
+
+/* Check that every instruction set supported by the processor gives
+   the same bits as the plain C kernels, including the exponential
+   and the Gaussian deviates. */
+static void fill(real * data, long n, unsigned int seed) {
+  long i;
+  srand(seed);
+  for (i = 0; i < n; i++) {
+    data[i] = (real) rand() / RAND_MAX * 4.0 - 2.0;
+  }
+}
+
+/* Fill data with uniform deviates in (0,1] */
+static void fill_uniform(real * data, long n, unsigned int seed) {
+  long i;
+  srand(seed);
+  for (i = 0; i < n; i++) {
+    data[i] = ((real) rand() + 1) / ((real) RAND_MAX + 1);
+  }
+}
+
+/* Check that the vectorised exponential is within 1.5 ulp of the
+   exponential computed with the C library in long double, at n
+   evenly spaced points from lo to hi. */
+static int check_exp_range(real lo, real hi, long n) {
+  static real x[LENGTH * LENGTH / 8], y[LENGTH * LENGTH / 8];
+  int success = EXIT_SUCCESS;
+  long i;
+  for (i = 0; i < n; i++) {
+    x[i] = y[i] = lo + (hi - lo) * i / (n - 1);
+  }
+  cg_exp_values(y, n);
+  for (i = 0; i < n; i++) {
+    long double expected = expl(x[i]);
+    real rounded = (real) expected;
+    long double ulp = sizeof(real) == sizeof(float)
+        ? (double) nextafterf(rounded, INFINITY) - rounded
+        : nextafter(rounded, INFINITY) - rounded;
+    if (fabsl(y[i] - expected) > 1.5 * ulp) {
+      fprintf(stderr, "exp(%.17g) is %.17g, expected %.17g\n",
+              (double) x[i], (double) y[i], (double) expected);
+      success = EXIT_FAILURE;
+      break;
+    }
+  }
+  return success;
+}
+
+/* Check the exponential over the range of normal results, densely
+   near the smallest ones, with the documented limits at either
+   end. */
+static int check_exp(void) {
+  real lo = sizeof(real) == sizeof(float) ? -86.5 : -708.0;
+  real hi = sizeof(real) == sizeof(float) ? 88.5 : 709.5;
+  real low_end = sizeof(real) == sizeof(float) ? -80.0 : -690.0;
+  real y[2];
+  int success = EXIT_SUCCESS;
+  if (check_exp_range(lo, hi, LENGTH) != EXIT_SUCCESS
+      || check_exp_range(lo, low_end, LENGTH * LENGTH / 8)
+      != EXIT_SUCCESS) {
+    success = EXIT_FAILURE;
+  }
+  y[0] = 2 * hi;
+  y[1] = 2 * lo;
+  cg_exp_values(y, 2);
+  if (!isinf(y[0]) || y[1] != 0.0) {
+    fprintf(stderr, "exp() does not overflow to infinity and zero\n");
+    success = EXIT_FAILURE;
+  }
+  return success;
+}
+
+/* Check that the Gaussian deviates are within 4 ulp of their
+   magnitude of those computed with the C library in long double,
+   including at either end of the range of uniform deviates. */
+static int check_gaussian(void) {
+  static real u[LENGTH * LENGTH / 8], v[LENGTH * LENGTH / 8];
+  static real x[LENGTH * LENGTH / 8], y[LENGTH * LENGTH / 8];
+  const long n = LENGTH * LENGTH / 8;
+  const long double two_pi = 6.28318530717958647692528676655900577L;
+  int success = EXIT_SUCCESS;
+  long i;
+  fill_uniform(u, n, 5);
+  fill_uniform(v, n, 6);
+  for (i = 0; i < n; i++) {
+    v[i] -= v[i] == 1.0 ? 1.0 : 0.0;
+  }
+  u[0] = 1.0;
+  u[1] = sizeof(real) == sizeof(float) ? FLT_MIN : DBL_MIN;
+  v[2] = 0.0;
+  v[3] = 1.0 - (sizeof(real) == sizeof(float) ? 6.0e-8 : 1.2e-16);
+  memcpy(x, u, sizeof(x));
+  memcpy(y, v, sizeof(y));
+  cg_gaussian_values(x, y, n);
+  for (i = 0; i < n; i++) {
+    long double r = sqrtl(-2.0L * logl(u[i]));
+    real rounded = (real) r;
+    double ulp = sizeof(real) == sizeof(float)
+        ? (double) nextafterf(rounded, INFINITY) - rounded
+        : nextafter(rounded, INFINITY) - rounded;
+    long double cs = r * cosl(two_pi * v[i]);
+    long double sn = r * sinl(two_pi * v[i]);
+    if (fabsl(x[i] - cs) > 4.0 * ulp || fabsl(y[i] - sn) > 4.0 * ulp) {
+      fprintf(stderr, "Box-Muller of (%.9g, %.9g) is (%.9g, %.9g), "
+              "expected (%.9g, %.9g)\n", (double) u[i], (double) v[i],
+              (double) x[i], (double) y[i], (double) cs, (double) sn);
+      success = EXIT_FAILURE;
+      break;
+    }
+  }
+  return success;
+}
+
+int main(void) {
+  const char * names[] = {"sse2", "avx2", "avx512"};
+  static real expected[4][2 * LENGTH], actual[4][2 * LENGTH];
+  static real factor[2 * LENGTH];
+  int success = EXIT_SUCCESS;
+  int isa, v;
+
+  cg_select_libm_exp(0);
+  for (isa = -1; isa < 3; isa++) {
+    real (*out)[2 * LENGTH] = isa < 0 ? expected : actual;
+    real * rows[3];
+    double sum;
+    if (!cg_select_simd(isa < 0 ? "generic" : names[isa])) {
+      printf("%s is not supported\n", names[isa]);
+      continue;
+    }
+    for (v = 0; v < 3; v++) {
+      fill(out[v], 2 * LENGTH, v + 1);
+      rows[v] = out[v];
+    }
+    fill_uniform(out[3], 2 * LENGTH, 4);
+    fill(factor, 2 * LENGTH, 4);
+    sum = cg_sum_squares(out[0], LENGTH);
+    cg_scale_values(out[0], LENGTH, 1.5, -0.25);
+    cg_multiply_values(out[0] + 1, factor, LENGTH);
+    cg_multiply_complex_values((complex *) out[1], (complex *) factor,
+                               LENGTH);
+    cg_lognormal_values(out[2], LENGTH, 0.7, 1.0e-3);
+    cg_threshold_values(rows, 3, 0, LENGTH, 0.0, -999.0);
+    cg_gaussian_values(out[3], out[3] + LENGTH, LENGTH - 1);
+    out[0][2 * LENGTH - 1] = (real) sum;
+    if (isa < 0) {
+      continue;
+    }
+    if (memcmp(expected, actual, sizeof(expected)) != 0) {
+      fprintf(stderr, "The %s kernels differ from the generic ones\n",
+              names[isa]);
+      success = EXIT_FAILURE;
+    }
+  }
+  for (isa = -1; isa < 3; isa++) {
+    if (cg_select_simd(isa < 0 ? "generic" : names[isa])
+        && (check_exp() != EXIT_SUCCESS
+            || check_gaussian() != EXIT_SUCCESS)) {
+      success = EXIT_FAILURE;
+    }
+  }
+  return success;
+}
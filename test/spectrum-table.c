@@ -0,0 +1,126 @@
+// Copyright 2022 Keith F. Prussing
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "cloudgen.h"  // NOLINT(build/include_subdir)
+#include "random.h"  // NOLINT(build/include_subdir)
+
+/* Check that variable 0 of field holds the amplitudes of spectrum,
+   evaluated for every component, with a zero mean */
+static int check_amplitudes(cg_field * field, const cg_spectrum * spectrum) {
+  int success = EXIT_SUCCESS;
+  int i, j, k, nx = field->nx, ny = field->ny;
+  for (k = 0; k < field->nz; k++) {
+    for (j = 0; j < ny; j++) {
+      for (i = 0; i < nx / 2 + 1; i++) {
+        real kk = field->kx[i] * field->kx[i] + field->ky[j] * field->ky[j]
+            + field->kz[k] * field->kz[k];
+        real expected = (i + j + k) ? cg_spectrum_amplitude(spectrum, kk)
+            : 0.0;
+        complex value = field->p[0][i + (nx / 2 + 1) * (j + ny * k)];
+        if (creal(value) != expected || cimag(value) != 0.0) {
+          fprintf(stderr, "Amplitude at (%d,%d,%d) is %g, expected %g\n",
+                  i, j, k, (double) creal(value), (double) expected);
+          success = EXIT_FAILURE;
+        }
+      }
+    }
+  }
+  return success;
+}
+
+/* Check that the spectrum applied from the table of distinct
+   wavenumbers matches the amplitude evaluated for every Fourier
+   component, also when the amplitudes kept from one spectrum must be
+   replaced by those of another, that the fused synthesis matches the
+   separate passes, and that a tabulated power law is reproduced
+   exactly. */
+int main(void) {
+  int success = EXIT_SUCCESS;
+  int i, nx = 16, ny = 16, nz = 8;
+
+  cg_field * field = cg_new_field(nx, ny, nz, 100.0, 100.0, 50.0,
+                                  0.0, 0.0, 0.0);
+  cg_spectrum * law = field ? cg_new_power_law_spectrum(field, 1000.0,
+                                                        -2.0, 0.0) : NULL;
+  cg_spectrum * steeper = field ? cg_new_power_law_spectrum(field, 1000.0,
+                                                            -3.0, 0.0) : NULL;
+  if (field == NULL || law == NULL || steeper == NULL) {
+    fprintf(stderr, "Error creating the field\n");
+    return EXIT_FAILURE;
+  }
+
+  cg_unity_phase(field, 0);
+  cg_apply_spectrum(field, 0, law);
+  if (check_amplitudes(field, law) != EXIT_SUCCESS) {
+    success = EXIT_FAILURE;
+  }
+  cg_unity_phase(field, 0);
+  cg_apply_spectrum(field, 0, steeper);
+  if (check_amplitudes(field, steeper) != EXIT_SUCCESS) {
+    success = EXIT_FAILURE;
+  }
+  cg_delete_spectrum(steeper);
+
+  /* Random phases and correlated phases in one pass */
+  cg_field * fused = cg_new_multi_field(nx, ny, nz, 100.0, 100.0, 50.0,
+                                        0.0, 0.0, 0.0, 2);
+  cg_field * separate = cg_new_multi_field(nx, ny, nz, 100.0, 100.0, 50.0,
+                                           0.0, 0.0, 0.0, 2);
+  if (fused == NULL || separate == NULL) {
+    fprintf(stderr, "Error creating the fields\n");
+    return EXIT_FAILURE;
+  }
+  seed_random_number_generator(1);
+  cg_random_phase(separate, 0);
+  cg_correlated_phase(separate, 1, 0, 0.5);
+  cg_apply_spectrum(separate, 0, law);
+  cg_apply_spectrum(separate, 1, law);
+  seed_random_number_generator(1);
+  if (!cg_correlated_spectra(fused, 0, 1, 0.5, law, law)) {
+    fprintf(stderr, "Error generating the fused spectra\n");
+    return EXIT_FAILURE;
+  }
+  for (i = 0; i < (nx / 2 + 1) * ny * nz; i++) {
+    if (fused->p[0][i] != separate->p[0][i]
+        || fused->p[1][i] != separate->p[1][i]) {
+      fprintf(stderr, "Fused spectra differ at %d\n", i);
+      success = EXIT_FAILURE;
+      break;
+    }
+  }
+  cg_delete_field(fused);
+  cg_delete_field(separate);
+
+  /* An energy density falling as k^-2 gives an amplitude of 1e-4/k,
+     inside and beyond the table. */
+  real wavenumber[] = {0.01, 0.1};
+  real energy[] = {1.0e-4, 1.0e-6};
+  cg_spectrum * table = cg_new_tabulated_spectrum(2, wavenumber, energy);
+  if (table == NULL) {
+    fprintf(stderr, "Error creating the tabulated spectrum\n");
+    return EXIT_FAILURE;
+  }
+  for (i = 0; i < 5; i++) {
+    real kk = 1.0e-5 * pow(10.0, i);
+    real expected = 1.0e-2 * 0.01 / sqrt(kk);
+    if (fabs(cg_spectrum_amplitude(table, kk) - expected) > 1.0e-6 * expected) {
+      fprintf(stderr, "Tabulated amplitude at kk=%g is %g, expected %g\n",
+              (double) kk, (double) cg_spectrum_amplitude(table, kk),
+              (double) expected);
+      success = EXIT_FAILURE;
+    }
+  }
+
+  energy[1] = -1.0;
+  if (cg_new_tabulated_spectrum(2, wavenumber, energy) != NULL) {
+    fprintf(stderr, "Negative energies were accepted\n");
+    success = EXIT_FAILURE;
+  }
+
+  cg_delete_spectrum(law);
+  cg_delete_spectrum(table);
+  cg_delete_field(field);
+  return success;
+}